@@ -0,0 +1,698 @@
+/* 
+ * MVisor
+ * Copyright (C) 2022 Terrence <terrence@tenclass.com>
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/* Disk image benchmark
+ * Opens an image through DiskImage::Create without a guest and keeps a fixed
+ * number of requests in flight, like fio with iodepth, to measure how IOPS
+ * scale with queue depth and worker threads. The host page cache used by the
+ * image and the process RSS are printed to compare cache modes.
+ * Mixed read/write, batched submission through QueueMultipleIoRequests,
+ * backing chains and compressed images are covered so that changes to the
+ * image engine can be measured in CI with meson benchmark.
+ */
+
+#include <cstdio>
+#include <cstring>
+#include <algorithm>
+#include <string>
+#include <thread>
+#include <random>
+#include <atomic>
+#include <future>
+#include <getopt.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+
+#include "disk_image.h"
+#include "device.h"
+#include "machine.h"
+#include "qcow2.h"
+#include "logger.h"
+
+static std::string  image_path;
+static std::string  format = "raw";
+static std::string  pattern = "randread";
+static size_t       rwmixread = 50;
+static size_t       batch_size = 1;
+static bool         compressed = false;
+static std::string  cache = "writeback";
+static uint64_t     l2_cache_size = 0;
+static bool         populate = false;
+static Qcow2Preallocation preallocation = kPreallocationOff;
+static size_t       fsync_interval = 0;
+static bool         lazy_refcounts = false;
+static uint64_t     image_size = 1UL << 30;
+static size_t       block_size = 4096;
+static std::vector<size_t> block_sizes = { 4096 };
+static std::vector<std::pair<std::string, uint64_t>> throttle_limits;
+static size_t       chain_depth = 0;
+static bool         commit_chain = false;
+static std::vector<std::string> chain_paths;
+static uint64_t     workers = 1;
+static double       runtime = 5;
+static std::vector<size_t> queue_depths = { 1, 2, 4, 8, 16, 32, 64 };
+
+static void PrintHelp() {
+  printf("Usage: disk-benchmark [option]\n");
+  printf("Options\n");
+  printf("  -i, --image           Image file path, WRITE PATTERNS MODIFY IT (default a temporary image in cwd).\n");
+  printf("  -f, --format          Format of the temporary image raw|qcow2 (default raw).\n");
+  printf("  -s, --size            Size of the temporary image in MB (default 1024).\n");
+  printf("  -r, --rw              Pattern read|write|rw|randread|randwrite|randrw (default randread).\n");
+  printf("  -M, --rwmixread       Percentage of reads for rw and randrw (default 50).\n");
+  printf("  -b, --bs              Comma separated block sizes in bytes, used in turn (default 4096).\n");
+  printf("  -q, --iodepth         Comma separated queue depths (default 1,2,4,8,16,32,64).\n");
+  printf("  -B, --batch           Submit N requests at a time with QueueMultipleIoRequests (default 1).\n");
+  printf("  -w, --workers         Worker threads of the image (default 1).\n");
+  printf("  -c, --cache           Cache mode none|writeback|unsafe (default writeback).\n");
+  printf("  -l, --l2-cache        Qcow2 L2 cache size in MB (default 128 clusters).\n");
+  printf("  -p, --populate        Allocate every qcow2 L2 table of the temporary image before running.\n");
+  printf("  -a, --preallocation   Preallocate the temporary qcow2 image off|metadata|falloc (default off).\n");
+  printf("  -y, --fsync           Flush after every N writes, like a database (default 0, never).\n");
+  printf("  -z, --lazy-refcounts  Enable qcow2 lazy refcounts, flushes skip refcount blocks.\n");
+  printf("  -C, --compressed      Run on a compressed qcow2 copy of the filled temporary image.\n");
+  printf("  -d, --chain           Put N qcow2 overlays above the temporary image, each with some clusters.\n");
+  printf("  -m, --commit          Merge the overlays down to one backing file before running.\n");
+  printf("  -T, --throttle        Throttle limits, e.g. write_iops=1000,write_bps=10485760.\n");
+  printf("  -t, --runtime         Seconds for each queue depth (default 5).\n");
+  printf("  -h, --help            Display this information.\n");
+}
+
+static struct option long_options[] = {
+  {"image", required_argument, 0, 'i'},
+  {"format", required_argument, 0, 'f'},
+  {"size", required_argument, 0, 's'},
+  {"rw", required_argument, 0, 'r'},
+  {"rwmixread", required_argument, 0, 'M'},
+  {"bs", required_argument, 0, 'b'},
+  {"iodepth", required_argument, 0, 'q'},
+  {"batch", required_argument, 0, 'B'},
+  {"workers", required_argument, 0, 'w'},
+  {"cache", required_argument, 0, 'c'},
+  {"l2-cache", required_argument, 0, 'l'},
+  {"populate", no_argument, 0, 'p'},
+  {"preallocation", required_argument, 0, 'a'},
+  {"fsync", required_argument, 0, 'y'},
+  {"lazy-refcounts", no_argument, 0, 'z'},
+  {"compressed", no_argument, 0, 'C'},
+  {"chain", required_argument, 0, 'd'},
+  {"commit", no_argument, 0, 'm'},
+  {"throttle", required_argument, 0, 'T'},
+  {"runtime", required_argument, 0, 't'},
+  {"help", no_argument, 0, 'h'},
+  {NULL, 0, 0, 0}
+};
+
+static std::string JoinSizes(const std::vector<size_t>& sizes) {
+  std::string result;
+  for (auto size : sizes) {
+    result += (result.empty() ? "" : ",") + std::to_string(size);
+  }
+  return result;
+}
+
+/* Keeps queue_depth requests, or batches of requests, in flight until stopped */
+class DiskBenchmark {
+ public:
+  DiskBenchmark(DiskImage* image, size_t queue_depth) : image_(image), queue_depth_(queue_depth) {
+    auto info = image_->information();
+    blocks_ = info.block_size * info.total_blocks / block_size;
+    MV_ASSERT(blocks_ > 0);
+    for (size_t i = 0; i < queue_depth_ * batch_size; i++) {
+      buffers_.push_back((uint8_t*)aligned_alloc(4096, ALIGN(block_size, 4096)));
+      memset(buffers_.back(), 0x5A, block_size);
+    }
+    submit_times_.resize(queue_depth_);
+    latencies_.resize(queue_depth_);
+  }
+
+  ~DiskBenchmark() {
+    for (auto buffer : buffers_) {
+      free(buffer);
+    }
+  }
+
+  void Run() {
+    auto start_time = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < queue_depth_; i++) {
+      Submit(i);
+    }
+    std::this_thread::sleep_for(std::chrono::duration<double>(runtime));
+
+    stopped_ = true;
+    while (inflight_ > 0) {
+      std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    seconds_ = std::chrono::duration<double>(std::chrono::steady_clock::now() - start_time).count();
+  }
+
+  void PrintResult() {
+    printf("rw=%s bs=%s iodepth=%lu workers=%lu cache=%s iops=%.0f bw=%.1fMB/s errors=%lu", pattern.c_str(),
+      JoinSizes(block_sizes).c_str(), queue_depth_, workers, cache.c_str(), completed_ / seconds_,
+      bytes_ / seconds_ / (1 << 20), errors_.load());
+    if (IsMixed()) {
+      printf(" reads=%lu writes=%lu", completed_ - written_, written_.load());
+    }
+    if (batch_size > 1) {
+      printf(" batch=%lu", batch_size);
+    }
+    if (fsync_interval) {
+      printf(" fsync=%lu flushes/s=%.0f", fsync_interval, flushes_ / seconds_);
+    }
+    printf("\n");
+    PrintLatency();
+
+    /* Compare the limits of this pattern with the measured rates, the first
+     * burst is included so short runs measure a little above the limit */
+    bool is_write = pattern.find("read") == std::string::npos;
+    for (auto &limit : throttle_limits) {
+      auto& key = limit.first;
+      if (IsMixed() || key.find("_burst") != std::string::npos || (key.find("write") == 0) != is_write) {
+        continue;
+      }
+      double measured = (key.find("_iops") != std::string::npos ? completed_ : bytes_) / seconds_;
+      printf("  %s limit=%lu measured=%.0f (%.1f%%)\n", key.c_str(), limit.second, measured,
+        measured * 100 / limit.second);
+    }
+  }
+
+ private:
+  DiskImage*            image_;
+  size_t                queue_depth_;
+  size_t                blocks_;
+  std::vector<uint8_t*> buffers_;
+  std::atomic<bool>     stopped_ = false;
+  std::atomic<size_t>   inflight_ = 0;
+  std::atomic<size_t>   completed_ = 0;
+  std::atomic<size_t>   written_ = 0;
+  std::atomic<size_t>   bytes_ = 0;
+  std::atomic<size_t>   submitted_ = 0;
+  std::atomic<size_t>   errors_ = 0;
+  std::atomic<size_t>   next_block_ = 0;
+  std::atomic<size_t>   writes_ = 0;
+  std::atomic<size_t>   flushes_ = 0;
+  double                seconds_ = 0;
+  /* Each slot has one request or batch in flight, so slots are not locked */
+  std::vector<std::chrono::steady_clock::time_point> submit_times_;
+  std::vector<std::vector<uint64_t>> latencies_;
+
+  static bool IsMixed() {
+    return pattern == "rw" || pattern == "randrw";
+  }
+
+  static std::mt19937_64& Generator() {
+    thread_local std::mt19937_64 generator(std::random_device{}());
+    return generator;
+  }
+
+  size_t NextBlock() {
+    if (pattern.find("rand") == 0) {
+      return Generator()() % blocks_;
+    }
+    return next_block_++ % blocks_;
+  }
+
+  bool NextIsWrite() {
+    if (IsMixed()) {
+      return Generator()() % 100 >= rwmixread;
+    }
+    return pattern.find("read") == std::string::npos;
+  }
+
+  /* Completion latency of each request or batch in nanoseconds, sorted when printing */
+  void PrintLatency() {
+    std::vector<uint64_t> all;
+    for (auto &slot : latencies_) {
+      all.insert(all.end(), slot.begin(), slot.end());
+    }
+    if (all.empty()) {
+      return;
+    }
+    std::sort(all.begin(), all.end());
+    auto percentile = [&all](double percent) {
+      return all[std::min(all.size() - 1, (size_t)(all.size() * percent / 100))] / 1e3;
+    };
+    uint64_t total = 0;
+    for (auto latency : all) {
+      total += latency;
+    }
+    printf("  lat(us) avg=%.1f p50=%.1f p90=%.1f p99=%.1f p99.9=%.1f max=%.1f\n", total / 1e3 / all.size(),
+      percentile(50), percentile(90), percentile(99), percentile(99.9), all.back() / 1e3);
+  }
+
+  void Complete(size_t slot, size_t requests, size_t writes, size_t bytes, bool failed) {
+    auto latency = std::chrono::steady_clock::now() - submit_times_[slot];
+    latencies_[slot].push_back(std::chrono::duration_cast<std::chrono::nanoseconds>(latency).count());
+    if (failed) {
+      errors_++;
+    }
+    completed_ += requests;
+    written_ += writes;
+    bytes_ += bytes;
+    if (!stopped_) {
+      Submit(slot);
+    }
+    inflight_--;
+  }
+
+  /* Every fsync_interval writes, the slot sends a flush instead */
+  void SubmitFlush(size_t slot) {
+    ImageIoRequest request = { .type = kImageIoFlush };
+    inflight_++;
+    image_->QueueIoRequest(request, [this, slot](auto ret) {
+      if (ret < 0) {
+        errors_++;
+      }
+      flushes_++;
+      if (!stopped_) {
+        Submit(slot);
+      }
+      inflight_--;
+    });
+  }
+
+  /* Mixed sizes start at multiples of the largest block */
+  ImageIoRequest NextRequest(uint8_t* buffer) {
+    size_t length = block_sizes[submitted_++ % block_sizes.size()];
+    ImageIoRequest request = {
+      .type = NextIsWrite() ? kImageIoWrite : kImageIoRead,
+      .position = NextBlock() * block_size,
+      .length = length
+    };
+    request.vector.push_back(iovec { .iov_base = buffer, .iov_len = length });
+    return request;
+  }
+
+  /* Completions run on the worker threads with the host device locked */
+  void Submit(size_t slot) {
+    if (pattern.find("write") != std::string::npos && fsync_interval &&
+        ++writes_ % (fsync_interval + 1) == 0) {
+      SubmitFlush(slot);
+      return;
+    }
+
+    inflight_++;
+    submit_times_[slot] = std::chrono::steady_clock::now();
+    if (batch_size > 1) {
+      /* A batch runs as one barrier job and completes with the total bytes */
+      std::vector<ImageIoRequest> requests;
+      size_t writes = 0, bytes = 0;
+      for (size_t i = 0; i < batch_size; i++) {
+        requests.push_back(NextRequest(buffers_[slot * batch_size + i]));
+        writes += requests.back().type == kImageIoWrite;
+        bytes += requests.back().length;
+      }
+      image_->QueueMultipleIoRequests(std::move(requests), [this, slot, writes, bytes](auto ret) {
+        Complete(slot, batch_size, writes, bytes, ret != (ssize_t)bytes);
+      });
+      return;
+    }
+
+    auto request = NextRequest(buffers_[slot]);
+    size_t length = request.length;
+    bool is_write = request.type == kImageIoWrite;
+    image_->QueueIoRequest(request, [this, slot, length, is_write](auto ret) {
+      Complete(slot, 1, is_write, length, ret != (ssize_t)length);
+    });
+  }
+};
+
+static std::vector<size_t> ParseSizes(std::string value) {
+  std::vector<size_t> depths;
+  size_t start = 0;
+  while (start < value.size()) {
+    auto end = value.find(',', start);
+    if (end == std::string::npos) {
+      end = value.size();
+    }
+    depths.push_back(std::max(1L, atol(value.substr(start, end - start).c_str())));
+    start = end + 1;
+  }
+  return depths;
+}
+
+/* key=value pairs separated by commas */
+static std::vector<std::pair<std::string, uint64_t>> ParseLimits(std::string value) {
+  std::vector<std::pair<std::string, uint64_t>> limits;
+  size_t start = 0;
+  while (start < value.size()) {
+    auto end = value.find(',', start);
+    if (end == std::string::npos) {
+      end = value.size();
+    }
+    auto item = value.substr(start, end - start);
+    auto equal = item.find('=');
+    if (equal != std::string::npos) {
+      limits.emplace_back(item.substr(0, equal), atoll(item.substr(equal + 1).c_str()));
+    }
+    start = end + 1;
+  }
+  return limits;
+}
+
+/* Bytes of the image file resident in the host page cache */
+static size_t GetPageCacheBytes(const std::string& path) {
+  int fd = open(path.c_str(), O_RDONLY);
+  if (fd < 0) {
+    return 0;
+  }
+  struct stat st;
+  fstat(fd, &st);
+  size_t resident = 0;
+  if (st.st_size > 0) {
+    auto addr = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    if (addr != MAP_FAILED) {
+      size_t pages = (st.st_size + PAGE_SIZE - 1) / PAGE_SIZE;
+      std::vector<uint8_t> vec(pages);
+      if (mincore(addr, st.st_size, vec.data()) == 0) {
+        for (auto v : vec) {
+          resident += (v & 1) ? PAGE_SIZE : 0;
+        }
+      }
+      munmap(addr, st.st_size);
+    }
+  }
+  close(fd);
+  return resident;
+}
+
+/* Start each run with a cold page cache for the image file */
+static void DropPageCache(const std::string& path) {
+  int fd = open(path.c_str(), O_RDONLY);
+  if (fd >= 0) {
+    fdatasync(fd);
+    posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+    close(fd);
+  }
+}
+
+/* Write one block in each 512MB range, so that random reads across a large
+ * image look up an L2 table (64KB clusters) instead of an empty L1 entry */
+static void PopulateL2Tables(DiskImage* image) {
+  const size_t l2_coverage = 512UL << 20;
+  std::vector<uint8_t> buffer(4096, 0x5A);
+  for (size_t position = 0; position < image_size; position += l2_coverage) {
+    ImageIoRequest request = {
+      .type = kImageIoWrite,
+      .position = position,
+      .length = buffer.size()
+    };
+    request.vector.push_back(iovec { .iov_base = buffer.data(), .iov_len = buffer.size() });
+    std::promise<ssize_t> done;
+    image->QueueIoRequest(request, [&done](auto ret) {
+      done.set_value(ret);
+    });
+    MV_ASSERT(done.get_future().get() == (ssize_t)buffer.size());
+  }
+}
+
+/* Level i of the chain has a 4KB block in every (depth + 1)th cluster starting
+ * from cluster i, so most random reads go down to the base image */
+static std::string CreateBackingChain(const std::string& base_path) {
+  const size_t cluster_size = 1 << 16;
+  std::vector<uint8_t> buffer(4096, 0x5A);
+  Device device;
+  device.set_name("disk-benchmark-chain");
+
+  std::string path = base_path;
+  for (size_t level = 0; level <= chain_depth; level++) {
+    if (level > 0) {
+      auto overlay = base_path.substr(0, base_path.size() - 6) + "." + std::to_string(level) + ".qcow2";
+      Qcow2Image::CreateImageWithBackingFile(overlay, path);
+      chain_paths.push_back(overlay);
+      path = overlay;
+    }
+    auto image = DiskImage::Create(&device, &device, path, false, false);
+    for (size_t position = level * cluster_size; position < image_size; position += (chain_depth + 1) * cluster_size) {
+      ImageIoRequest request = {
+        .type = kImageIoWrite,
+        .position = position,
+        .length = buffer.size()
+      };
+      request.vector.push_back(iovec { .iov_base = buffer.data(), .iov_len = buffer.size() });
+      std::promise<ssize_t> done;
+      image->QueueIoRequest(request, [&done](auto ret) {
+        done.set_value(ret);
+      });
+      MV_ASSERT(done.get_future().get() == (ssize_t)buffer.size());
+    }
+    delete image;
+  }
+  return path;
+}
+
+static void CommitBackingChain(DiskImage* image) {
+  auto qcow2 = dynamic_cast<Qcow2Image*>(image);
+  std::atomic<bool> stopped = false;
+  auto start_time = std::chrono::steady_clock::now();
+  while (qcow2->backing_chain_depth() > 1) {
+    MV_ASSERT(qcow2->CommitBackingFile(0, stopped));
+  }
+  printf("commit chain_depth=%lu to 1 in %.2fs\n", chain_depth,
+    std::chrono::duration<double>(std::chrono::steady_clock::now() - start_time).count());
+}
+
+static void PrintCacheStatistics(DiskImage* image) {
+  auto qcow2 = dynamic_cast<Qcow2Image*>(image);
+  if (!qcow2) {
+    return;
+  }
+  Qcow2CacheStatistics l2, refcount, cluster;
+  qcow2->GetCacheStatistics(&l2, &refcount, &cluster);
+  printf("l2_cache hits=%lu misses=%lu evictions=%lu writebacks=%lu\n", l2.hits, l2.misses,
+    l2.evictions, l2.writebacks);
+  printf("refcount_cache hits=%lu misses=%lu evictions=%lu writebacks=%lu\n", refcount.hits, refcount.misses,
+    refcount.evictions, refcount.writebacks);
+}
+
+/* Fill every cluster with text-like data that compresses about 2:1, export
+ * the image compressed and return the path of the compressed copy */
+static std::string CreateCompressedImage(Device* device, const std::string& path) {
+  const size_t cluster_size = 1 << 16;
+  std::vector<uint8_t> buffer(cluster_size);
+  std::mt19937 generator(1);
+  for (auto &byte : buffer) {
+    byte = 'a' + generator() % 16;
+  }
+
+  auto image = DiskImage::Create(device, device, path, false, false);
+  for (size_t position = 0; position < image_size; position += cluster_size) {
+    ImageIoRequest request = {
+      .type = kImageIoWrite,
+      .position = position,
+      .length = buffer.size()
+    };
+    request.vector.push_back(iovec { .iov_base = buffer.data(), .iov_len = buffer.size() });
+    std::promise<ssize_t> done;
+    image->QueueIoRequest(request, [&done](auto ret) {
+      done.set_value(ret);
+    });
+    MV_ASSERT(done.get_future().get() == (ssize_t)buffer.size());
+  }
+
+  auto compressed_path = path.substr(0, path.size() - 6) + ".compressed.qcow2";
+  auto start_time = std::chrono::steady_clock::now();
+  MV_ASSERT(Qcow2Image::ExportCompressedImage(image, compressed_path, std::thread::hardware_concurrency()));
+  delete image;
+
+  struct stat st;
+  stat(compressed_path.c_str(), &st);
+  printf("compressed %luMB to %.1fMB in %.2fs\n", image_size >> 20, st.st_blocks * 512 / 1048576.0,
+    std::chrono::duration<double>(std::chrono::steady_clock::now() - start_time).count());
+  return compressed_path;
+}
+
+/* Created in the current directory, /tmp could be a tmpfs without O_DIRECT */
+static std::string CreateTemporaryImage() {
+  char temp[] = "disk_benchmark_XXXXXX.img";
+  int fd = mkstemps(temp, 4);
+  MV_ASSERT(fd >= 0);
+  std::string path = temp;
+
+  if (format == "qcow2") {
+    close(fd);
+    remove(temp);
+    path = path.substr(0, path.size() - 4) + ".qcow2";
+    Qcow2Image::CreateEmptyImage(path, image_size, kCompressionTypeZlib, false, preallocation);
+  } else {
+    MV_ASSERT(ftruncate(fd, image_size) == 0);
+    close(fd);
+  }
+  return path;
+}
+
+int main(int argc, char* argv[]) {
+  int c, option_index = 0;
+  while ((c = getopt_long_only(argc, argv, "hi:f:s:r:M:b:q:B:w:c:l:pa:y:zCd:mT:t:", long_options, &option_index)) != -1) {
+    switch (c)
+    {
+    case 'i':
+      image_path = optarg;
+      break;
+    case 'f':
+      format = optarg;
+      break;
+    case 's':
+      image_size = atol(optarg) << 20;
+      break;
+    case 'r':
+      pattern = optarg;
+      break;
+    case 'M':
+      rwmixread = std::min(100L, atol(optarg));
+      break;
+    case 'b':
+      block_sizes = ParseSizes(optarg);
+      block_size = *std::max_element(block_sizes.begin(), block_sizes.end());
+      break;
+    case 'q':
+      queue_depths = ParseSizes(optarg);
+      break;
+    case 'B':
+      batch_size = std::max(1L, atol(optarg));
+      break;
+    case 'w':
+      workers = atol(optarg);
+      break;
+    case 'c':
+      cache = optarg;
+      break;
+    case 'l':
+      l2_cache_size = atol(optarg) << 20;
+      break;
+    case 'p':
+      populate = true;
+      break;
+    case 'a':
+      if (strcmp(optarg, "metadata") == 0) {
+        preallocation = kPreallocationMetadata;
+      } else if (strcmp(optarg, "falloc") == 0) {
+        preallocation = kPreallocationFalloc;
+      }
+      break;
+    case 'y':
+      fsync_interval = atol(optarg);
+      break;
+    case 'z':
+      lazy_refcounts = true;
+      break;
+    case 'C':
+      compressed = true;
+      break;
+    case 'd':
+      chain_depth = atol(optarg);
+      break;
+    case 'm':
+      commit_chain = true;
+      break;
+    case 'T':
+      throttle_limits = ParseLimits(optarg);
+      break;
+    case 't':
+      runtime = atof(optarg);
+      break;
+    case 'h':
+    case '?':
+      PrintHelp();
+      return 0;
+    }
+  }
+
+  bool temporary = image_path.empty();
+  if (temporary) {
+    image_path = CreateTemporaryImage();
+  }
+
+  /* Images read keys from the disk object like they do in a machine */
+  Device device;
+  device.set_name("disk-benchmark");
+  device["workers"] = workers;
+  device["cache"] = cache;
+  if (l2_cache_size) {
+    device["l2_cache_size"] = l2_cache_size;
+  }
+  if (lazy_refcounts) {
+    device["lazy_refcounts"] = true;
+  }
+  for (auto &limit : throttle_limits) {
+    device[limit.first] = limit.second;
+  }
+
+  /* The compressed copy replaces the temporary image and becomes the chain base */
+  if (compressed && temporary && format == "qcow2") {
+    auto compressed_path = CreateCompressedImage(&device, image_path);
+    remove(image_path.c_str());
+    image_path = compressed_path;
+  }
+
+  std::string top_path = image_path;
+  if (chain_depth && temporary && format == "qcow2") {
+    top_path = CreateBackingChain(image_path);
+  }
+
+  DropPageCache(image_path);
+  auto image = DiskImage::Create(&device, &device, top_path, false, false);
+  if (populate && temporary) {
+    PopulateL2Tables(image);
+  }
+  if (commit_chain && top_path != image_path) {
+    CommitBackingChain(image);
+  }
+  if (auto qcow2 = dynamic_cast<Qcow2Image*>(image)) {
+    if (qcow2->backing_chain_depth()) {
+      printf("backing_chain_depth=%lu\n", qcow2->backing_chain_depth());
+    }
+  }
+  for (auto depth : queue_depths) {
+    DiskBenchmark benchmark(image, depth);
+    benchmark.Run();
+    benchmark.PrintResult();
+  }
+  PrintCacheStatistics(image);
+  auto statistics = image->statistics();
+  printf("queue_wait avg=%.1fus p50<%luus p99<%luus service avg=%.1fus p50<%luus p99<%luus max_inflight=%lu\n",
+    statistics.queue_wait.total_ns / 1e3 / std::max(1UL, statistics.queue_wait.count),
+    statistics.queue_wait.Percentile(50), statistics.queue_wait.Percentile(99),
+    statistics.service.total_ns / 1e3 / std::max(1UL, statistics.service.count),
+    statistics.service.Percentile(50), statistics.service.Percentile(99), statistics.max_inflight);
+  if (statistics.cow_copies || statistics.backing_reads) {
+    printf("cow_copies=%lu copy_on_read=%lu backing_reads=%lu\n", statistics.cow_copies,
+      statistics.copy_on_read, statistics.backing_reads);
+  }
+  if (statistics.throttled_requests) {
+    printf("throttle held=%lu of %lu requests avg_delay=%.2fms\n", statistics.throttled_requests,
+      statistics.requests, statistics.throttle_delay_ns / 1e6 / statistics.throttled_requests);
+  }
+  delete image;
+
+  struct rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+  printf("cache=%s page_cache=%.1fMB max_rss=%.1fMB\n", cache.c_str(),
+    GetPageCacheBytes(image_path) / 1048576.0, usage.ru_maxrss / 1024.0);
+
+  if (temporary) {
+    remove(image_path.c_str());
+    for (auto &path : chain_paths) {
+      remove(path.c_str());
+    }
+  }
+  return 0;
+}
@@ -0,0 +1,344 @@
+/* 
+ * MVisor
+ * Copyright (C) 2022 Terrence <terrence@tenclass.com>
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/* Localhost migration benchmark
+ * A source and a destination machine run in two processes and migrate over
+ * loopback. Instead of a guest OS, the BIOS is replaced by a tiny firmware that
+ * switches to protected mode and keeps writing one dword per page in a working
+ * set, so the dirty rate is controlled by the working set size and a delay loop.
+ */
+
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <thread>
+#include <filesystem>
+#include <getopt.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+#include "machine.h"
+#include "logger.h"
+
+#define FIRMWARE_SIZE           (64 * 1024)
+#define FIRMWARE_PARAM_BASE     0x6E
+#define FIRMWARE_PARAM_PAGES    0x72
+#define FIRMWARE_PARAM_DELAY    0x76
+#define FIRMWARE_RESET_VECTOR   0xFFF0
+#define WORKING_SET_BASE        (16UL << 20)
+#define LOW_RAM_UPPER_BOUND     (2UL << 30)
+
+/* Mapped at 0xFFFF0000, the reset vector jumps to offset 0
+ *   cli
+ *   lgdtl  %cs:gdt_desc
+ *   mov    %cr0, %eax; or $1, %eax; mov %eax, %cr0
+ *   ljmpl  $0x08, $0xffff0000 + start32
+ * start32:
+ *   mov    $0x10, %ax; mov %ax, %ds; mov %ax, %es; mov %ax, %ss
+ * sweep:
+ *   mov    param_base, %esi
+ *   mov    param_pages, %ecx
+ *   jecxz  idle
+ * page:
+ *   incl   (%esi)
+ *   mov    param_delay, %edx
+ * delay:
+ *   test   %edx, %edx; jz next; pause; dec %edx; jmp delay
+ * next:
+ *   add    $4096, %esi
+ *   loop   page
+ *   jmp    sweep
+ * idle:
+ *   hlt; jmp idle
+ * gdt:         null, flat code, flat data
+ * gdt_desc:    .word 23; .long 0xffff0000 + gdt
+ * param_base, param_pages, param_delay
+ */
+static const uint8_t firmware_code[] = {
+  0xfa, 0x2e, 0x66, 0x0f, 0x01, 0x16, 0x68, 0x00, 0x0f, 0x20, 0xc0, 0x66, 0x83, 0xc8, 0x01, 0x0f,
+  0x22, 0xc0, 0x66, 0xea, 0x1a, 0x00, 0xff, 0xff, 0x08, 0x00, 0x66, 0xb8, 0x10, 0x00, 0x8e, 0xd8,
+  0x8e, 0xc0, 0x8e, 0xd0, 0x8b, 0x35, 0x6e, 0x00, 0xff, 0xff, 0x8b, 0x0d, 0x72, 0x00, 0xff, 0xff,
+  0xe3, 0x1b, 0xff, 0x06, 0x8b, 0x15, 0x76, 0x00, 0xff, 0xff, 0x85, 0xd2, 0x74, 0x05, 0xf3, 0x90,
+  0x4a, 0xeb, 0xf7, 0x81, 0xc6, 0x00, 0x10, 0x00, 0x00, 0xe2, 0xe7, 0xeb, 0xd7, 0xf4, 0xeb, 0xfd,
+  0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0xff, 0xff, 0x00, 0x00, 0x00, 0x9a, 0xcf, 0x00,
+  0xff, 0xff, 0x00, 0x00, 0x00, 0x92, 0xcf, 0x00, 0x17, 0x00, 0x50, 0x00, 0xff, 0xff
+};
+
+/* jmp start16 (IP wraps to 0) */
+static const uint8_t firmware_reset_vector[] = { 0xe9, 0x0d, 0x00 };
+
+/* Sent from the destination process to the source process */
+struct DestinationReport {
+  double  resume_time;
+  double  load_cpu_user;
+  double  load_cpu_system;
+  bool    guest_running;
+};
+
+static std::string  base_config = "../config/q35.yaml";
+static std::string  memory = "2G";
+static uint64_t     working_set_mb = 256;
+static uint32_t     delay_loops = 0;
+static double       warmup_seconds = 1;
+static double       converge_seconds = 0;
+static uint16_t     port = 18000;
+
+static void PrintHelp() {
+  printf("Usage: migration-benchmark [option]\n");
+  printf("Options\n");
+  printf("  -b, --base            Base machine config file path (default ../config/q35.yaml).\n");
+  printf("  -m, --memory          Guest memory size (default 2G).\n");
+  printf("  -w, --working-set     Memory dirtied by the guest in MB, must fit in guest memory (default 256).\n");
+  printf("  -d, --delay           Pause loops between two page writes (default 0).\n");
+  printf("  -u, --warmup          Seconds the guest runs before migration (default 1).\n");
+  printf("  -c, --converge        Seconds between Save and PostSave (default 0).\n");
+  printf("  -p, --port            Loopback port (default 18000).\n");
+  printf("  -h, --help            Display this information.\n");
+}
+
+static struct option long_options[] = {
+  {"base", required_argument, 0, 'b'},
+  {"memory", required_argument, 0, 'm'},
+  {"working-set", required_argument, 0, 'w'},
+  {"delay", required_argument, 0, 'd'},
+  {"warmup", required_argument, 0, 'u'},
+  {"converge", required_argument, 0, 'c'},
+  {"port", required_argument, 0, 'p'},
+  {"help", no_argument, 0, 'h'},
+  {NULL, 0, 0, 0}
+};
+
+static double Now() {
+  timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void GetCpuUsage(double& user, double& system) {
+  rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+  user = usage.ru_utime.tv_sec + usage.ru_utime.tv_usec / 1e6;
+  system = usage.ru_stime.tv_sec + usage.ru_stime.tv_usec / 1e6;
+}
+
+static void Sleep(double seconds) {
+  std::this_thread::sleep_for(std::chrono::duration<double>(seconds));
+}
+
+static std::string CreateFirmware(std::string dir) {
+  std::vector<uint8_t> firmware(FIRMWARE_SIZE, 0);
+  memcpy(firmware.data(), firmware_code, sizeof(firmware_code));
+  memcpy(firmware.data() + FIRMWARE_RESET_VECTOR, firmware_reset_vector, sizeof(firmware_reset_vector));
+
+  uint32_t base = WORKING_SET_BASE;
+  uint32_t pages = (working_set_mb << 20) / PAGE_SIZE;
+  memcpy(firmware.data() + FIRMWARE_PARAM_BASE, &base, sizeof(base));
+  memcpy(firmware.data() + FIRMWARE_PARAM_PAGES, &pages, sizeof(pages));
+  memcpy(firmware.data() + FIRMWARE_PARAM_DELAY, &delay_loops, sizeof(delay_loops));
+
+  auto path = dir + "/firmware.bin";
+  FILE* fp = fopen(path.c_str(), "wb");
+  MV_ASSERT(fp);
+  MV_ASSERT(fwrite(firmware.data(), firmware.size(), 1, fp) == 1);
+  fclose(fp);
+  return path;
+}
+
+static std::string CreateConfig(std::string dir, std::string firmware_path) {
+  auto path = dir + "/configuration.yaml";
+  FILE* fp = fopen(path.c_str(), "w");
+  MV_ASSERT(fp);
+  fprintf(fp, "name: migration benchmark\n");
+  fprintf(fp, "base: %s\n", std::filesystem::absolute(base_config).c_str());
+  fprintf(fp, "machine:\n");
+  fprintf(fp, "  memory: %s\n", memory.c_str());
+  fprintf(fp, "  vcpu: 1\n");
+  fprintf(fp, "  bios: %s\n", firmware_path.c_str());
+  fclose(fp);
+  return path;
+}
+
+/* The guest keeps incrementing the first dword of the working set */
+static bool IsGuestRunning(Machine* machine) {
+  if (working_set_mb == 0) {
+    return true;
+  }
+  auto counter = (volatile uint32_t*)machine->memory_manager()->GuestToHostAddress(WORKING_SET_BASE);
+  uint32_t value = *counter;
+  Sleep(0.2);
+  return *counter != value;
+}
+
+static void RunDestination(std::string config_path, int report_fd) {
+  auto machine = new Machine(config_path, "destination", "");
+
+  /* Tell the source we are about to listen */
+  char ready = 1;
+  MV_ASSERT(write(report_fd, &ready, 1) == 1);
+
+  double user, system, load_user, load_system;
+  GetCpuUsage(user, system);
+  machine->Load(port);
+  GetCpuUsage(load_user, load_system);
+  machine->Resume();
+
+  DestinationReport report = {
+    .resume_time = Now(),
+    .load_cpu_user = load_user - user,
+    .load_cpu_system = load_system - system,
+    .guest_running = IsGuestRunning(machine)
+  };
+  MV_ASSERT(write(report_fd, &report, sizeof(report)) == sizeof(report));
+
+  machine->Quit();
+  delete machine;
+}
+
+static int RunSource(std::string config_path, int report_fd) {
+  auto machine = new Machine(config_path, "source", "");
+  machine->Resume();
+  Sleep(warmup_seconds);
+
+  char ready;
+  MV_ASSERT(read(report_fd, &ready, 1) == 1);
+
+  double user, system;
+  GetCpuUsage(user, system);
+  double start_time = Now();
+
+  /* The destination might not be listening yet */
+  bool saved = false;
+  for (int retry = 0; retry < 50 && !saved; retry++) {
+    saved = machine->Save("127.0.0.1", port);
+    if (!saved) {
+      Sleep(0.1);
+    }
+  }
+  if (!saved) {
+    MV_ERROR("failed to save machine");
+    return 1;
+  }
+  double save_time = Now();
+
+  /* Guest keeps running and dirtying memory before the cut over */
+  for (double waited = 0; waited < converge_seconds; waited += 1) {
+    auto progress = machine->GetMigrationProgress();
+    printf("converging: dirty_pages=%lu dirty_rate=%.0f pages/s predicted_downtime=%.3fs\n",
+      progress.dirty_pages, progress.dirty_rate, progress.downtime);
+    Sleep(std::min(1.0, converge_seconds - waited));
+  }
+
+  auto predicted = machine->GetMigrationProgress();
+  double post_save_time = Now();
+  if (!machine->PostSave()) {
+    MV_ERROR("failed to post-save machine");
+    return 1;
+  }
+  double end_time = Now();
+
+  double end_user, end_system;
+  GetCpuUsage(end_user, end_system);
+  auto progress = machine->GetMigrationProgress();
+
+  DestinationReport report;
+  MV_ASSERT(read(report_fd, &report, sizeof(report)) == sizeof(report));
+
+  printf("working_set=%luMB delay=%u memory=%s\n", working_set_mb, delay_loops, memory.c_str());
+  printf("total_time=%.3fs pre_copy=%.3fs post_save=%.3fs\n", std::max(end_time, report.resume_time) - start_time,
+    save_time - start_time, end_time - post_save_time);
+  printf("downtime=%.3fs predicted=%.3fs\n", report.resume_time - post_save_time, predicted.downtime);
+  printf("bytes=%luMB bandwidth=%.1fMB/s dirty_pages=%lu dirty_rate=%.0f pages/s\n", progress.total_bytes >> 20,
+    progress.bandwidth / (1 << 20), predicted.dirty_pages, predicted.dirty_rate);
+  printf("source_cpu user=%.3fs system=%.3fs\n", end_user - user, end_system - system);
+  printf("destination_cpu user=%.3fs system=%.3fs\n", report.load_cpu_user, report.load_cpu_system);
+  printf("destination_guest_running=%s\n", report.guest_running ? "yes" : "no");
+
+  machine->Quit();
+  delete machine;
+  return report.guest_running ? 0 : 1;
+}
+
+int main(int argc, char* argv[]) {
+  int c, option_index = 0;
+  while ((c = getopt_long_only(argc, argv, "hb:m:w:d:u:c:p:", long_options, &option_index)) != -1) {
+    switch (c)
+    {
+    case 'b':
+      base_config = optarg;
+      break;
+    case 'm':
+      memory = optarg;
+      break;
+    case 'w':
+      working_set_mb = atol(optarg);
+      break;
+    case 'd':
+      delay_loops = atol(optarg);
+      break;
+    case 'u':
+      warmup_seconds = atof(optarg);
+      break;
+    case 'c':
+      converge_seconds = atof(optarg);
+      break;
+    case 'p':
+      port = atoi(optarg);
+      break;
+    case 'h':
+    case '?':
+      PrintHelp();
+      return 0;
+    }
+  }
+
+  if (WORKING_SET_BASE + (working_set_mb << 20) > LOW_RAM_UPPER_BOUND) {
+    fprintf(stderr, "working set must fit in low memory below %luMB\n", LOW_RAM_UPPER_BOUND >> 20);
+    return 1;
+  }
+
+  char temp[] = "/tmp/migration_benchmark_XXXXXX";
+  MV_ASSERT(mkdtemp(temp));
+  std::string dir = temp;
+  auto config_path = CreateConfig(dir, CreateFirmware(dir));
+
+  int fds[2];
+  MV_ASSERT(pipe(fds) == 0);
+
+  int ret = 0;
+  pid_t pid = fork();
+  MV_ASSERT(pid >= 0);
+  if (pid == 0) {
+    SetThreadName("mvisor-dest");
+    close(fds[0]);
+    RunDestination(config_path, fds[1]);
+    _exit(0);
+  } else {
+    SetThreadName("mvisor-source");
+    close(fds[1]);
+    ret = RunSource(config_path, fds[0]);
+    if (ret != 0) {
+      kill(pid, SIGKILL);
+    }
+    waitpid(pid, nullptr, 0);
+  }
+
+  std::filesystem::remove_all(dir);
+  return ret;
+}
@@ -0,0 +1,324 @@
+/* 
+ * MVisor
+ * Copyright (C) 2022 Terrence <terrence@tenclass.com>
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/* Virtqueue benchmark
+ * Measures the host cost of PopQueue and PushQueue with split and packed rings.
+ * A paused machine provides the guest memory, one thread plays the guest driver
+ * and keeps the ring full of virtio-blk like chains (header, data, status), and
+ * another thread plays the device and returns used buffers in batches. The two
+ * threads only talk through the ring, so cache line bouncing is included.
+ * Interrupts are not sent. Needs /dev/kvm.
+ */
+
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <getopt.h>
+#include <linux/virtio_config.h>
+
+#include "machine.h"
+#include "virtio_pci.h"
+#include "logger.h"
+
+#define RING_BASE     (16UL << 20)
+#define BUFFER_BASE   (32UL << 20)
+
+static std::string  base_config = "../config/q35.yaml";
+static std::string  ring = "both";
+static uint16_t     queue_size = 256;
+static uint16_t     chain_length = 3;
+static std::vector<size_t> batch_sizes = { 1, 8, 32 };
+static double       runtime = 2;
+
+static void PrintHelp() {
+  printf("Usage: virtqueue-benchmark [option]\n");
+  printf("Options\n");
+  printf("  -b, --base            Machine config file path (default ../config/q35.yaml).\n");
+  printf("  -r, --ring            Ring layout split|packed|both (default both).\n");
+  printf("  -s, --size            Queue size, a power of 2 for split rings (default 256).\n");
+  printf("  -c, --chain           Descriptors in each request (default 3).\n");
+  printf("  -n, --batch           Comma separated numbers of buffers pushed at a time (default 1,8,32).\n");
+  printf("  -t, --runtime         Seconds for each batch size (default 2).\n");
+  printf("  -h, --help            Display this information.\n");
+}
+
+static struct option long_options[] = {
+  {"base", required_argument, 0, 'b'},
+  {"ring", required_argument, 0, 'r'},
+  {"size", required_argument, 0, 's'},
+  {"chain", required_argument, 0, 'c'},
+  {"batch", required_argument, 0, 'n'},
+  {"runtime", required_argument, 0, 't'},
+  {"help", no_argument, 0, 'h'},
+  {NULL, 0, 0, 0}
+};
+
+/* The device side is a VirtioPci with one queue, the driver side writes the ring
+ * in guest memory the way the Linux virtio driver does */
+class VirtqueueBenchmark : public VirtioPci {
+ public:
+  VirtqueueBenchmark(Machine* machine, bool packed) : packed_(packed) {
+    manager_ = machine->device_manager();
+    use_ioevent_ = false;
+    SoftReset();
+    AddQueue(queue_size, nullptr);
+    slots_ = queue_size / chain_length;
+    MV_ASSERT(slots_ > 0);
+
+    auto& vq = queues_[0];
+    vq.descriptor_table_address = RING_BASE;
+    if (packed_) {
+      vq.available_ring_address = RING_BASE + queue_size * sizeof(VRingPackedDescriptor);
+      vq.used_ring_address = vq.available_ring_address + sizeof(VRingPackedEvent);
+    } else {
+      vq.available_ring_address = RING_BASE + queue_size * sizeof(VRingDescriptor);
+      vq.used_ring_address = ALIGN(vq.available_ring_address + sizeof(VRingAvailable) + (queue_size + 1) * sizeof(uint16_t), 4096);
+    }
+    size_t ring_size = vq.used_ring_address - RING_BASE + (packed_ ? sizeof(VRingPackedEvent) :
+      sizeof(VRingUsed) + (queue_size + 1) * sizeof(VRingUsedElement));
+    bzero(manager_->TranslateGuestMemory(RING_BASE), ring_size);
+    driver_features_ = (1UL << VIRTIO_F_VERSION_1) | (packed_ ? (1UL << VIRTIO_F_RING_PACKED) : 0);
+    EnableQueue(0);
+  }
+
+  void Run(size_t batch_size) {
+    stopped_ = false;
+    completed_ = 0;
+    auto start_time = std::chrono::steady_clock::now();
+    std::thread driver(packed_ ? &VirtqueueBenchmark::RunPackedDriver : &VirtqueueBenchmark::RunSplitDriver, this);
+    std::thread device(&VirtqueueBenchmark::RunDevice, this, batch_size);
+    std::this_thread::sleep_for(std::chrono::duration<double>(runtime));
+    stopped_ = true;
+    device.join();
+    driver.join();
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start_time).count();
+
+    printf("ring=%s size=%u chain=%u batch=%lu requests/s=%.0f ns/request=%.1f\n", packed_ ? "packed" : "split",
+      queue_size, chain_length, batch_size, completed_ / seconds, seconds * 1e9 / completed_);
+  }
+
+ private:
+  bool                  packed_;
+  size_t                slots_;
+  std::atomic<bool>     stopped_;
+  std::atomic<size_t>   completed_;
+
+  uint64_t BufferAddress(size_t slot, size_t index) {
+    return BUFFER_BASE + (slot * chain_length + index) * 4096;
+  }
+
+  void RunDevice(size_t batch_size) {
+    auto& vq = queues_[0];
+    std::vector<VirtElement*> elements;
+    while (!stopped_) {
+      while (elements.size() < batch_size) {
+        auto element = PopQueue(vq);
+        if (!element) {
+          break;
+        }
+        /* The status byte */
+        element->length = 1;
+        elements.push_back(element);
+      }
+      if (elements.empty()) {
+        std::this_thread::yield();
+        continue;
+      }
+      size_t count = elements.size();
+      if (count == 1) {
+        PushQueue(vq, elements[0]);
+      } else {
+        PushQueueMultiple(vq, elements);
+      }
+      elements.clear();
+      completed_ += count;
+    }
+  }
+
+  /* Each slot has its own linked descriptors, only the head goes to the available ring */
+  void RunSplitDriver() {
+    auto& vq = queues_[0];
+    auto descriptors = vq.descriptor_table;
+    auto available = vq.available_ring;
+    auto used = vq.used_ring;
+    std::vector<uint16_t> free_slots;
+    for (size_t slot = 0; slot < slots_; slot++) {
+      for (size_t i = 0; i < chain_length; i++) {
+        auto& descriptor = descriptors[slot * chain_length + i];
+        descriptor.address = BufferAddress(slot, i);
+        descriptor.length = i == 0 ? 16 : (i + 1 == chain_length ? 1 : 4096);
+        descriptor.flags = (i + 1 < chain_length ? VRING_DESC_F_NEXT : 0) |
+          (i + 1 == chain_length ? VRING_DESC_F_WRITE : 0);
+        descriptor.next = slot * chain_length + i + 1;
+      }
+      free_slots.push_back(slot);
+    }
+
+    uint16_t available_index = 0, last_used = 0;
+    while (!stopped_) {
+      bool progress = false;
+      while (last_used != *(volatile uint16_t*)&used->index) {
+        asm volatile ("": : :"memory");
+        free_slots.push_back(used->items[last_used++ % queue_size].id / chain_length);
+        progress = true;
+      }
+      if (!free_slots.empty()) {
+        while (!free_slots.empty()) {
+          available->items[available_index++ % queue_size] = free_slots.back() * chain_length;
+          free_slots.pop_back();
+        }
+        asm volatile ("": : :"memory");
+        *(volatile uint16_t*)&available->index = available_index;
+        progress = true;
+      }
+      if (!progress) {
+        std::this_thread::yield();
+      }
+    }
+  }
+
+  /* Chains take consecutive ring slots, the head flags are written last */
+  void RunPackedDriver() {
+    auto& vq = queues_[0];
+    auto ring = vq.packed_ring;
+    std::vector<uint16_t> free_ids;
+    for (size_t slot = 0; slot < slots_; slot++) {
+      free_ids.push_back(slot);
+    }
+
+    uint16_t next_available = 0, next_used = 0;
+    bool available_wrap = true, used_wrap = true;
+    size_t free_descriptors = queue_size;
+    while (!stopped_) {
+      bool progress = false;
+      while (true) {
+        uint16_t flags = *(volatile uint16_t*)&ring[next_used].flags;
+        bool available = flags & (1 << VRING_PACKED_DESC_F_AVAIL);
+        bool used = flags & (1 << VRING_PACKED_DESC_F_USED);
+        if (available != used || used != used_wrap) {
+          break;
+        }
+        asm volatile ("": : :"memory");
+        free_ids.push_back(ring[next_used].id);
+        free_descriptors += chain_length;
+        next_used += chain_length;
+        if (next_used >= queue_size) {
+          next_used -= queue_size;
+          used_wrap = !used_wrap;
+        }
+        progress = true;
+      }
+
+      while (!free_ids.empty() && free_descriptors >= chain_length) {
+        uint16_t id = free_ids.back();
+        free_ids.pop_back();
+        free_descriptors -= chain_length;
+        auto head = &ring[next_available];
+        uint16_t head_flags = 0;
+        for (size_t i = 0; i < chain_length; i++) {
+          auto& descriptor = ring[next_available];
+          descriptor.address = BufferAddress(id, i);
+          descriptor.length = i == 0 ? 16 : (i + 1 == chain_length ? 1 : 4096);
+          descriptor.id = id;
+          uint16_t flags = (i + 1 < chain_length ? VRING_DESC_F_NEXT : 0) |
+            (i + 1 == chain_length ? VRING_DESC_F_WRITE : 0) |
+            (available_wrap ? (1 << VRING_PACKED_DESC_F_AVAIL) : (1 << VRING_PACKED_DESC_F_USED));
+          if (i == 0) {
+            head_flags = flags;
+          } else {
+            descriptor.flags = flags;
+          }
+          if (++next_available == queue_size) {
+            next_available = 0;
+            available_wrap = !available_wrap;
+          }
+        }
+        asm volatile ("": : :"memory");
+        *(volatile uint16_t*)&head->flags = head_flags;
+        progress = true;
+      }
+      if (!progress) {
+        std::this_thread::yield();
+      }
+    }
+  }
+};
+
+static std::vector<size_t> ParseSizes(std::string value) {
+  std::vector<size_t> sizes;
+  size_t start = 0;
+  while (start < value.size()) {
+    auto end = value.find(',', start);
+    if (end == std::string::npos) {
+      end = value.size();
+    }
+    sizes.push_back(std::max(1L, atol(value.substr(start, end - start).c_str())));
+    start = end + 1;
+  }
+  return sizes;
+}
+
+int main(int argc, char* argv[]) {
+  int c, option_index = 0;
+  while ((c = getopt_long_only(argc, argv, "hb:r:s:c:n:t:", long_options, &option_index)) != -1) {
+    switch (c)
+    {
+    case 'b':
+      base_config = optarg;
+      break;
+    case 'r':
+      ring = optarg;
+      break;
+    case 's':
+      queue_size = atol(optarg);
+      break;
+    case 'c':
+      chain_length = std::max(1L, atol(optarg));
+      break;
+    case 'n':
+      batch_sizes = ParseSizes(optarg);
+      break;
+    case 't':
+      runtime = atof(optarg);
+      break;
+    case 'h':
+    case '?':
+      PrintHelp();
+      return 0;
+    }
+  }
+
+  /* The machine stays paused, only its guest memory is used */
+  auto machine = new Machine(base_config, "virtqueue benchmark", "");
+  for (auto packed : { false, true }) {
+    if (ring != "both" && ring != (packed ? "packed" : "split")) {
+      continue;
+    }
+    for (auto batch_size : batch_sizes) {
+      auto benchmark = new VirtqueueBenchmark(machine, packed);
+      benchmark->Run(batch_size);
+      delete benchmark;
+    }
+  }
+  machine->Quit();
+  delete machine;
+  return 0;
+}
@@ -253,6 +253,9 @@ void Configuration::LoadMachine(const YAML::Node& node) {
   if (node["hypervisor"]) {
     machine_->hypervisor_ = node["hypervisor"].as<bool>();
   }
+  if (node["iothreads"]) {
+    machine_->num_queue_threads_ = node["iothreads"].as<uint64_t>();
+  }
 }
 
 void Configuration::LoadObjects(const YAML::Node& objects_node) {
@@ -370,5 +373,6 @@ void Configuration::SaveMachine(YAML::Node& node) {
   node["vcpu"] = machine_->num_vcpus_;
   node["debug"] = machine_->debug_;
   node["hypervisor"] = machine_->hypervisor_;
+  node["iothreads"] = machine_->num_queue_threads_;
   node["bios"] = bios_path_;
 }
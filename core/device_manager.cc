@@ -47,6 +47,12 @@ IoThread* DeviceManager::io() {
   return machine_->io_thread_;
 }
 
+/* Queues of devices share the queue threads round-robin, null if there is none */
+IoThread* DeviceManager::queue_io(size_t index) {
+  auto& threads = machine_->queue_threads_;
+  return threads.empty() ? nullptr : threads[index % threads.size()];
+}
+
 DeviceManager::DeviceManager(Machine* machine, Device* root) :
   machine_(machine), root_(root)
 {
@@ -253,7 +259,7 @@ void DeviceManager::UnregisterIoHandler(Device* device, const IoResource* resour
   }
 }
 
-IoEvent* DeviceManager::RegisterIoEvent(Device* device, IoResourceType type, uint64_t address, uint32_t length, uint64_t datamatch) {
+IoEvent* DeviceManager::CreateIoEvent(Device* device, IoResourceType type, uint64_t address, uint32_t length, uint64_t datamatch) {
   IoEvent* event = new IoEvent {
     .type = kIoEventFd,
     .device = device,
@@ -261,7 +267,8 @@ IoEvent* DeviceManager::RegisterIoEvent(Device* device, IoResourceType type, uin
     .length = length,
     .datamatch = datamatch,
     .flags = length ? KVM_IOEVENTFD_FLAG_DATAMATCH : 0U,
-    .fd = eventfd(0, 0)
+    .fd = eventfd(0, 0),
+    .io_thread = nullptr
   };
   if (type == kIoResourceTypePio) {
     event->flags |= KVM_IOEVENTFD_FLAG_PIO;
@@ -284,7 +291,11 @@ IoEvent* DeviceManager::RegisterIoEvent(Device* device, IoResourceType type, uin
   if (machine_->debug_) {
     MV_LOG("%s register IO event address=0x%lx length=%lu fd=%d", device->name(), address, length, event->fd);
   }
+  return event;
+}
 
+IoEvent* DeviceManager::RegisterIoEvent(Device* device, IoResourceType type, uint64_t address, uint32_t length, uint64_t datamatch) {
+  IoEvent* event = CreateIoEvent(device, type, address, length, datamatch);
   io()->StartPolling(device, event->fd, EPOLLIN, [event, this](int events) {
     if (events & EPOLLIN) {
       uint64_t tmp;
@@ -306,8 +317,27 @@ IoEvent* DeviceManager::RegisterIoEvent(Device* device, IoResourceType type, uin
   return RegisterIoEvent(device, type, address, 0, 0);
 }
 
+/* Poll the write on io_thread and call back without locking the device, so writes
+ * to different addresses of a device are handled in parallel */
+IoEvent* DeviceManager::RegisterIoEvent(Device* device, IoResourceType type, uint64_t address,
+  IoThread* io_thread, VoidCallback callback) {
+  IoEvent* event = CreateIoEvent(device, type, address, 0, 0);
+  event->io_thread = io_thread;
+  io_thread->StartPolling(nullptr, event->fd, EPOLLIN, [event, callback = std::move(callback)](int events) {
+    if (events & EPOLLIN) {
+      uint64_t tmp;
+      MV_ASSERT(read(event->fd, &tmp, sizeof(tmp)) == sizeof(tmp));
+      callback();
+    }
+  });
+
+  std::lock_guard<std::recursive_mutex> lock(mutex_);
+  ioevents_.insert(event);
+  return event;
+}
+
 void DeviceManager::UnregisterIoEvent(IoEvent* event) {
-  io()->StopPolling(event->fd);
+  (event->io_thread ? event->io_thread : io())->StopPolling(event->fd);
 
   std::lock_guard<std::recursive_mutex> lock(mutex_);
 
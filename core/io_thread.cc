@@ -34,13 +34,16 @@
 
 
 #define MAX_ENTRIES 256
+/* The first polling window, doubled while wakeups come within the maximum */
+#define POLL_START_NS 4000
 
-IoThread::IoThread(Machine* machine) : machine_(machine) {
+IoThread::IoThread(Machine* machine, std::string name) : name_(name), machine_(machine) {
   epoll_fd_ = epoll_create(MAX_ENTRIES);
   event_fd_ = eventfd(0, 0);
 }
 
 IoThread::~IoThread() {
+  StopCommittingDiskImages();
   Kick();
 
   if (thread_.joinable()) {
@@ -59,6 +62,9 @@ IoThread::~IoThread() {
     }
     delete timer;
   }
+  for (auto poller : pollers_) {
+    delete poller;
+  }
 
   for (auto it = qcow2_image_backing_files_.begin(); it != qcow2_image_backing_files_.end(); it++) {
     auto& files = it->second;
@@ -78,10 +84,12 @@ void IoThread::Start() {
     MV_UNUSED(ret);
     uint64_t tmp;
     MV_ASSERT(read(event_fd_, &tmp, sizeof(tmp)) == sizeof(tmp));
+    kicked_ = false;
   });
 }
 
 void IoThread::Kick() {
+  kicked_ = true;
   if (event_fd_ > 0) {
     uint64_t tmp = 1;
     MV_ASSERT(write(event_fd_, &tmp, sizeof(tmp)) == sizeof(tmp));
@@ -125,7 +133,7 @@ bool IoThread::PreRun() {
 }
 
 void IoThread::RunLoop() {
-  SetThreadName("mvisor-iothread");
+  SetThreadName(name_.c_str());
   signal(SIGPIPE, SIG_IGN);
 
   struct epoll_event events[MAX_ENTRIES];
@@ -142,12 +150,20 @@ void IoThread::RunLoop() {
         break;
       }
 
+      /* Work found by polling skips the sleep, but events are still checked */
+      auto wait_start = std::chrono::steady_clock::now();
+      bool polled = poll_ns_ > 0 && RunPollers(std::min(poll_ns_, next_timeout_ns));
+
       /* epoll_wait limits to 1ms at least. epoll_pwait2 is only available after kernel 5.11 */
-      int nfds = epoll_wait(epoll_fd_, events, MAX_ENTRIES, std::max(1LL, next_timeout_ns / 1000000LL));
+      int nfds = epoll_wait(epoll_fd_, events, MAX_ENTRIES, polled ? 0 : std::max(1LL, next_timeout_ns / 1000000LL));
       if (nfds < 0 && errno != EINTR) {
         MV_PANIC("nfds=%d", nfds);
         break;
       }
+      if (poll_max_ns_ > 0) {
+        AdjustPollWindow(std::chrono::duration_cast<std::chrono::nanoseconds>(
+          std::chrono::steady_clock::now() - wait_start).count());
+      }
       
       for (int i = 0; i < nfds; i++) {
         EpollEvent* event = nullptr;
@@ -187,7 +203,7 @@ void IoThread::RunLoop() {
   }
 
   paused_ = true;
-  if (machine_->debug()) MV_LOG("mvisor-iothread ended");
+  if (machine_->debug()) MV_LOG("%s ended", name_.c_str());
 }
 
 EpollEvent* IoThread::StartPolling(Device* device, int fd, uint poll_mask, IoCallback callback) {
@@ -287,7 +303,11 @@ int64_t IoThread::CheckTimers() {
   }
   
   for (auto timer : triggered) {
-    std::lock_guard<std::recursive_mutex> device_lock(timer->device->mutex_);
+    /* Timers without a device do their own locking */
+    std::unique_lock<std::recursive_mutex> device_lock;
+    if (timer->device) {
+      device_lock = std::unique_lock<std::recursive_mutex>(timer->device->mutex_);
+    }
     /* better check again, in case of removing a timer in during a timer event or device IO */
     if (timer->removed) {
       continue;
@@ -306,6 +326,116 @@ void IoThread::Schedule(Device* device, VoidCallback callback) {
   AddTimer(device, 0, false, std::move(callback));
 }
 
+IoPoller* IoThread::AddPoller(Device* device, int64_t max_ns, PollCallback poll, PollNotifyCallback set_notification) {
+  IoPoller* poller = new IoPoller;
+  poller->device = device;
+  poller->max_ns = max_ns;
+  poller->poll = std::move(poll);
+  poller->set_notification = std::move(set_notification);
+  poller->removed = false;
+
+  std::lock_guard<std::mutex> lock(mutex_);
+  pollers_.push_back(poller);
+  if (max_ns > poll_max_ns_) {
+    poll_max_ns_ = max_ns;
+  }
+  return poller;
+}
+
+/* Removed pollers are freed by the IO thread, like timers */
+void IoThread::RemovePoller(IoPoller** poller) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  (*poller)->removed = true;
+  *poller = nullptr;
+
+  int64_t max_ns = 0;
+  for (auto item : pollers_) {
+    if (!item->removed) {
+      max_ns = std::max(max_ns, item->max_ns);
+    }
+  }
+  poll_max_ns_ = max_ns;
+}
+
+/* Lock the device of the poller like timers, pollers without a device lock themselves */
+bool IoThread::CallPoller(IoPoller* poller, const std::function<bool()>& callback) {
+  std::unique_lock<std::recursive_mutex> device_lock;
+  if (poller->device) {
+    device_lock = std::unique_lock<std::recursive_mutex>(poller->device->mutex_);
+  }
+  if (poller->removed) {
+    return false;
+  }
+  return callback();
+}
+
+/* Spin until a poller handles new work, the window passes or someone kicks us for
+ * timers and pausing. Guest notifications are off while spinning, after turning
+ * them on again, the pollers check once more for work added in between.
+ * Return true if any work was handled. */
+bool IoThread::RunPollers(int64_t window_ns) {
+  std::vector<IoPoller*> pollers;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (auto it = pollers_.begin(); it != pollers_.end();) {
+      auto poller = *it;
+      if (poller->removed) {
+        it = pollers_.erase(it);
+        delete poller;
+      } else {
+        pollers.push_back(poller);
+        ++it;
+      }
+    }
+  }
+  if (pollers.empty()) {
+    poll_ns_ = 0;
+    return false;
+  }
+
+  for (auto poller : pollers) {
+    CallPoller(poller, [poller]() {
+      poller->set_notification(false);
+      return false;
+    });
+  }
+
+  bool progress = false;
+  auto deadline = std::chrono::steady_clock::now() + std::chrono::nanoseconds(window_ns);
+  while (!progress && !kicked_ && std::chrono::steady_clock::now() < deadline) {
+    for (auto poller : pollers) {
+      progress |= CallPoller(poller, poller->poll);
+    }
+    asm volatile ("pause": : :"memory");
+  }
+
+  for (auto poller : pollers) {
+    progress |= CallPoller(poller, [poller]() {
+      poller->set_notification(true);
+      return poller->poll();
+    });
+  }
+  return progress;
+}
+
+/* Like halt polling of KVM, block_ns is the time from polling to a wakeup. A wakeup
+ * within the window is a hit. The window grows if a longer one would have hit, and
+ * shrinks if the thread stays idle longer than the maximum. */
+void IoThread::AdjustPollWindow(int64_t block_ns) {
+  int64_t max_ns = poll_max_ns_;
+  if (block_ns <= poll_ns_) {
+    /* Hit */
+  } else if (block_ns > max_ns) {
+    poll_ns_ /= 2;
+    if (poll_ns_ < POLL_START_NS) {
+      poll_ns_ = 0;
+    }
+  } else if (poll_ns_ < max_ns) {
+    poll_ns_ = poll_ns_ ? poll_ns_ * 2 : POLL_START_NS;
+  }
+  poll_ns_ = std::min(poll_ns_, max_ns);
+}
+
 void IoThread::RegisterDiskImage(DiskImage* image) {
   std::lock_guard<std::mutex> lock(mutex_);
   disk_images_.push_back(image);
@@ -331,6 +461,7 @@ void IoThread::FlushDiskImages() {
 
 /* Make sure call Flush() before save disk images */
 bool IoThread::SaveDiskImage(MigrationWriter* writer) {
+  StopCommittingDiskImages();
   for (auto image : disk_images_) {
     auto& device = *image->deivce();
     if (image->readonly())
@@ -369,6 +500,7 @@ bool IoThread::SaveDiskImage(MigrationWriter* writer) {
 
 // only could be called when vm was paused
 bool IoThread::CreateQcow2ImageSnapshot() {
+  StopCommittingDiskImages();
   for (auto image : disk_images_) {
     auto qcow2_image = dynamic_cast<Qcow2Image*>(image);
      if (!qcow2_image) {
@@ -386,6 +518,118 @@ bool IoThread::CreateQcow2ImageSnapshot() {
   return true;
 }
 
+/* Called after CreateQcow2ImageSnapshot() with the commit thread stopped. Writes go
+ * to the new overlay, so the chain below it is frozen and opened again read-only
+ * for export while the machine runs. */
+bool IoThread::ExportDiskImage(std::string device_name, std::string path, size_t threads) {
+  std::string backing_path;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (auto item : disk_images_) {
+      auto qcow2_image = dynamic_cast<Qcow2Image*>(item);
+      if (qcow2_image && item->deivce()->name() == device_name) {
+        auto& files = qcow2_image_backing_files_[qcow2_image];
+        if (!files.empty()) {
+          backing_path = files.back();
+        }
+        break;
+      }
+    }
+  }
+  if (backing_path.empty()) {
+    MV_ERROR("qcow2 snapshot of %s is not found", device_name.c_str());
+    return false;
+  }
+
+  Device device;
+  device.set_name("export");
+  auto image = DiskImage::Create(&device, &device, backing_path, true, false);
+  bool ret = Qcow2Image::ExportCompressedImage(image, path, threads);
+  delete image;
+  return ret;
+}
+
+/* Each snapshot for migration adds an overlay, so reads missing the top image
+ * look up more files. Overlays beyond max_snapshot_chain are merged into older
+ * overlays at commit_rate bytes per second while the machine runs. Backing
+ * images opened before the first snapshot are never written. */
+void IoThread::StartCommittingDiskImages() {
+  StopCommittingDiskImages();
+  commit_stopped_ = false;
+  commit_thread_ = std::thread(&IoThread::CommitDiskImages, this);
+}
+
+/* Stop before snapshots, migration or export use the chains */
+void IoThread::StopCommittingDiskImages() {
+  if (commit_thread_.joinable()) {
+    commit_stopped_ = true;
+    commit_thread_.join();
+  }
+}
+
+void IoThread::CommitDiskImages() {
+  SetThreadName("mvisor-commit");
+  std::vector<Qcow2Image*> images;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (auto image : disk_images_) {
+      auto qcow2_image = dynamic_cast<Qcow2Image*>(image);
+      if (qcow2_image && !qcow2_image->readonly()) {
+        images.push_back(qcow2_image);
+      }
+    }
+  }
+
+  for (auto image : images) {
+    auto& device = *image->deivce();
+    size_t max_chain = 1;
+    uint64_t rate = 32UL << 20;
+    if (device.has_key("max_snapshot_chain")) {
+      max_chain = std::max(1UL, std::get<uint64_t>(device["max_snapshot_chain"]));
+    }
+    if (device.has_key("commit_rate")) {
+      rate = std::get<uint64_t>(device["commit_rate"]);
+    }
+
+    while (!commit_stopped_) {
+      std::string merged_path;
+      {
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto& files = qcow2_image_backing_files_[image];
+        if (files.size() <= max_chain) {
+          break;
+        }
+        merged_path = files.back();
+      }
+      if (!image->CommitBackingFile(rate, commit_stopped_)) {
+        break;
+      }
+
+      /* The merged overlay is no longer sent when migrating */
+      std::lock_guard<std::mutex> lock(mutex_);
+      auto& files = qcow2_image_backing_files_[image];
+      std::queue<std::string> remaining;
+      while (!files.empty()) {
+        if (files.front() != merged_path) {
+          remaining.push(files.front());
+        }
+        files.pop();
+      }
+      files = std::move(remaining);
+    }
+  }
+}
+
+/* Statistics of each disk by device name */
+std::map<std::string, DiskImageStatistics> IoThread::GetDiskImageStatistics() {
+  std::map<std::string, DiskImageStatistics> result;
+  std::lock_guard<std::mutex> lock(mutex_);
+  for (auto image : disk_images_) {
+    result[image->deivce()->name()] = image->statistics();
+  }
+  return result;
+}
+
 bool IoThread::SaveBackingDiskImage(MigrationNetworkWriter* writer) {
   for (auto image : disk_images_) {
     auto qcow2_image = dynamic_cast<Qcow2Image*>(image);
@@ -34,8 +34,8 @@
 #include "migration.h"
 
 
-Machine::Machine(std::string config_path, std::string vm_name, std::string vm_uuid) :
-  vm_name_(vm_name), vm_uuid_(vm_uuid) {
+Machine::Machine(std::string config_path, std::string vm_name, std::string vm_uuid, bool clone) :
+  clone_(clone), vm_name_(vm_name), vm_uuid_(vm_uuid) {
   /* Load the configuration and set values of num_vcpus & ram_size */
   config_ = new Configuration(this);
   if (!config_->Load(config_path)) {
@@ -56,6 +56,9 @@ Machine::Machine(std::string config_path, std::string vm_name, std::string vm_uu
   }
   /* Initialize IO thread before devices */
   io_thread_ = new IoThread(this);
+  for (int i = 0; i < num_queue_threads_; ++i) {
+    queue_threads_.push_back(new IoThread(this, "mvisor-queue-" + std::to_string(i)));
+  }
   /* Initialize device manager, connect and reset all devices */
   device_manager_ = new DeviceManager(this, root);
 
@@ -70,6 +73,9 @@ Machine::Machine(std::string config_path, std::string vm_name, std::string vm_uu
     vcpu->Start();
   }
   io_thread_->Start();
+  for (auto thread : queue_threads_) {
+    thread->Start();
+  }
 
   /* Reset devices after vCPU created and paused */
   device_manager_->ResetDevices();
@@ -78,10 +84,14 @@ Machine::Machine(std::string config_path, std::string vm_name, std::string vm_uu
 /* Free VM resources */
 Machine::~Machine() {
   valid_ = false;
+  io_thread_->StopCommittingDiskImages();
 
   delete vfio_manager_;
   delete device_manager_;
   delete memory_manager_;
+  for (auto thread : queue_threads_) {
+    delete thread;
+  }
   delete io_thread_;
 
   // Join all vcpu threads and free resources
@@ -135,6 +145,9 @@ void Machine::Quit() {
 
   /* If paused, threads are waiting to resume */
   io_thread_->Kick();
+  for (auto thread : queue_threads_) {
+    thread->Kick();
+  }
   for (auto vcpu: vcpus_) {
     vcpu->Kick();
   }
@@ -222,6 +235,9 @@ void Machine::Resume() {
   
   /* Resume threads */
   io_thread_->Kick();
+  for (auto thread : queue_threads_) {
+    thread->Kick();
+  }
   for (auto vcpu : vcpus_) {
     vcpu->Kick();
   }
@@ -236,6 +252,12 @@ void Machine::Pause() {
   /* Make sure no vcpu thread is running now */
   VcpuRunLockGuard guard(vcpus_);
 
+  /* Queue threads stop first, so no request is submitted after disks are drained */
+  std::list<IoThreadLockGuard> queue_guards;
+  for (auto thread : queue_threads_) {
+    queue_guards.emplace_back(thread);
+  }
+
   /* Wait for iothread to stop */
   io_thread_->FlushDiskImages();
   IoThreadLockGuard io_guard(io_thread_);
@@ -308,7 +330,9 @@ bool Machine::Save(const std::string ip, const uint16_t port) {
   }
 
   /* Make connection to target machine */
+  migration_statistics_.Start(ram_size_ / PAGE_SIZE);
   network_writer_ = new MigrationNetworkWriter();
+  network_writer_->set_statistics(&migration_statistics_);
   if (!network_writer_->Connect(ip, port)) {
     MV_ERROR("failed to connect target machine");
     goto end;
@@ -320,6 +344,7 @@ bool Machine::Save(const std::string ip, const uint16_t port) {
   }
 
   /* Save backing disk images */
+  migration_statistics_.BeginPhase(kMigrationPhaseBackingImage);
   if(!io_thread_->SaveBackingDiskImage(network_writer_)) {
     MV_ERROR("failed to save backing disk images");
     goto end;
@@ -330,6 +355,8 @@ bool Machine::Save(const std::string ip, const uint16_t port) {
   }
 
   /* Save system RAM */
+  migration_statistics_.UpdateDirtyPages(memory_manager_->CountDirtyPages(), true);
+  migration_statistics_.BeginPhase(kMigrationPhaseRam);
   if (!memory_manager_->SaveState(network_writer_)) {
     MV_ERROR("failed to save memory");
     goto end;
@@ -338,6 +365,8 @@ bool Machine::Save(const std::string ip, const uint16_t port) {
   if (!network_writer_->WaitForSignal(kMigrateRamComplete)) {
     goto end;
   }
+  migration_statistics_.UpdateDirtyPages(memory_manager_->CountDirtyPages(), true);
+  migration_statistics_.BeginPhase(kMigrationPhaseReady);
   ret = true;
 
 end:
@@ -345,10 +374,14 @@ end:
     delete network_writer_;
     network_writer_ = nullptr;
     memory_manager_->StopTrackingDirtyMemory();
+    migration_statistics_.Finish(false);
   }
 
   saving_ = false;
   MV_LOG("done saving");
+
+  /* Chains grow by one overlay for every attempt */
+  io_thread_->StartCommittingDiskImages();
   return ret;
 }
 
@@ -372,6 +405,9 @@ bool Machine::PostSave() {
   saving_ = true;
   bool ret = false;
 
+  /* The final dirty set is what we send while the guest is paused */
+  migration_statistics_.UpdateDirtyPages(memory_manager_->CountDirtyPages(), true);
+  migration_statistics_.BeginPhase(kMigrationPhaseImage);
   if(!io_thread_->SaveDiskImage(network_writer_)) {
     MV_ERROR("failed to save disk images");
     goto end;
@@ -381,6 +417,7 @@ bool Machine::PostSave() {
     goto end;
   }
 
+  migration_statistics_.BeginPhase(kMigrationPhaseDirtyMemory);
   if (!memory_manager_->SaveDirtyMemory(network_writer_, kDirtyMemoryTypeKvm)) {
     MV_ERROR("failed to save dirty memory from kvm");
     goto end;
@@ -401,6 +438,7 @@ bool Machine::PostSave() {
 
   /* Target machine need to get all memory before load device state,
    * so we send device state and dirty memory from dma together. */
+  migration_statistics_.BeginPhase(kMigrationPhaseDevice);
   if (!device_manager_->SaveState(network_writer_)) {
     MV_ERROR("failed to save device states");
     goto end;
@@ -422,6 +460,7 @@ bool Machine::PostSave() {
   }
 
   /* Save vcpu states */
+  migration_statistics_.BeginPhase(kMigrationPhaseVcpu);
   for (auto vcpu : vcpus_) {
     if (!vcpu->SaveState(network_writer_)) {
       MV_ERROR("failed to save vcpu=%d states", vcpu->vcpu_id());
@@ -445,10 +484,54 @@ end:
 
   saving_ = false;
   memory_manager_->StopTrackingDirtyMemory();
+  migration_statistics_.Finish(ret);
   MV_LOG("done post-saving");
   return ret;
 }
 
+/* Safe to call from UI threads while migrating, the dirty page count is
+ * refreshed when the guest is running between Save and PostSave */
+MigrationProgress Machine::GetMigrationProgress() {
+  auto progress = migration_statistics_.progress();
+  if (progress.phase >= kMigrationPhaseBackingImage && progress.phase <= kMigrationPhaseReady) {
+    migration_statistics_.UpdateDirtyPages(memory_manager_->CountDirtyPages(), false);
+    progress = migration_statistics_.progress();
+  }
+  return progress;
+}
+
+/* Export a disk as a compressed qcow2 image while the machine runs. Like saving,
+ * the machine is paused to add overlays, then the frozen backing chain is exported
+ * before the commit thread may merge it again. */
+bool Machine::ExportDiskImage(std::string device_name, std::string path) {
+  if (saving_) {
+    MV_ERROR("machine is busy migrating");
+    return false;
+  }
+  saving_ = true;
+
+  bool paused = IsPaused();
+  if (!paused) {
+    Pause();
+  }
+  bool ret = io_thread_->CreateQcow2ImageSnapshot();
+  if (!paused) {
+    Resume();
+  }
+  if (ret) {
+    ret = io_thread_->ExportDiskImage(device_name, path, std::thread::hardware_concurrency());
+  }
+
+  saving_ = false;
+  io_thread_->StartCommittingDiskImages();
+  return ret;
+}
+
+/* Counters and latency histograms of each disk, keyed by device name */
+std::map<std::string, DiskImageStatistics> Machine::GetDiskImageStatistics() {
+  return io_thread_->GetDiskImageStatistics();
+}
+
 /* Load through network */
 void Machine::Load(uint16_t port) {
   MV_ASSERT(!loading_);
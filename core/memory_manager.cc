@@ -362,6 +362,31 @@ void MemoryManager::StopTrackingDirtyMemory() {
   track_dirty_memory_ = false;
 }
 
+/* Count pages dirtied since the last synchronization, with manual dirty log
+ * protection KVM_GET_DIRTY_LOG does not clear the bits so it is safe to call
+ * while saving */
+uint64_t MemoryManager::CountDirtyPages() {
+  if (!track_dirty_memory_) {
+    return 0;
+  }
+
+  std::shared_lock lock(mutex_);
+  uint64_t count = 0;
+  std::vector<uint64_t> bitmap;
+  for (auto region: system_regions_) {
+    for (auto slot: region->slots_) {
+      bitmap.assign(ALIGN(slot->size / PAGE_SIZE, 64) / 64, 0);
+      if (!GetDirtyBitmapFromKvm(slot->id, bitmap.data())) {
+        continue;
+      }
+      for (auto bits : bitmap) {
+        count += __builtin_popcountll(bits);
+      }
+    }
+  }
+  return count;
+}
+
 // Update dirty memory map for migration
 void MemoryManager::SetDirtyMemoryRegion(uint64_t gpa, size_t size) {
   if (!track_dirty_memory_) {
@@ -600,6 +625,9 @@ bool MemoryManager::SaveDirtyMemory(MigrationNetworkWriter* writer, DirtyMemoryT
     return false;
   }
 
+  if (writer->statistics()) {
+    writer->statistics()->AddPages(dirty_memory_size / PAGE_SIZE);
+  }
   MV_LOG("Save dirty memory type=%d size=%ldMB", type, dirty_memory_size >> 20);
   return true;
 }
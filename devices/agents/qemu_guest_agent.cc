@@ -21,14 +21,52 @@
  */
 
 #include <string>
+#include <cstdio>
 
 #include "device.h"
 #include "device_manager.h"
+#include "machine.h"
 #include "serial_port.h"
 #include "utilities.h"
 #include "logger.h"
 
 class QemuGuestAgent : public Device, public SerialPort {
+ private:
+  std::list<VoidCallback>::iterator state_change_listener_;
+
+  /* Clones get new MAC addresses while the restored guest uses the template's.
+   * Commands for Linux and Windows are both sent, the other one fails. */
+  void ApplyMacAddressChanges() {
+    auto machine = manager_->machine();
+    if (!ready_ || !machine->clone()) {
+      return;
+    }
+    auto objects = machine->LookupObjects([](auto o) { return dynamic_cast<MacAddressInterface*>(o); });
+    for (auto object : objects) {
+      MacAddress guest_mac, new_mac;
+      if (!dynamic_cast<MacAddressInterface*>(object)->GetMacAddressChange(guest_mac, new_mac)) {
+        continue;
+      }
+      auto g = guest_mac.data, n = new_mac.data;
+      char command[512];
+      snprintf(command, sizeof(command), "{\"execute\":\"guest-exec\",\"arguments\":{\"path\":\"/bin/sh\","
+        "\"arg\":[\"-c\",\"for d in /sys/class/net/*; do grep -qx %02x:%02x:%02x:%02x:%02x:%02x $d/address && "
+        "ip link set dev ${d##*/} address %02x:%02x:%02x:%02x:%02x:%02x; done\"]}}\n",
+        g[0], g[1], g[2], g[3], g[4], g[5], n[0], n[1], n[2], n[3], n[4], n[5]);
+      SerialPort::SendMessage((uint8_t*)command, strlen(command));
+
+      /* Setting NetworkAddress restarts the adapter with the new address */
+      snprintf(command, sizeof(command), "{\"execute\":\"guest-exec\",\"arguments\":{\"path\":\"powershell.exe\","
+        "\"arg\":[\"-NoProfile\",\"-Command\",\"Get-NetAdapter | Where-Object MacAddress -eq "
+        "'%02X-%02X-%02X-%02X-%02X-%02X' | Set-NetAdapterAdvancedProperty -RegistryKeyword NetworkAddress "
+        "-RegistryValue %02X%02X%02X%02X%02X%02X\"]}}\n",
+        g[0], g[1], g[2], g[3], g[4], g[5], n[0], n[1], n[2], n[3], n[4], n[5]);
+      SerialPort::SendMessage((uint8_t*)command, strlen(command));
+      MV_LOG("%s: ask the guest to change MAC address to %02x:%02x:%02x:%02x:%02x:%02x", name(),
+        n[0], n[1], n[2], n[3], n[4], n[5]);
+    }
+  }
+
  public:
   QemuGuestAgent() {
     set_default_parent_class("VirtioConsole");
@@ -36,13 +74,32 @@ class QemuGuestAgent : public Device, public SerialPort {
     strcpy(port_name_, "org.qemu.guest_agent.0");
   }
 
-  // virtual void set_ready(bool ready) {
-  //   SerialPortInterface::set_ready(ready);
-  //   if (ready) {
-  //     std::string cmd = "{\"execute\":\"guest-info\"}\n";
-  //     device_->SendMessage(this, (uint8_t*)cmd.data(), cmd.size());
-  //   }
-  // }
+  virtual void Connect() {
+    Device::Connect();
+    auto machine = manager_->machine();
+    state_change_listener_ = machine->RegisterStateChangeListener([this, machine]() {
+      if (!machine->IsPaused()) {
+        Schedule([this]() {
+          ApplyMacAddressChanges();
+        });
+      }
+    });
+  }
+
+  virtual void Disconnect() {
+    manager_->machine()->UnregisterStateChangeListener(state_change_listener_);
+    Device::Disconnect();
+  }
+
+  /* The agent may start after the clone is resumed */
+  virtual void set_ready(bool ready) {
+    SerialPort::set_ready(ready);
+    if (ready && !manager_->machine()->IsPaused()) {
+      Schedule([this]() {
+        ApplyMacAddressChanges();
+      });
+    }
+  }
 
   /* This interface function is called by UI thread */
   virtual void SendMessage(uint8_t* data, size_t size) {
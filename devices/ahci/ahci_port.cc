@@ -281,16 +281,24 @@ void AhciPort::CheckCommand() {
     return;
   }
   if ((port_control_.command & PORT_CMD_START) && port_control_.command_issue) {
+    /* NCQ commands issued together are merged by the image */
+    auto image = drive_ ? drive_->image() : nullptr;
+    if (image) {
+      image->Plug();
+    }
     for (int slot = 0; (slot < 32) && port_control_.command_issue; slot++) {
       if (port_control_.command_issue & (1U << slot)) {
         if (HandleCommand(slot)) {
           port_control_.command_issue &= ~(1U << slot);
         } else {
           /* Stop executing other commands if an async command is running */
-          return;
+          break;
         }
       }
     }
+    if (image) {
+      image->Unplug();
+    }
   }
 }
 
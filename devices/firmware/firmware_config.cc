@@ -300,6 +300,12 @@ class FirmwareConfig : public Device, public AcpiTableInterface {
     current_index_ = state.current_index();
     current_offset_ = state.current_offset();
     dma_address_ = state.dma_address();
+
+    /* Guest memory is loaded before devices, clones get serial numbers of their uuid */
+    if (manager_->machine()->clone()) {
+      Smbios smbios(manager_->machine());
+      smbios.UpdateGuestSerialNumbers();
+    }
     return Device::LoadState(reader);
   }
 
@@ -21,6 +21,8 @@
 
 #include "smbios.h"
 #include <cstring>
+#include <cstddef>
+#include <algorithm>
 
 #include "version.h"
 #include "logger.h"
@@ -65,6 +67,83 @@ void Smbios::GetTables(std::string& anchor, std::string& table) {
   anchor = std::string((char*)&entry_point_, sizeof(entry_point_));
 }
 
+/* SeaBIOS copies the tables to guest memory and puts the entry point in the F segment */
+uint8_t* Smbios::FindGuestTable(size_t& length) {
+  auto memory_manager = machine_->memory_manager();
+  auto fseg = (uint8_t*)memory_manager->GuestToHostAddress(0xF0000);
+  for (size_t offset = 0; offset < 0x10000; offset += 16) {
+    auto entry = (smbios_21_entry_point*)(fseg + offset);
+    if (memcmp(entry->anchor_string, "_SM_", 4) || memcmp(entry->intermediate_anchor_string, "_DMI_", 5)) {
+      continue;
+    }
+    uint64_t address = entry->structure_table_address;
+    length = entry->structure_table_length;
+    auto table = (uint8_t*)memory_manager->GuestToHostAddress(address);
+    if (length == 0 || memory_manager->GuestToHostAddress(address + length - 1) != table + length - 1) {
+      return nullptr;
+    }
+    return table;
+  }
+  return nullptr;
+}
+
+/* A clone restores the tables of its template from guest memory, so the serial
+ * numbers are rewritten in place with the uuid of the clone. Both are uuids of
+ * the same length, other serials are truncated or padded with spaces. */
+void Smbios::UpdateGuestSerialNumbers() {
+  size_t length;
+  auto table = FindGuestTable(length);
+  if (table == nullptr) {
+    MV_WARN("SMBIOS tables are not found in guest memory");
+    return;
+  }
+
+  auto end = table + length;
+  auto ptr = table;
+  while (ptr + sizeof(smbios_structure_header) <= end) {
+    auto header = (smbios_structure_header*)ptr;
+    if (header->type == SMBIOS_MAX_TYPE || ptr + header->length > end) {
+      break;
+    }
+    uint8_t serial_index = 0;
+    switch (header->type) {
+    case 1:
+      if (header->length > offsetof(smbios_type_1, serial_number_str)) {
+        serial_index = ((smbios_type_1*)ptr)->serial_number_str;
+      }
+      break;
+    case 2:
+      if (header->length > offsetof(smbios_type_2, serial_number_str)) {
+        serial_index = ((smbios_type_2*)ptr)->serial_number_str;
+      }
+      break;
+    case 17:
+      if (header->length > offsetof(smbios_type_17, serial_number_str)) {
+        serial_index = ((smbios_type_17*)ptr)->serial_number_str;
+      }
+      break;
+    }
+
+    /* Strings follow the formatted area, ended by an empty string */
+    auto text = (char*)ptr + header->length;
+    uint8_t index = 1;
+    while (text < (char*)end && *text) {
+      size_t text_length = strnlen(text, (char*)end - text);
+      if (index == serial_index) {
+        size_t copy = std::min(text_length, default_serial_number_.size());
+        memcpy(text, default_serial_number_.data(), copy);
+        memset(text + copy, ' ', text_length - copy);
+      }
+      text += text_length + 1;
+      index++;
+    }
+    if (index == 1) {
+      text++;
+    }
+    ptr = (uint8_t*)text + 1;
+  }
+}
+
 void Smbios::SetupEntryPoint() {
   bzero(&entry_point_, sizeof(entry_point_));
   entry_point_.length = sizeof(smbios_21_entry_point);
@@ -282,6 +282,7 @@ class Smbios {
  public:
   Smbios(Machine* machine);
   void GetTables(std::string& anchor, std::string& table);
+  void UpdateGuestSerialNumbers();
 
  private:
   void BuildStructure(uint8_t type, void* data, size_t size, std::vector<std::string>& texts, uint16_t handle=0);
@@ -294,6 +295,7 @@ class Smbios {
   void BuildType19();
   void BuildType32();
   void SetupEntryPoint();
+  uint8_t* FindGuestTable(size_t& length);
   Machine* machine_;
 
   smbios_21_entry_point entry_point_;
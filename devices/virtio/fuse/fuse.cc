@@ -369,7 +369,7 @@ bool Fuse::ReadDirectory(fuse_read_in* read_in, uint64_t nodeid, char* result_bu
   return !lookup_err;
 }
 
-DataBuffer Fuse::GetDataBufferFromIovec(std::deque<struct iovec>& iovec, size_t size) {
+DataBuffer Fuse::GetDataBufferFromIovec(IovecList& iovec, size_t size) {
   // get request from guest
   MV_ASSERT(!iovec.empty());
 
@@ -37,6 +37,7 @@
 #include "fuse_kernel.h"
 #include "fuse_lowlevel.h"
 #include "logger.h"
+#include "iovec_list.h"
 
 #define MAX_PATH 260
 #define BLOCK_SIZE 4096
@@ -110,7 +111,7 @@ class Fuse {
   Inode* GetInodeFromFd(int fd);
   Inode* GetInodeFromStat(struct stat* stat);
 
-  DataBuffer GetDataBufferFromIovec(std::deque<struct iovec>& iovec, size_t size);
+  DataBuffer GetDataBufferFromIovec(IovecList& iovec, size_t size);
 
   inline struct UserConfig user_config() const { return user_config_; }
 
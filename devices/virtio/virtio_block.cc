@@ -49,6 +49,8 @@ class VirtioBlock : public VirtioPci {
       (1UL << VIRTIO_BLK_F_WCE) |
       (1UL << VIRTIO_BLK_F_MQ);
     bzero(&block_config_, sizeof(block_config_));
+    /* Queues are served by the queue threads of the machine if there are any */
+    use_queue_threads_ = true;
   }
 
   virtual void Disconnect() {
@@ -67,8 +69,7 @@ class VirtioBlock : public VirtioPci {
       std::string path = std::get<std::string>(key_values_["image"]);
       image_ = DiskImage::Create(this, this, path, readonly, snapshot);
 
-      /* Qcow2 supports disacard & write zeros */
-      if (path.find(".qcow2") != std::string::npos) {
+      if (image_->SupportsDiscard()) {
         device_features_ |=  (1UL << VIRTIO_BLK_F_DISCARD) | (1UL << VIRTIO_BLK_F_WRITE_ZEROES);
       }
     }
@@ -130,48 +131,42 @@ class VirtioBlock : public VirtioPci {
   void OnOutput(int queue_index) {
     auto &vq = queues_[queue_index];
 
+    /* Requests popped in one notification are merged by the image, and requests
+     * completed in one IoThread iteration share one interrupt */
+    image_->Plug();
     while (auto element = PopQueue(vq)) {
       HandleCommand(vq, element, [=, &vq]() {
-        PushQueue(vq, element);
-        NotifyQueue(vq);
+        PushQueueLater(vq, element);
       });
     }
+    image_->Unplug();
   }
 
+  /* The whole scatter-gather list is submitted as one request with one completion */
   void BlockIoAsync(VirtElement* element, size_t position, bool is_write, IoCallback callback) {
-    auto vector(element->vector);
-    for (auto &iov : vector) {
-      void* buffer = iov.iov_base;
-      size_t length = iov.iov_len;
-
-      auto io_complete = [element, position, length, is_write, callback](auto ret) {
-        if (!is_write && ret != (ssize_t)length) {
-          MV_PANIC("failed IO ret=%lx pos=%lx length=%lx", ret, position, length);
-        }
-        if (!is_write) {
-          element->length += length;
-        }
-        element->vector.pop_back();
-        if (element->vector.empty()) {
-          callback(ret == (ssize_t)length ? VIRTIO_BLK_S_OK : VIRTIO_BLK_S_IOERR);
-        }
-      };
-      if (debug_) {
-        MV_LOG("%s pos=0x%lx len=0x%lx ", is_write ? "write" : "read", position, length);
-      }
-
-      ImageIoRequest r = {
-        .type = is_write ? kImageIoWrite : kImageIoRead,
-        .position = position,
-        .length = length
-      };
-      r.vector.emplace_back(iovec {
-        .iov_base = buffer,
-        .iov_len = length
-      });
-      image_->QueueIoRequest(r, std::move(io_complete));
-      position += length;
+    ImageIoRequest r = {
+      .type = is_write ? kImageIoWrite : kImageIoRead,
+      .position = position,
+      .length = 0
+    };
+    r.vector.assign(element->vector.begin(), element->vector.end());
+    for (auto &iov : r.vector) {
+      r.length += iov.iov_len;
+    }
+    if (debug_) {
+      MV_LOG("%s pos=0x%lx len=0x%lx iovs=%lu", is_write ? "write" : "read", position, r.length, r.vector.size());
     }
+
+    size_t length = r.length;
+    image_->QueueIoRequest(std::move(r), [element, position, length, is_write, callback = std::move(callback)](auto ret) {
+      if (!is_write && ret != (ssize_t)length) {
+        MV_PANIC("failed IO ret=%lx pos=%lx length=%lx", ret, position, length);
+      }
+      if (!is_write) {
+        element->length += length;
+      }
+      callback(ret == (ssize_t)length ? VIRTIO_BLK_S_OK : VIRTIO_BLK_S_IOERR);
+    });
   }
 
   void HandleCommand(VirtQueue& vq, VirtElement* element, VoidCallback callback) {
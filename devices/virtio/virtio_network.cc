@@ -22,13 +22,17 @@
 #include <set>
 #include "linuz/virtio_net.h"
 #include "device_interface.h"
+#include "device_manager.h"
+#include "machine.h"
 #include "logger.h"
 
 #define DEFAULT_MTU 1500
 
-class VirtioNetwork : public VirtioPci, public NetworkDeviceInterface {
+class VirtioNetwork : public VirtioPci, public NetworkDeviceInterface, public MacAddressInterface {
  private:
   virtio_net_config         net_config_;
+  /* The address read or set by the guest driver, net_config_.mac is read at its next reset */
+  MacAddress                guest_mac_;
   std::set<MacAddress>      mac_table_;
   NetworkBackendInterface*  backend_ = nullptr;
 
@@ -52,6 +56,7 @@ class VirtioNetwork : public VirtioPci, public NetworkDeviceInterface {
       (1UL << VIRTIO_NET_F_MAC) |
       (1UL << VIRTIO_NET_F_STATUS) |
       (1UL << VIRTIO_NET_F_CTRL_VQ) |
+      (1UL << VIRTIO_NET_F_CTRL_MAC_ADDR) |
       // (1UL << VIRTIO_F_ANY_LAYOUT) |
       (1UL << VIRTIO_NET_F_SPEED_DUPLEX) |
       (1UL << VIRTIO_NET_F_GUEST_ANNOUNCE);
@@ -84,7 +89,7 @@ class VirtioNetwork : public VirtioPci, public NetworkDeviceInterface {
   virtual void Connect() {
     VirtioPci::Connect();
 
-    /* Configurable MAC address */
+    /* Configurable MAC address, clones get a new one when the template is loaded */
     if (has_key("mac")) {
       uint32_t mac[6];
       std::string mac_string = std::get<std::string>(key_values_["mac"]);
@@ -100,9 +105,8 @@ class VirtioNetwork : public VirtioPci, public NetworkDeviceInterface {
     }
     backend_ = dynamic_cast<NetworkBackendInterface*>(Object::Create(network_type.c_str()));
     MV_ASSERT(backend_);
-    MacAddress mac;
-    memcpy(mac.data, net_config_.mac, sizeof(mac.data));
-    backend_->Initialize(this, mac);
+    memcpy(guest_mac_.data, net_config_.mac, sizeof(guest_mac_.data));
+    backend_->Initialize(this, guest_mac_);
 
     if (has_key("mtu")) {
       net_config_.mtu = std::get<uint64_t>(key_values_["mtu"]);
@@ -121,9 +125,45 @@ class VirtioNetwork : public VirtioPci, public NetworkDeviceInterface {
     AddQueue(256, std::bind(&VirtioNetwork::OnTransmit, this, 1));
     AddQueue(64, std::bind(&VirtioNetwork::OnControl, this, 2));
 
+    /* The driver reads the address from the config space after reset */
+    memcpy(guest_mac_.data, net_config_.mac, sizeof(guest_mac_.data));
+    backend_->SetMacAddress(guest_mac_);
     backend_->Reset();
   }
 
+  bool SaveState(MigrationWriter* writer) {
+    writer->WriteRaw("GUEST_MAC", guest_mac_.data, sizeof(guest_mac_.data));
+    return VirtioPci::SaveState(writer);
+  }
+
+  /* The restored driver keeps the address of the template, a clone gets a new
+   * one that the guest agent applies, or the driver reads at its next reset */
+  bool LoadState(MigrationReader* reader) {
+    if (!VirtioPci::LoadState(reader)) {
+      return false;
+    }
+    if (reader->Exists("GUEST_MAC")) {
+      if (!reader->ReadRaw("GUEST_MAC", guest_mac_.data, sizeof(guest_mac_.data))) {
+        return false;
+      }
+    }
+    if (manager_->machine()->clone()) {
+      GenerateRandomMac(net_config_.mac);
+    }
+    backend_->SetMacAddress(guest_mac_);
+    return true;
+  }
+
+  bool GetMacAddressChange(MacAddress& guest_mac, MacAddress& new_mac) {
+    std::lock_guard<std::recursive_mutex> lock(mutex_);
+    if (memcmp(guest_mac_.data, net_config_.mac, sizeof(guest_mac_.data)) == 0) {
+      return false;
+    }
+    guest_mac = guest_mac_;
+    memcpy(new_mac.data, net_config_.mac, sizeof(new_mac.data));
+    return true;
+  }
+
   void ReadDeviceConfig(uint64_t offset, uint8_t* data, uint32_t size) {
     MV_ASSERT(offset + size <= sizeof(net_config_));
     memcpy(data, (uint8_t*)&net_config_ + offset, size);
@@ -259,6 +299,16 @@ class VirtioNetwork : public VirtioPci, public NetworkDeviceInterface {
       }
       *status = VIRTIO_NET_OK;
       break;
+    case VIRTIO_NET_CTRL_MAC:
+      if (control->cmd == VIRTIO_NET_CTRL_MAC_ADDR_SET && iov.iov_len == sizeof(guest_mac_.data)) {
+        memcpy(guest_mac_.data, iov.iov_base, sizeof(guest_mac_.data));
+        memcpy(net_config_.mac, iov.iov_base, sizeof(net_config_.mac));
+        backend_->SetMacAddress(guest_mac_);
+        *status = VIRTIO_NET_OK;
+      } else {
+        *status = VIRTIO_NET_ERR;
+      }
+      break;
     default:
       *status = VIRTIO_NET_ERR;
       MV_HEXDUMP("control packet", iov.iov_base, iov.iov_len);
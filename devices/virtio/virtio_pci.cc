@@ -19,6 +19,7 @@
 #include "virtio_pci.h"
 
 #include <cstring>
+#include <set>
 #include <linux/virtio_config.h>
 
 #include "machine.h"
@@ -65,16 +66,55 @@ VirtioPci::VirtioPci() {
     bzero(&common_config_, sizeof(common_config_));
     /* Device common features */
     device_features_ = (1UL << VIRTIO_RING_F_INDIRECT_DESC) | (1UL << VIRTIO_RING_F_EVENT_IDX) | \
-      (1UL << VIRTIO_F_VERSION_1);
+      (1UL << VIRTIO_F_VERSION_1) | (1UL << VIRTIO_F_RING_PACKED);
     driver_features_ = 0;
 
     common_config_.num_queues = queues_.size();
     use_ioevent_ = true;
+
+    for (auto &vq : queues_) {
+      vq.flush_scheduled = false;
+      vq.pending_interrupts = 0;
+      vq.interrupt_timer = nullptr;
+      vq.io_thread = nullptr;
+      vq.poller = nullptr;
+      vq.polling = false;
+    }
+}
+
+VirtioPci::~VirtioPci() {
+  for (auto &vq : queues_) {
+    for (auto element : vq.free_elements) {
+      delete element;
+    }
+  }
+}
+
+void VirtioPci::Connect() {
+  /* Like interrupt throttling of NICs, queue interrupts wait up to interrupt_delay_us
+   * for more used buffers, or until interrupt_batch of them are pending */
+  if (has_key("interrupt_delay_us")) {
+    interrupt_delay_ns_ = std::get<uint64_t>(key_values_["interrupt_delay_us"]) * 1000;
+  }
+  if (has_key("interrupt_batch")) {
+    interrupt_batch_ = std::get<uint64_t>(key_values_["interrupt_batch"]);
+  }
+  /* The thread of a queue may poll the ring up to poll_us before waiting for a
+   * notification, the window adapts to how soon new buffers come */
+  if (has_key("poll_us")) {
+    poll_max_ns_ = std::get<uint64_t>(key_values_["poll_us"]) * 1000;
+  }
+  PciDevice::Connect();
 }
 
 void VirtioPci::Disconnect() {
+  std::list<IoThreadLockGuard> guards;
+  PauseQueueThreads(guards);
   if (use_ioevent_) {
     for (uint index = 0; index < queues_.size(); index++) {
+      if (queues_[index].poller) {
+        RemoveQueuePoller(queues_[index]);
+      }
       if (queues_[index].enabled) {
         uint64_t notify_address = pci_bars_[4].address + 0x3000 + index * 4;
         manager_->UnregisterIoEvent(this, kIoResourceTypeMmio, notify_address);
@@ -90,19 +130,46 @@ void VirtioPci::Reset() {
 }
 
 void VirtioPci::SoftReset() {
+  std::list<IoThreadLockGuard> guards;
+  PauseQueueThreads(guards);
   isr_status_ = 0;
   for (uint index = 0; index < queues_.size(); index++) {
+    auto &vq = queues_[index];
+    for (auto element : vq.completed_elements) {
+      ReleaseElement(vq, element);
+    }
+    vq.completed_elements.clear();
+    vq.pending_interrupts = 0;
+    if (vq.interrupt_timer) {
+      RemoveQueueTimer(vq, &vq.interrupt_timer);
+    }
+
+    if (vq.poller) {
+      RemoveQueuePoller(vq);
+    }
+    vq.polling = false;
+
     queues_[index].index = index;
     if (queues_[index].enabled && use_ioevent_) {
       uint64_t notify_address = pci_bars_[4].address + 0x3000 + index * 4;
       manager_->UnregisterIoEvent(this, kIoResourceTypeMmio, notify_address);
     }
+    queues_[index].io_thread = nullptr;
     queues_[index].enabled = false;
     queues_[index].size = 0;
   }
 }
 
 bool VirtioPci::SaveState(MigrationWriter* writer) {
+  /* Don't leave completions or interrupts behind in the IoThread */
+  for (auto &vq : queues_) {
+    FlushQueue(vq);
+    if (vq.interrupt_timer) {
+      RemoveQueueTimer(vq, &vq.interrupt_timer);
+      InterruptQueue(vq);
+    }
+  }
+
   VirtioPciState state;
   auto common = state.mutable_common_config();
   common->set_guest_feature(driver_features_);
@@ -119,9 +186,17 @@ bool VirtioPci::SaveState(MigrationWriter* writer) {
     q->set_descriptor_table_address(queues_[index].descriptor_table_address);
     q->set_available_ring_address(queues_[index].available_ring_address);
     q->set_used_ring_address(queues_[index].used_ring_address);
+    q->set_used_index(queues_[index].used_index);
+    q->set_available_wrap_counter(queues_[index].available_wrap_counter);
+    q->set_used_wrap_counter(queues_[index].used_wrap_counter);
 
     if (dynamic_cast<MigrationNetworkWriter*>(writer)) {
-      manager_->AddDirtyMemory(queues_[index].used_ring_address, sizeof(VRingUsed) + queues_[index].size * sizeof(VRingUsedElement));
+      if (queues_[index].packed) {
+        /* Used descriptors are written in place */
+        manager_->AddDirtyMemory(queues_[index].descriptor_table_address, queues_[index].size * sizeof(VRingPackedDescriptor));
+      } else {
+        manager_->AddDirtyMemory(queues_[index].used_ring_address, sizeof(VRingUsed) + queues_[index].size * sizeof(VRingUsedElement));
+      }
     }
   }
   state.set_isr_status(isr_status_);
@@ -151,6 +226,9 @@ bool VirtioPci::LoadState(MigrationReader* reader) {
     queues_[index].descriptor_table_address = q.descriptor_table_address();
     queues_[index].available_ring_address = q.available_ring_address();
     queues_[index].used_ring_address = q.used_ring_address();
+    queues_[index].used_index = q.used_index();
+    queues_[index].available_wrap_counter = q.available_wrap_counter();
+    queues_[index].used_wrap_counter = q.used_wrap_counter();
     if (q.enabled()) {
       EnableQueue(index);
     }
@@ -160,6 +238,19 @@ bool VirtioPci::LoadState(MigrationReader* reader) {
 }
 
 void VirtioPci::PrintQueue(VirtQueue& vq) {
+  if (vq.packed) {
+    MV_LOG("packed queue index=%d size=%d available=%u wrap=%d used=%u wrap=%d descriptors: ", vq.index, vq.size,
+      vq.last_available_index, vq.available_wrap_counter, vq.used_index, vq.used_wrap_counter);
+    for (int i = 0; i < vq.size; i++) {
+      auto descriptor = &vq.packed_ring[i];
+      MV_LOG("descriptor address=0x%lx length=%x id=%x flags=%x", descriptor->address,
+        descriptor->length, descriptor->id, descriptor->flags);
+    }
+    MV_LOG("driver event flags=%x offset_wrap=%x device event flags=%x offset_wrap=%x",
+      vq.driver_event->flags, vq.driver_event->offset_wrap, vq.device_event->flags, vq.device_event->offset_wrap);
+    return;
+  }
+
   MV_LOG("queue index=%d size=%d descriptors: ", vq.index, vq.size);
   for (int i = 0; i < vq.size; i++) {
     auto descriptor = &vq.descriptor_table[i];
@@ -178,23 +269,45 @@ void VirtioPci::PrintQueue(VirtQueue& vq) {
   }
 }
 
-void VirtioPci::AddDescriptorToElement(VirtElement& element,  VRingDescriptor* descriptor) {
-  void* host = manager_->TranslateGuestMemory(descriptor->address);
+/* Pop and push of a queue run with the device or the queue locked, so the pool isn't locked */
+VirtElement* VirtioPci::AllocateElement(VirtQueue& vq) {
+  VirtElement* element;
+  if (vq.free_elements.empty()) {
+    element = new VirtElement;
+  } else {
+    element = vq.free_elements.back();
+    vq.free_elements.pop_back();
+  }
+  element->Initialize();
+  return element;
+}
+
+/* No more than a ring of elements are kept */
+void VirtioPci::ReleaseElement(VirtQueue& vq, VirtElement* element) {
+  if (vq.free_elements.size() < (size_t)vq.size) {
+    vq.free_elements.push_back(element);
+  } else {
+    delete element;
+  }
+}
+
+void VirtioPci::AddDescriptorToElement(VirtElement& element, uint64_t address, uint32_t length, uint16_t flags) {
+  void* host = manager_->TranslateGuestMemory(address);
   element.vector.push_back(iovec {
     .iov_base = host,
-    .iov_len = descriptor->length
+    .iov_len = length
   });
-  element.size += descriptor->length;
+  element.size += length;
 
-  if (descriptor->flags & VRING_DESC_F_WRITE) {
-    manager_->AddDirtyMemory(descriptor->address, descriptor->length);
+  if (flags & VRING_DESC_F_WRITE) {
+    manager_->AddDirtyMemory(address, length);
   }
 }
 
 void VirtioPci::ReadIndirectDescriptorTable(VirtElement& element, VRingDescriptor* table) {
   VRingDescriptor* descriptor = &table[0];
   while (true) {
-    AddDescriptorToElement(element, descriptor);
+    AddDescriptorToElement(element, descriptor->address, descriptor->length, descriptor->flags);
     if ((descriptor->flags & VRING_DESC_F_NEXT) == 0) {
       break;
     }
@@ -202,7 +315,91 @@ void VirtioPci::ReadIndirectDescriptorTable(VirtElement& element, VRingDescripto
   }
 }
 
+/* Descriptors are read in place from the packed ring. x86 doesn't reorder loads,
+ * so a compiler barrier after checking the flags is enough. */
+VirtElement* VirtioPci::PopPackedQueue(VirtQueue& vq) {
+  auto descriptor = &vq.packed_ring[vq.last_available_index];
+  uint16_t flags = *(volatile uint16_t*)&descriptor->flags;
+  bool available = flags & (1 << VRING_PACKED_DESC_F_AVAIL);
+  bool used = flags & (1 << VRING_PACKED_DESC_F_USED);
+  if (available == used || available != vq.available_wrap_counter) {
+    return nullptr;
+  }
+
+  asm volatile ("": : :"memory");
+
+  auto element = AllocateElement(vq);
+
+  /* Only the first descriptor of a chain is checked, the driver makes it available last */
+  while (true) {
+    if (flags & VRING_DESC_F_INDIRECT) {
+      auto table = (VRingPackedDescriptor*)manager_->TranslateGuestMemory(descriptor->address);
+      for (size_t i = 0; i < descriptor->length / sizeof(VRingPackedDescriptor); i++) {
+        AddDescriptorToElement(*element, table[i].address, table[i].length, table[i].flags);
+      }
+    } else {
+      AddDescriptorToElement(*element, descriptor->address, descriptor->length, flags);
+    }
+    element->id = descriptor->id;
+    element->descriptor_count++;
+
+    if (++vq.last_available_index == vq.size) {
+      vq.last_available_index = 0;
+      vq.available_wrap_counter = !vq.available_wrap_counter;
+    }
+    if ((flags & VRING_DESC_F_NEXT) == 0) {
+      break;
+    }
+    descriptor = &vq.packed_ring[vq.last_available_index];
+    flags = descriptor->flags;
+  }
+
+  element->length = 0;
+  return element;
+}
+
+/* Used descriptors are written from used_index on, whatever slots the buffers came
+ * from. The flags of the first one are written last, so the driver sees the whole
+ * batch at once. x86 doesn't reorder stores, a compiler barrier is enough. */
+void VirtioPci::PushPackedQueue(VirtQueue& vq, VirtElement** elements, size_t count) {
+  VRingPackedDescriptor* first = nullptr;
+  uint16_t first_flags = 0;
+  for (size_t i = 0; i < count; i++) {
+    auto element = elements[i];
+    auto descriptor = &vq.packed_ring[vq.used_index];
+    descriptor->id = element->id;
+    descriptor->length = element->length;
+    uint16_t flags = vq.used_wrap_counter ? (1 << VRING_PACKED_DESC_F_AVAIL) | (1 << VRING_PACKED_DESC_F_USED) : 0;
+    if (element->length) {
+      flags |= VRING_DESC_F_WRITE;
+    }
+    if (i == 0) {
+      first = descriptor;
+      first_flags = flags;
+    } else {
+      descriptor->flags = flags;
+    }
+
+    vq.used_index += element->descriptor_count;
+    if (vq.used_index >= vq.size) {
+      vq.used_index -= vq.size;
+      vq.used_wrap_counter = !vq.used_wrap_counter;
+    }
+    ReleaseElement(vq, element);
+  }
+
+  asm volatile ("": : :"memory");
+  if (first) {
+    *(volatile uint16_t*)&first->flags = first_flags;
+  }
+  vq.pending_interrupts += count;
+}
+
 VirtElement* VirtioPci::PopQueue(VirtQueue& vq) {
+  if (vq.packed) {
+    return PopPackedQueue(vq);
+  }
+
   asm volatile ("mfence": : :"memory");
 
   if (vq.available_ring->index == vq.last_available_index) {
@@ -211,11 +408,10 @@ VirtElement* VirtioPci::PopQueue(VirtQueue& vq) {
 
   asm volatile ("lfence": : :"memory");
 
-  auto element = new VirtElement;
-  element->Initialize();
+  auto element = AllocateElement(vq);
 
   auto item = vq.available_ring->items[vq.last_available_index++ % vq.size];
-  if (driver_features_ & (1 << VIRTIO_RING_F_EVENT_IDX)) {
+  if ((driver_features_ & (1 << VIRTIO_RING_F_EVENT_IDX)) && !vq.polling) {
     void* end = &vq.used_ring->items[vq.size];
     *(uint16_t*)end = vq.last_available_index;
   }
@@ -226,7 +422,7 @@ VirtElement* VirtioPci::PopQueue(VirtQueue& vq) {
       VRingDescriptor* table = (VRingDescriptor*)manager_->TranslateGuestMemory(descriptor->address);
       ReadIndirectDescriptorTable(*element, table);
     } else {
-      AddDescriptorToElement(*element, descriptor);
+      AddDescriptorToElement(*element, descriptor->address, descriptor->length, descriptor->flags);
     }
     if ((descriptor->flags & VRING_DESC_F_NEXT) == 0) {
       break;
@@ -240,20 +436,31 @@ VirtElement* VirtioPci::PopQueue(VirtQueue& vq) {
 }
 
 void VirtioPci::PushQueue(VirtQueue& vq, VirtElement* element) {
+  if (vq.packed) {
+    PushPackedQueue(vq, &element, 1);
+    return;
+  }
+
   asm volatile ("mfence": : :"memory");
 
   auto &item = vq.used_ring->items[vq.used_ring->index % vq.size];
   item.id = element->id;
   item.length = element->length;
-  delete element;
+  ReleaseElement(vq, element);
 
   /* Make sure other vCPU could see the buffer before we update index. */
   asm volatile ("sfence": : :"memory");
 
   ++vq.used_ring->index;
+  vq.pending_interrupts++;
 }
 
 void VirtioPci::PushQueueMultiple(VirtQueue& vq, std::vector<VirtElement*>& elements) {
+  if (vq.packed) {
+    PushPackedQueue(vq, elements.data(), elements.size());
+    return;
+  }
+
   asm volatile ("mfence": : :"memory");
 
   auto index = vq.used_ring->index;
@@ -261,22 +468,190 @@ void VirtioPci::PushQueueMultiple(VirtQueue& vq, std::vector<VirtElement*>& elem
     auto &item = vq.used_ring->items[index++ % vq.size];
     item.id = element->id;
     item.length = element->length;
-    delete element;
+    ReleaseElement(vq, element);
   }
 
   /* Make sure other vCPU could see the buffer before we update index. */
   asm volatile ("sfence": : :"memory");
 
   vq.used_ring->index = index;
+  vq.pending_interrupts += elements.size();
+}
+
+/* Push an element from a completion callback. Elements completed until the next
+ * IoThread iteration are pushed with one used index update and one notification.
+ * Completions come from image workers while the queue thread may be flushing. */
+void VirtioPci::PushQueueLater(VirtQueue& vq, VirtElement* element) {
+  std::lock_guard<std::recursive_mutex> lock(vq.mutex);
+  vq.completed_elements.push_back(element);
+  if (!vq.flush_scheduled) {
+    vq.flush_scheduled = true;
+    AddQueueTimer(vq, 0, [this, &vq]() {
+      vq.flush_scheduled = false;
+      FlushQueue(vq);
+    });
+  }
 }
 
+void VirtioPci::FlushQueue(VirtQueue& vq) {
+  if (vq.completed_elements.empty()) {
+    return;
+  }
+  PushQueueMultiple(vq, vq.completed_elements);
+  vq.completed_elements.clear();
+  NotifyQueue(vq);
+}
+
+/* Like vring_need_event(), but the event offset of the driver is a ring slot with a
+ * wrap counter. A wrap since the last interrupt could send one more interrupt. */
+bool VirtioPci::PackedQueueNeedsNotification(VirtQueue& vq) {
+  uint16_t flags = vq.driver_event->flags;
+  if (flags == VRING_PACKED_EVENT_FLAG_DISABLE) {
+    return false;
+  }
+  if (flags != VRING_PACKED_EVENT_FLAG_DESC || !(driver_features_ & (1 << VIRTIO_RING_F_EVENT_IDX))) {
+    return true;
+  }
+
+  uint16_t old_used = vq.signalled_used;
+  uint16_t new_used = vq.signalled_used = vq.used_index;
+  uint16_t offset_wrap = vq.driver_event->offset_wrap;
+  uint16_t event = offset_wrap & 0x7FFF;
+  if ((offset_wrap >> 15) != vq.used_wrap_counter) {
+    event -= vq.size;
+  }
+  return (uint16_t)(new_used - event - 1) < (uint16_t)(new_used - old_used);
+}
+
+/* With moderation, the interrupt is delayed until enough used buffers are pending
+ * or the delay of the first one passed. Used buffers are visible to the guest at once. */
 void VirtioPci::NotifyQueue(VirtQueue& vq) {
+  if (interrupt_delay_ns_ && vq.pending_interrupts > 0) {
+    if (interrupt_batch_ == 0 || vq.pending_interrupts < interrupt_batch_) {
+      if (!vq.interrupt_timer) {
+        vq.interrupt_timer = AddQueueTimer(vq, interrupt_delay_ns_, [this, &vq]() {
+          vq.interrupt_timer = nullptr;
+          InterruptQueue(vq);
+        });
+      }
+      return;
+    }
+    if (vq.interrupt_timer) {
+      RemoveQueueTimer(vq, &vq.interrupt_timer);
+    }
+  }
+  InterruptQueue(vq);
+}
+
+/* Timers of a queue run on its thread, and lock the queue instead of the device */
+IoTimer* VirtioPci::AddQueueTimer(VirtQueue& vq, int64_t interval_ns, VoidCallback callback) {
+  if (!vq.io_thread) {
+    return AddTimer(interval_ns, false, std::move(callback));
+  }
+  return vq.io_thread->AddTimer(nullptr, interval_ns, false, [&vq, callback = std::move(callback)]() {
+    std::lock_guard<std::recursive_mutex> lock(vq.mutex);
+    callback();
+  });
+}
+
+void VirtioPci::RemoveQueueTimer(VirtQueue& vq, IoTimer** timer) {
+  if (vq.io_thread) {
+    vq.io_thread->RemoveTimer(timer);
+  } else {
+    RemoveTimer(timer);
+  }
+}
+
+bool VirtioPci::QueueHasAvailable(VirtQueue& vq) {
+  if (vq.packed) {
+    uint16_t flags = *(volatile uint16_t*)&vq.packed_ring[vq.last_available_index].flags;
+    bool available = flags & (1 << VRING_PACKED_DESC_F_AVAIL);
+    bool used = flags & (1 << VRING_PACKED_DESC_F_USED);
+    return available != used && available == vq.available_wrap_counter;
+  }
+  return *(volatile uint16_t*)&vq.available_ring->index != vq.last_available_index;
+}
+
+/* With EVENT_IDX, the avail event is set behind the buffers the driver has added,
+ * so it doesn't kick again until the event is moved to the next buffer */
+void VirtioPci::SetQueueNotification(VirtQueue& vq, bool enabled) {
+  vq.polling = !enabled;
+  if (vq.packed) {
+    vq.device_event->flags = enabled ? VRING_PACKED_EVENT_FLAG_ENABLE : VRING_PACKED_EVENT_FLAG_DISABLE;
+  } else if (driver_features_ & (1 << VIRTIO_RING_F_EVENT_IDX)) {
+    void* end = &vq.used_ring->items[vq.size];
+    *(uint16_t*)end = enabled ? vq.last_available_index : vq.last_available_index - 1;
+  } else if (enabled) {
+    vq.used_ring->flags &= ~VRING_USED_F_NO_NOTIFY;
+  } else {
+    vq.used_ring->flags |= VRING_USED_F_NO_NOTIFY;
+  }
+  /* The ring is checked again after notifications are on */
+  asm volatile ("mfence": : :"memory");
+}
+
+/* Polling runs on the thread that handles notifications of the queue */
+void VirtioPci::AddQueuePoller(VirtQueue& vq) {
+  PollCallback poll = [this, &vq]() {
+    if (!QueueHasAvailable(vq)) {
+      return false;
+    }
+    vq.notification_callback();
+    return true;
+  };
+  PollNotifyCallback set_notification = [this, &vq](bool enabled) {
+    SetQueueNotification(vq, enabled);
+  };
+
+  if (vq.io_thread) {
+    vq.poller = vq.io_thread->AddPoller(nullptr, poll_max_ns_, [&vq, poll]() {
+      std::lock_guard<std::recursive_mutex> lock(vq.mutex);
+      return poll();
+    }, [&vq, set_notification](bool enabled) {
+      std::lock_guard<std::recursive_mutex> lock(vq.mutex);
+      set_notification(enabled);
+    });
+  } else {
+    vq.poller = manager_->io()->AddPoller(this, poll_max_ns_, poll, set_notification);
+  }
+}
+
+void VirtioPci::RemoveQueuePoller(VirtQueue& vq) {
+  if (vq.io_thread) {
+    vq.io_thread->RemovePoller(&vq.poller);
+  } else {
+    manager_->io()->RemovePoller(&vq.poller);
+  }
+}
+
+/* Queue threads don't take the device lock, so they are paused before queues are
+ * reset or their notifications are removed */
+void VirtioPci::PauseQueueThreads(std::list<IoThreadLockGuard>& guards) {
+  std::set<IoThread*> threads;
+  for (auto &vq : queues_) {
+    if (vq.io_thread) {
+      threads.insert(vq.io_thread);
+    }
+  }
+  for (auto thread : threads) {
+    guards.emplace_back(thread);
+  }
+}
+
+void VirtioPci::InterruptQueue(VirtQueue& vq) {
   asm volatile ("mfence": : :"memory");
 
-  if (driver_features_ & (1 << VIRTIO_RING_F_EVENT_IDX)) {
-    /* Carefully handle the overflow */
-    uint16_t compare = vq.used_ring->index - vq.available_ring->items[vq.size];
-    if (compare != 1) {
+  vq.pending_interrupts = 0;
+  if (vq.packed) {
+    if (!PackedQueueNeedsNotification(vq)) {
+      return;
+    }
+  } else if (driver_features_ & (1 << VIRTIO_RING_F_EVENT_IDX)) {
+    /* Like vring_need_event(), several buffers could be pushed since the last interrupt */
+    uint16_t old_used = vq.signalled_used;
+    uint16_t new_used = vq.signalled_used = vq.used_ring->index;
+    uint16_t event = vq.available_ring->items[vq.size];
+    if ((uint16_t)(new_used - event - 1) >= (uint16_t)(new_used - old_used)) {
       return;
     }
   } else if (vq.available_ring->flags & VRING_AVAIL_F_NO_INTERRUPT) {
@@ -307,6 +682,14 @@ void VirtioPci::AddQueue(uint16_t queue_size, VoidCallback callback) {
     vq.used_ring = nullptr;
     vq.enabled = false;
     vq.last_available_index = 0;
+    vq.packed = false;
+    vq.packed_ring = nullptr;
+    vq.driver_event = nullptr;
+    vq.device_event = nullptr;
+    vq.available_wrap_counter = true;
+    vq.used_wrap_counter = true;
+    vq.used_index = 0;
+    vq.signalled_used = 0;
     return;
   }
   MV_PANIC("exceeded queue size");
@@ -315,14 +698,39 @@ void VirtioPci::AddQueue(uint16_t queue_size, VoidCallback callback) {
 void VirtioPci::EnableQueue(uint16_t queue_index) {
   auto &vq = queues_[queue_index];
   MV_ASSERT(!vq.enabled);
-  vq.descriptor_table = (VRingDescriptor*)manager_->TranslateGuestMemory(vq.descriptor_table_address);
-  vq.available_ring = (VRingAvailable*)manager_->TranslateGuestMemory(vq.available_ring_address);
-  vq.used_ring = (VRingUsed*)manager_->TranslateGuestMemory(vq.used_ring_address);
-  MV_ASSERT(vq.descriptor_table && vq.available_ring && vq.used_ring);
+  /* Drivers without packed ring support don't accept the feature and use split rings */
+  vq.packed = driver_features_ & (1UL << VIRTIO_F_RING_PACKED);
+  if (vq.packed) {
+    vq.packed_ring = (VRingPackedDescriptor*)manager_->TranslateGuestMemory(vq.descriptor_table_address);
+    vq.driver_event = (VRingPackedEvent*)manager_->TranslateGuestMemory(vq.available_ring_address);
+    vq.device_event = (VRingPackedEvent*)manager_->TranslateGuestMemory(vq.used_ring_address);
+    MV_ASSERT(vq.packed_ring && vq.driver_event && vq.device_event);
+    /* Always kick, like the avail event of split rings */
+    vq.device_event->flags = VRING_PACKED_EVENT_FLAG_ENABLE;
+    vq.signalled_used = vq.used_index;
+  } else {
+    vq.descriptor_table = (VRingDescriptor*)manager_->TranslateGuestMemory(vq.descriptor_table_address);
+    vq.available_ring = (VRingAvailable*)manager_->TranslateGuestMemory(vq.available_ring_address);
+    vq.used_ring = (VRingUsed*)manager_->TranslateGuestMemory(vq.used_ring_address);
+    MV_ASSERT(vq.descriptor_table && vq.available_ring && vq.used_ring);
+    vq.signalled_used = vq.used_ring->index;
+  }
 
   if (use_ioevent_) {
     uint64_t notify_address = pci_bars_[4].address + 0x3000 + queue_index * 4;
-    manager_->RegisterIoEvent(this, kIoResourceTypeMmio, notify_address);
+    /* Each queue has its own MSI-X vector, so it could be served by another thread */
+    vq.io_thread = use_queue_threads_ && msi_config_.enabled ? manager_->queue_io(queue_index) : nullptr;
+    if (vq.io_thread) {
+      manager_->RegisterIoEvent(this, kIoResourceTypeMmio, notify_address, vq.io_thread, [&vq]() {
+        std::lock_guard<std::recursive_mutex> lock(vq.mutex);
+        vq.notification_callback();
+      });
+    } else {
+      manager_->RegisterIoEvent(this, kIoResourceTypeMmio, notify_address);
+    }
+    if (poll_max_ns_) {
+      AddQueuePoller(vq);
+    }
   }
 
   vq.enabled = true;
@@ -520,7 +928,11 @@ void VirtioPci::HandleQueueCallback(uint16_t queue_index) {
   MV_ASSERT(queue_index < queues_.size());
   auto &vq = queues_[queue_index];
   if (vq.enabled) {
-    if (use_ioevent_) {
+    if (vq.io_thread) {
+      /* Legacy notifications of a queue bound to a queue thread */
+      std::lock_guard<std::recursive_mutex> lock(vq.mutex);
+      vq.notification_callback();
+    } else if (use_ioevent_) {
       vq.notification_callback();
     } else {
       Schedule(vq.notification_callback);
@@ -23,7 +23,11 @@
 
 #include <linux/virtio_pci.h>
 #include <sys/uio.h>
-#include <deque>
+#include <vector>
+#include <list>
+#include <mutex>
+
+#include "iovec_list.h"
 
 /* We support indirect buffer descriptors */
 #define VIRTIO_RING_F_INDIRECT_DESC  28
@@ -82,8 +86,32 @@ struct VRingUsed {
   struct VRingUsedElement items[];
 } __attribute__((packed));
 
+/* Packed ring descriptors: 16 bytes. Available and used descriptors share one ring,
+ * a chain takes consecutive slots and the buffer id is in the last one. */
+struct VRingPackedDescriptor {
+  uint64_t address;
+  uint32_t length;
+  uint16_t id;
+/* Available when this bit differs from the used bit and matches the driver wrap counter,
+ * used when both bits match the device wrap counter. */
+#define VRING_PACKED_DESC_F_AVAIL  7
+#define VRING_PACKED_DESC_F_USED  15
+  uint16_t flags;
+} __attribute__((packed));
+
+/* Event suppression areas of the driver and the device */
+struct VRingPackedEvent {
+/* Bits 0-14 are the ring offset and bit 15 is the wrap counter */
+  uint16_t offset_wrap;
+#define VRING_PACKED_EVENT_FLAG_ENABLE  0x0
+#define VRING_PACKED_EVENT_FLAG_DISABLE 0x1
+#define VRING_PACKED_EVENT_FLAG_DESC    0x2
+  uint16_t flags;
+} __attribute__((packed));
+
 
 typedef std::function<void (void)> VoidCallback;
+struct VirtElement;
 struct VirtQueue {
   bool              enabled = false;
   int               msix_vector;
@@ -98,27 +126,64 @@ struct VirtQueue {
   uint64_t          descriptor_table_address;
   uint64_t          available_ring_address;
   uint64_t          used_ring_address;
+
+  /* With VIRTIO_F_RING_PACKED, the descriptor table address is the ring and the
+   * available and used ring addresses are the driver and device event areas */
+  bool                    packed;
+  VRingPackedDescriptor*  packed_ring;
+  VRingPackedEvent*       driver_event;
+  VRingPackedEvent*       device_event;
+  bool                    available_wrap_counter;
+  bool                    used_wrap_counter;
+  uint16_t                used_index;
+  uint16_t                signalled_used;
+
+  /* Elements pushed back are reused by the next pops of this queue */
+  std::vector<VirtElement*> free_elements;
+
+  /* Completions pushed together in the next IoThread iteration */
+  std::vector<VirtElement*> completed_elements;
+  bool                      flush_scheduled;
+  /* Used buffers not yet signalled, and the timer of a moderated interrupt */
+  size_t                    pending_interrupts;
+  IoTimer*                  interrupt_timer;
+
+  /* A queue bound to a queue thread is notified, flushed and interrupted there.
+   * The queue is locked instead of the device, completions lock it as well. */
+  IoThread*                 io_thread;
+  std::recursive_mutex      mutex;
+
+  /* Guest notifications are off while the thread of the queue polls the ring */
+  IoPoller*                 poller;
+  bool                      polling;
 };
 
+/* Elements are owned by their queue from PopQueue until PushQueue, devices keep
+ * pointers to them and never copy them */
 struct VirtElement {
   int                       id;
   uint32_t                  length;
-  std::deque<struct iovec>  vector;
+  IovecList                 vector;
   size_t                    size;
+  /* Slots of the packed ring taken by the chain */
+  uint16_t                  descriptor_count;
+
+  VirtElement() {}
+  VirtElement(const VirtElement&) = delete;
+  VirtElement& operator=(const VirtElement&) = delete;
 
   void Initialize() {
     id = length = size = 0;
+    descriptor_count = 0;
     vector.clear();
   }
-
- private:
-  /* disallow const copy */
-  const VirtElement& operator=(const VirtElement&);
 };
 
 class VirtioPci : public PciDevice {
  public:
   VirtioPci();
+  virtual ~VirtioPci();
+  virtual void Connect();
   virtual void Disconnect();
   virtual void Reset();
   virtual void SoftReset();
@@ -127,7 +192,21 @@ class VirtioPci : public PciDevice {
 
  private:
   void ReadIndirectDescriptorTable(VirtElement& element, VRingDescriptor* table);
-  void AddDescriptorToElement(VirtElement& element,  VRingDescriptor* descriptor);
+  void AddDescriptorToElement(VirtElement& element, uint64_t address, uint32_t length, uint16_t flags);
+  VirtElement* PopPackedQueue(VirtQueue& vq);
+  void PushPackedQueue(VirtQueue& vq, VirtElement** elements, size_t count);
+  bool PackedQueueNeedsNotification(VirtQueue& vq);
+  VirtElement* AllocateElement(VirtQueue& vq);
+  void ReleaseElement(VirtQueue& vq, VirtElement* element);
+  void FlushQueue(VirtQueue& vq);
+  void InterruptQueue(VirtQueue& vq);
+  IoTimer* AddQueueTimer(VirtQueue& vq, int64_t interval_ns, VoidCallback callback);
+  void RemoveQueueTimer(VirtQueue& vq, IoTimer** timer);
+  void PauseQueueThreads(std::list<IoThreadLockGuard>& guards);
+  bool QueueHasAvailable(VirtQueue& vq);
+  void SetQueueNotification(VirtQueue& vq, bool enabled);
+  void AddQueuePoller(VirtQueue& vq);
+  void RemoveQueuePoller(VirtQueue& vq);
   void ReadLegacyCommonConfig(uint64_t offset, uint8_t* data, uint32_t size);
   void WriteLegacyCommonConfig(uint64_t offset, uint8_t* data, uint32_t size);
   void ReadCommonConfig(uint64_t offset, uint8_t* data, uint32_t size);
@@ -142,6 +221,7 @@ class VirtioPci : public PciDevice {
   VirtElement* PopQueue(VirtQueue& vq);
   void PushQueue(VirtQueue& vq, VirtElement* element);
   void PushQueueMultiple(VirtQueue& vq, std::vector<VirtElement*>& elements);
+  void PushQueueLater(VirtQueue& vq, VirtElement* element);
   void NotifyQueue(VirtQueue& vq);
   void AddQueue(uint16_t queue_size, VoidCallback callback);
   virtual void EnableQueue(uint16_t queue_index);
@@ -154,6 +234,13 @@ class VirtioPci : public PciDevice {
   std::array<VirtQueue, 64>   queues_;
   uint8_t                     isr_status_;
   bool                        use_ioevent_ = false;
+  /* Bind queues to the queue threads of the machine if MSI-X is enabled */
+  bool                        use_queue_threads_ = false;
+  /* Interrupt moderation, zero delay raises interrupts at once */
+  uint64_t                    interrupt_delay_ns_ = 0;
+  size_t                      interrupt_batch_ = 0;
+  /* Busy polling of queues, zero waits for notifications only */
+  int64_t                     poll_max_ns_ = 0;
 };
 
 #endif // _MVISOR_DEVICES_VIRTIO_PCI_H
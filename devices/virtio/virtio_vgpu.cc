@@ -696,7 +696,7 @@ class VirtioVgpu : public VirtioPci {
   }
 
   // get information struct from iovec by custom size
-  void* EatIovec(std::deque<struct iovec>& iovec, size_t size) {
+  void* EatIovec(IovecList& iovec, size_t size) {
     MV_ASSERT(!iovec.empty());
     auto& front = iovec.front();
     void* ptr = front.iov_base;
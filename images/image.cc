@@ -18,11 +18,31 @@
 
 #include "disk_image.h"
 
+#include <sys/eventfd.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <linux/fs.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <cstring>
+#include <climits>
+#include <cmath>
+#include <algorithm>
+
+#include "version.h"
 #include "logger.h"
 #include "utilities.h"
 #include "device_manager.h"
 #include "pci_device.h"
 #include "qcow2.h"
+#include "machine.h"
+
+#ifdef HAS_LIBURING
+#include <liburing.h>
+#endif
+
+#define MAX_BOUNCE_BUFFERS    8
 
 
 DiskImage::DiskImage() {
@@ -36,12 +56,35 @@ DiskImage::~DiskImage()
     worker_cv_.notify_all();
   }
 
-  if (worker_thread_.joinable()) {
-    worker_thread_.join();
+  for (auto& thread : worker_threads_) {
+    if (thread.joinable()) {
+      thread.join();
+    }
+  }
+
+  DestroyAsyncIo();
+  if (io_) {
+    io_->UnregisterDiskImage(this);
+  }
+
+  for (auto &buffer : bounce_buffers_) {
+    free(buffer.second);
   }
 }
 
 DiskImage* DiskImage::Create(Device* host, Device* device, std::string path, bool readonly, bool snapshot) {
+  /* Images opened by tools have no device manager */
+  auto manager = device->manager();
+
+  /* Clones share the template images, writes go to private qcow2 overlays.
+   * Raw images can't be the backing file of an overlay. */
+  if (!readonly && manager && manager->machine()->clone()) {
+    if (path.find(".qcow2") == std::string::npos) {
+      MV_PANIC("clones need qcow2 images, %s is writable", path.c_str());
+    }
+    snapshot = true;
+  }
+
   DiskImage* image;
   if (path.find(".qcow2") != std::string::npos) {
     image = dynamic_cast<Qcow2Image*>(Object::Create("qcow2-image"));
@@ -54,58 +97,384 @@ DiskImage* DiskImage::Create(Device* host, Device* device, std::string path, boo
   image->snapshot_ = snapshot;
   image->host_device_ = host;
   image->device_ = device;
+  if (device->has_key("cache")) {
+    auto cache = std::get<std::string>((*device)["cache"]);
+    if (cache == "none") {
+      image->cache_mode_ = kImageCacheNone;
+    } else if (cache == "unsafe") {
+      image->cache_mode_ = kImageCacheUnsafe;
+    } else if (cache != "writeback") {
+      MV_PANIC("unknown cache mode %s, use none|writeback|unsafe", cache.c_str());
+    }
+  }
   image->Initialize();
   
-  image->io_ = device->manager()->io();
-  image->worker_thread_ = std::thread(&DiskImage::WorkerProcess, image);
+  image->io_ = manager ? manager->io() : nullptr;
+  if (device->has_key("aio") && std::get<std::string>((*device)["aio"]) == "io_uring") {
+    image->InitializeAsyncIo();
+  }
+
+  /* The io_uring engine has a single submitter */
+  size_t workers = 1;
+  if (device->has_key("workers") && !image->ring_) {
+    workers = std::max(1UL, std::get<uint64_t>((*device)["workers"]));
+  }
+  if (device->has_key("merge")) {
+    image->merge_ = std::get<bool>((*device)["merge"]);
+  }
+  if (device->has_key("max_merge_bytes")) {
+    image->max_merge_bytes_ = std::get<uint64_t>((*device)["max_merge_bytes"]);
+  }
+  image->InitializeThrottle();
+  if (image->io_) {
+    image->io_->RegisterDiskImage(image);
+  }
+  for (size_t i = 0; i < workers; i++) {
+    image->worker_threads_.emplace_back(&DiskImage::WorkerProcess, image);
+  }
   return image;
 }
 
+/* Called with worker_mutex_ locked */
+bool DiskImage::CanStartJob() {
+  if (worker_queue_.empty() || barrier_running_) {
+    return false;
+  }
+  return !worker_queue_.front().barrier || worker_running_ == 0;
+}
+
 void DiskImage::WorkerProcess() {
   SetThreadName("mvisor-disk");
-  
-  io_->RegisterDiskImage(this);
-
-  while (!finalized_) {
-    std::unique_lock<std::mutex> lock(worker_mutex_);
-    worker_cv_.wait(lock, [this]() {
-      return !worker_queue_.empty() || finalized_;
-    });
 
+  std::unique_lock<std::mutex> lock(worker_mutex_);
+  while (true) {
+    if (!throttled_jobs_.empty()) {
+      ReleaseThrottledJobs();
+    }
     if (finalized_) {
       break;
     }
+    if (!CanStartJob()) {
+      if (throttled_jobs_.empty()) {
+        worker_cv_.wait(lock);
+      } else {
+        worker_cv_.wait_until(lock, throttle_release_time_);
+      }
+      continue;
+    }
 
-    auto& callback = worker_queue_.front();
+    auto job = std::move(worker_queue_.front());
+    worker_queue_.pop_front();
+    worker_running_++;
+    barrier_running_ = job.barrier;
+    auto start_time = std::chrono::steady_clock::now();
+    statistics_.queue_wait.Add(std::chrono::duration_cast<std::chrono::nanoseconds>(
+      start_time - job.queued_time).count());
+    size_t requests = job.callback ? 1 : job.completions.size();
     lock.unlock();
   
-    callback();
+    bool completed = true;
+    if (job.callback) {
+      job.callback();
+    } else {
+      completed = RunRequestJob(job, requests, start_time);
+    }
 
-    /* Only remove item after job is done.
-     * Remember to lock mutex again when operating on worker_queue_
-     */
+    /* Remember to lock mutex again when operating on worker_queue_ */
     lock.lock();
-    worker_queue_.pop_front();
+    if (completed) {
+      RecordCompletion(requests, start_time);
+    }
+    worker_running_--;
+    if (job.barrier) {
+      barrier_running_ = false;
+    }
+    worker_cv_.notify_all();
   }
-  
-  io_->UnregisterDiskImage(this);
 }
 
+/* Called with worker_mutex_ locked */
+void DiskImage::RecordCompletion(size_t requests, IoTimePoint start_time) {
+  statistics_.service.Add(std::chrono::duration_cast<std::chrono::nanoseconds>(
+    std::chrono::steady_clock::now() - start_time).count());
+  statistics_.inflight -= requests;
+}
+
+/* Return false if the request is submitted to io_uring and completes later */
+bool DiskImage::RunRequestJob(DiskImageJob& job, size_t requests, IoTimePoint start_time) {
+  IoCallback callback;
+  if (job.completions.size() == 1) {
+    callback = std::move(job.completions.front().second);
+  } else {
+    /* Split the result of a merged request in the order of the original requests */
+    callback = [completions = std::move(job.completions)](ssize_t ret) {
+      for (auto &completion : completions) {
+        if (ret < 0) {
+          completion.second(ret);
+        } else {
+          size_t done = std::min((size_t)ret, completion.first);
+          completion.second(done);
+          ret -= done;
+        }
+      }
+    };
+  }
+
+  if (ring_) {
+    if (SubmitAsyncIo(job.request, callback, requests, start_time)) {
+      return false;
+    }
+    /* Synchronous requests may change metadata of clusters in flight */
+    DrainAsyncIo();
+  }
+  auto ret = HandleIoRequest(job.request);
+  std::lock_guard<std::recursive_mutex> device_lock(host_device_->mutex());
+  callback(ret);
+  return true;
+}
+
+/* Called with worker_mutex_ locked, append the request to the last queued job if adjacent */
+void DiskImage::PushJob(DiskImageJob job) {
+  if (merge_ && !job.barrier && !worker_queue_.empty()) {
+    auto &last = worker_queue_.back();
+    auto &request = last.request;
+    if (!last.barrier && !last.callback && request.type == job.request.type &&
+        request.position + request.length == job.request.position &&
+        request.length + job.request.length <= max_merge_bytes_ &&
+        request.vector.size() + job.request.vector.size() <= IOV_MAX) {
+      request.length += job.request.length;
+      request.vector.insert(request.vector.end(), job.request.vector.begin(), job.request.vector.end());
+      for (auto &completion : job.completions) {
+        last.completions.emplace_back(std::move(completion));
+      }
+      statistics_.merged_requests++;
+      return;
+    }
+  }
+  worker_queue_.push_back(std::move(job));
+}
+
+/* Called with worker_mutex_ locked, sort held requests by position like an elevator */
+void DiskImage::DispatchPluggedJobs() {
+  std::stable_sort(plugged_jobs_.begin(), plugged_jobs_.end(), [](auto& a, auto& b) {
+    return a.request.position < b.request.position;
+  });
+  for (auto &job : plugged_jobs_) {
+    QueueJob(std::move(job));
+  }
+  plugged_jobs_.clear();
+  worker_cv_.notify_all();
+}
+
+void DiskImage::Plug() {
+  std::lock_guard<std::mutex> lock(worker_mutex_);
+  plugged_++;
+}
+
+void DiskImage::Unplug() {
+  std::lock_guard<std::mutex> lock(worker_mutex_);
+  MV_ASSERT(plugged_ > 0);
+  if (--plugged_ == 0 && !plugged_jobs_.empty()) {
+    DispatchPluggedJobs();
+  }
+}
+
+DiskImageStatistics DiskImage::statistics() {
+  DiskImageStatistics statistics;
+  {
+    std::lock_guard<std::mutex> lock(worker_mutex_);
+    statistics_.throttle_queue = throttled_jobs_.size();
+    statistics = statistics_;
+  }
+  GetFormatStatistics(&statistics);
+  return statistics;
+}
+
+void DiskImage::GetFormatStatistics(DiskImageStatistics* statistics) {
+  MV_UNUSED(statistics);
+}
+
+void DiskLatencyHistogram::Add(uint64_t ns) {
+  uint64_t us = ns / 1000;
+  int bucket = us ? std::min(63 - __builtin_clzll(us), DISK_LATENCY_BUCKETS - 1) : 0;
+  buckets[bucket]++;
+  count++;
+  total_ns += ns;
+}
+
+uint64_t DiskLatencyHistogram::Percentile(double percent) const {
+  uint64_t target = std::ceil(count * percent / 100), sum = 0;
+  for (int i = 0; i < DISK_LATENCY_BUCKETS; i++) {
+    sum += buckets[i];
+    if (sum >= target && sum > 0) {
+      return 2UL << i;
+    }
+  }
+  return 0;
+}
+
+/* Each limit has an optional burst key, e.g. write_iops_burst, the default
+ * bucket holds 100ms of traffic */
+void DiskImage::InitializeThrottle() {
+  static const char* keys[kThrottleLimits] = { "read_iops", "read_bps", "write_iops", "write_bps" };
+  for (int i = 0; i < kThrottleLimits; i++) {
+    if (!device_->has_key(keys[i])) {
+      continue;
+    }
+    auto& bucket = throttle_buckets_[i];
+    bucket.rate = std::get<uint64_t>((*device_)[keys[i]]);
+    bucket.burst = std::max(1.0, bucket.rate / 10);
+    auto burst_key = std::string(keys[i]) + "_burst";
+    if (device_->has_key(burst_key)) {
+      bucket.burst = std::max(1.0, (double)std::get<uint64_t>((*device_)[burst_key]));
+    }
+    bucket.tokens = bucket.burst;
+    if (bucket.rate > 0) {
+      throttle_ = true;
+    }
+  }
+  throttle_refill_time_ = std::chrono::steady_clock::now();
+}
+
+/* Called with worker_mutex_ locked */
+void DiskImage::RefillThrottle(IoTimePoint now) {
+  double seconds = std::chrono::duration<double>(now - throttle_refill_time_).count();
+  throttle_refill_time_ = now;
+  for (auto &bucket : throttle_buckets_) {
+    if (bucket.rate > 0) {
+      bucket.tokens = std::min(bucket.burst, bucket.tokens + bucket.rate * seconds);
+    }
+  }
+}
+
+/* Called with worker_mutex_ locked, take tokens for a read or write request.
+ * Return 0 if the request can start, otherwise nanoseconds to wait. */
+int64_t DiskImage::ChargeThrottle(const ImageIoRequest& request) {
+  if (request.type != kImageIoRead && request.type != kImageIoWrite) {
+    return 0;
+  }
+  auto buckets = &throttle_buckets_[request.type == kImageIoRead ? kThrottleReadIops : kThrottleWriteIops];
+  double wait = 0;
+  for (int i = 0; i < 2; i++) {
+    if (buckets[i].rate > 0 && buckets[i].tokens < 0) {
+      wait = std::max(wait, -buckets[i].tokens / buckets[i].rate);
+    }
+  }
+  if (wait > 0) {
+    return std::max(1L, (int64_t)std::ceil(wait * NS_PER_SECOND));
+  }
+  buckets[0].tokens -= 1;
+  buckets[1].tokens -= request.length;
+  return 0;
+}
+
+/* Called with worker_mutex_ locked, requests are held in order once one is held,
+ * so barriers queued after held writes still wait for them */
+void DiskImage::QueueJob(DiskImageJob job) {
+  if (throttle_) {
+    auto now = std::chrono::steady_clock::now();
+    if (throttled_jobs_.empty()) {
+      RefillThrottle(now);
+      if (ChargeThrottle(job.request) == 0) {
+        PushJob(std::move(job));
+        return;
+      }
+      throttle_release_time_ = now;
+    }
+    if (!job.barrier) {
+      statistics_.throttled_requests++;
+    }
+    job.throttled_time = now;
+    throttled_jobs_.push_back(std::move(job));
+    return;
+  }
+  PushJob(std::move(job));
+}
+
+/* Called by workers with worker_mutex_ locked, move held requests that have
+ * enough tokens to the worker queue and set the next release deadline */
+void DiskImage::ReleaseThrottledJobs() {
+  auto now = std::chrono::steady_clock::now();
+  if (now < throttle_release_time_) {
+    return;
+  }
+  RefillThrottle(now);
+  while (!throttled_jobs_.empty()) {
+    auto& job = throttled_jobs_.front();
+    auto wait_ns = ChargeThrottle(job.request);
+    if (wait_ns > 0) {
+      throttle_release_time_ = now + std::chrono::nanoseconds(wait_ns);
+      break;
+    }
+    if (!job.barrier) {
+      statistics_.throttle_delay_ns += std::chrono::duration_cast<std::chrono::nanoseconds>(
+        now - job.throttled_time).count();
+    }
+    PushJob(std::move(job));
+    throttled_jobs_.pop_front();
+    worker_cv_.notify_all();
+  }
+}
 
 void DiskImage::QueueIoRequest(ImageIoRequest request, IoCallback callback) {
+  /* Flush waits for earlier writes, discards may free clusters that other workers are using */
+  bool barrier = request.type != kImageIoRead && request.type != kImageIoWrite;
+
+  DiskImageJob job = {
+    .barrier = barrier,
+    .callback = nullptr,
+    .request = std::move(request)
+  };
+  job.completions.emplace_back(job.request.length, std::move(callback));
+  job.queued_time = std::chrono::steady_clock::now();
+
   std::lock_guard<std::mutex> lock(worker_mutex_);
-  worker_queue_.emplace_back([this, request = std::move(request), callback = std::move(callback)]() {
-    auto ret = HandleIoRequest(std::move(request));
-    std::lock_guard<std::recursive_mutex> device_lock(host_device_->mutex());
-    callback(ret);
-  });
+  if (!barrier) {
+    statistics_.requests++;
+  }
+  statistics_.operations[job.request.type]++;
+  statistics_.bytes[job.request.type] += job.request.length;
+  statistics_.max_inflight = std::max(statistics_.max_inflight, ++statistics_.inflight);
+  if (merge_ && plugged_ > 0 && !barrier) {
+    plugged_jobs_.push_back(std::move(job));
+    return;
+  }
+  if (!plugged_jobs_.empty()) {
+    DispatchPluggedJobs();
+  }
+  QueueJob(std::move(job));
+  worker_cv_.notify_all();
+}
+
+void DiskImage::QueueBarrier(VoidCallback callback) {
+  DiskImageJob job = { true, std::move(callback) };
+  job.queued_time = std::chrono::steady_clock::now();
 
+  std::lock_guard<std::mutex> lock(worker_mutex_);
+  statistics_.max_inflight = std::max(statistics_.max_inflight, ++statistics_.inflight);
+  if (!plugged_jobs_.empty()) {
+    DispatchPluggedJobs();
+  }
+  QueueJob(std::move(job));
   worker_cv_.notify_all();
 }
 
+/* The requests are counted by type, but in flight as one */
 void DiskImage::QueueMultipleIoRequests(std::vector<ImageIoRequest> requests, IoCallback callback) {
+  auto queued_time = std::chrono::steady_clock::now();
   std::lock_guard<std::mutex> lock(worker_mutex_);
-  worker_queue_.emplace_back([this, requests = std::move(requests), callback = std::move(callback)]() {
+  for (auto &request : requests) {
+    statistics_.operations[request.type]++;
+    statistics_.bytes[request.type] += request.length;
+  }
+  statistics_.max_inflight = std::max(statistics_.max_inflight, ++statistics_.inflight);
+  if (!plugged_jobs_.empty()) {
+    DispatchPluggedJobs();
+  }
+  DiskImageJob job = { true, [this, requests = std::move(requests), callback = std::move(callback)]() {
+    if (ring_) {
+      DrainAsyncIo();
+    }
     long ret, total = 0;
     for (auto &req: requests) {
       ret = HandleIoRequest(req);
@@ -118,12 +487,467 @@ void DiskImage::QueueMultipleIoRequests(std::vector<ImageIoRequest> requests, Io
 
     std::lock_guard<std::recursive_mutex> device_lock(host_device_->mutex());
     callback(total);
-  });
+  }};
+  job.queued_time = queued_time;
+  QueueJob(std::move(job));
 
   worker_cv_.notify_all();
 }
 
 bool DiskImage::busy() {
+  {
+    std::lock_guard<std::mutex> lock(ring_mutex_);
+    if (ring_inflight_ > 0) {
+      return true;
+    }
+  }
   std::lock_guard<std::mutex> lock(worker_mutex_);
-  return !worker_queue_.empty();
+  return !worker_queue_.empty() || !plugged_jobs_.empty() || !throttled_jobs_.empty() || worker_running_ > 0;
+}
+
+bool DiskImage::PrepareAsyncIo(const ImageIoRequest& request, ImageAsyncIo& async_io) {
+  MV_UNUSED(request);
+  MV_UNUSED(async_io);
+  return false;
 }
+
+/* Open with O_DIRECT for cache=none, fallback to the page cache if the
+ * file system doesn't support it, e.g. tmpfs */
+int DiskImage::OpenFile(const std::string& path, int flags) {
+  if (cache_mode_ == kImageCacheNone) {
+    int fd = open(path.c_str(), flags | O_DIRECT);
+    if (fd >= 0) {
+      direct_alignment_ = ProbeDirectAlignment(fd);
+      return fd;
+    } else if (errno != EINVAL) {
+      return fd;
+    }
+    MV_WARN("O_DIRECT is not supported for %s, use cache=writeback", path.c_str());
+    cache_mode_ = kImageCacheWriteback;
+  }
+  return open(path.c_str(), flags);
+}
+
+/* 4K native disks reject 512 bytes aligned O_DIRECT requests. Use the alignment
+ * reported by statx(), the sector size of block devices, or probe with reads */
+size_t DiskImage::ProbeDirectAlignment(int fd) {
+#ifdef STATX_DIOALIGN
+  struct statx stx;
+  if (statx(fd, "", AT_EMPTY_PATH, STATX_DIOALIGN, &stx) == 0 && (stx.stx_mask & STATX_DIOALIGN) &&
+      stx.stx_dio_offset_align) {
+    return std::max(stx.stx_dio_offset_align, stx.stx_dio_mem_align);
+  }
+#endif
+
+  struct stat st;
+  int sector_size;
+  if (fstat(fd, &st) == 0 && S_ISBLK(st.st_mode) && ioctl(fd, BLKSSZGET, &sector_size) == 0) {
+    return sector_size;
+  }
+
+  auto buffer = aligned_alloc(PAGE_SIZE, PAGE_SIZE);
+  MV_ASSERT(buffer);
+  size_t alignment = 512;
+  while (alignment < PAGE_SIZE && pread(fd, buffer, alignment, 0) < 0 && errno == EINVAL) {
+    alignment <<= 1;
+  }
+  free(buffer);
+  return alignment;
+}
+
+/* O_DIRECT needs the offset, lengths and buffers aligned to the logical block size */
+bool DiskImage::IsDirectAligned(const iovec* vector, size_t count, off_t offset) {
+  if (offset % direct_alignment_) {
+    return false;
+  }
+  for (size_t i = 0; i < count; i++) {
+    if (((uint64_t)vector[i].iov_base | vector[i].iov_len) % direct_alignment_) {
+      return false;
+    }
+  }
+  return true;
+}
+
+/* preadv / pwritev with IOV_MAX entries per call. The vector is only copied
+ * when a short transfer stops inside an entry, to resume from there.
+ * Misaligned O_DIRECT requests are bounced. */
+ssize_t DiskImage::VectorFileIo(int fd, bool is_write, const iovec* vector, size_t count, off_t offset) {
+  if (cache_mode_ == kImageCacheNone && !IsDirectAligned(vector, count, offset)) {
+    return BounceFileIo(fd, is_write, vector, count, offset);
+  }
+
+  std::vector<iovec> resumed;
+  size_t total = 0;
+  while (count > 0) {
+    int batch = std::min(count, (size_t)IOV_MAX);
+    ssize_t ret;
+    if (is_write) {
+      ret = pwritev(fd, vector, batch, offset);
+    } else {
+      ret = preadv(fd, vector, batch, offset);
+    }
+    if (ret < 0) {
+      return total ? total : ret;
+    } else if (ret == 0) {
+      break;
+    }
+    total += ret;
+    offset += ret;
+
+    /* Skip the entries fully transferred */
+    while (count > 0 && (size_t)ret >= vector->iov_len) {
+      ret -= vector->iov_len;
+      vector++;
+      count--;
+    }
+    if (ret > 0) {
+      resumed.assign(vector, vector + count);
+      resumed[0].iov_base = (uint8_t*)resumed[0].iov_base + ret;
+      resumed[0].iov_len -= ret;
+      vector = resumed.data();
+    }
+  }
+  return total;
+}
+
+/* Copy through an aligned buffer covering the aligned range. Partial blocks at
+ * both ends of a write are read first, so the aligned range stays locked until
+ * the write completes. Otherwise two workers (or unlocked qcow2 data writes)
+ * writing different sectors of the same block would each rewrite the other's
+ * sectors with stale data. */
+ssize_t DiskImage::BounceFileIo(int fd, bool is_write, const iovec* vector, size_t count, off_t offset) {
+  size_t length = 0;
+  for (size_t i = 0; i < count; i++) {
+    length += vector[i].iov_len;
+  }
+  size_t alignment = direct_alignment_;
+  off_t start = offset & ~(alignment - 1);
+  off_t end = ALIGN(offset + length, alignment);
+  size_t size = end - start;
+  auto buffer = (uint8_t*)AcquireBounceBuffer(size);
+  auto data = buffer + (offset - start);
+  iovec bounce = { .iov_base = buffer, .iov_len = size };
+  ssize_t ret = 0;
+
+  if (is_write) {
+    bool partial = start != offset || end != offset + (off_t)length;
+    if (partial) {
+      LockBounceRange(start, end);
+    }
+    /* Blocks beyond the end of file read as zeros, errors fail the write */
+    if (start != offset) {
+      bzero(buffer, alignment);
+      ret = pread(fd, buffer, alignment, start);
+    }
+    if (ret >= 0 && end != offset + (off_t)length && (start == offset || size > alignment)) {
+      bzero(buffer + size - alignment, alignment);
+      ret = pread(fd, buffer + size - alignment, alignment, end - alignment);
+    }
+    if (ret >= 0) {
+      auto ptr = data;
+      for (size_t i = 0; i < count; i++) {
+        memcpy(ptr, vector[i].iov_base, vector[i].iov_len);
+        ptr += vector[i].iov_len;
+      }
+      ret = VectorFileIo(fd, true, &bounce, 1, start);
+      if (ret >= 0) {
+        ret = std::max(0L, std::min(ret - (offset - start), (ssize_t)length));
+      }
+    }
+    if (partial) {
+      UnlockBounceRange(start, end);
+    }
+  } else {
+    ret = VectorFileIo(fd, false, &bounce, 1, start);
+    if (ret >= 0) {
+      ret = std::max(0L, std::min(ret - (offset - start), (ssize_t)length));
+      auto ptr = data;
+      size_t remain = ret;
+      for (size_t i = 0; i < count; i++) {
+        size_t copy = std::min(remain, vector[i].iov_len);
+        memcpy(vector[i].iov_base, ptr, copy);
+        ptr += copy;
+        remain -= copy;
+      }
+    }
+  }
+
+  ReleaseBounceBuffer(buffer, size);
+  return ret;
+}
+
+/* Wait until no other bounced write overlaps the aligned range */
+void DiskImage::LockBounceRange(off_t start, off_t end) {
+  std::unique_lock<std::mutex> lock(bounce_mutex_);
+  bounce_cv_.wait(lock, [this, start, end]() {
+    for (auto& range : bounce_ranges_) {
+      if (range.first < end && start < range.second) {
+        return false;
+      }
+    }
+    return true;
+  });
+  bounce_ranges_.emplace_back(start, end);
+}
+
+void DiskImage::UnlockBounceRange(off_t start, off_t end) {
+  std::lock_guard<std::mutex> lock(bounce_mutex_);
+  for (auto it = bounce_ranges_.begin(); it != bounce_ranges_.end(); ++it) {
+    if (it->first == start && it->second == end) {
+      bounce_ranges_.erase(it);
+      break;
+    }
+  }
+  bounce_cv_.notify_all();
+}
+
+void* DiskImage::AcquireBounceBuffer(size_t size) {
+  {
+    std::lock_guard<std::mutex> lock(bounce_mutex_);
+    for (auto it = bounce_buffers_.begin(); it != bounce_buffers_.end(); ++it) {
+      if (it->first >= size) {
+        auto buffer = it->second;
+        bounce_buffers_.erase(it);
+        return buffer;
+      }
+    }
+  }
+  size_t alignment = std::max((size_t)PAGE_SIZE, direct_alignment_);
+  auto buffer = aligned_alloc(alignment, ALIGN(size, alignment));
+  MV_ASSERT(buffer);
+  return buffer;
+}
+
+/* Keep a few buffers for later requests, the buffer size is rounded up to pages
+ * or the O_DIRECT alignment if larger */
+void DiskImage::ReleaseBounceBuffer(void* buffer, size_t size) {
+  std::lock_guard<std::mutex> lock(bounce_mutex_);
+  if (bounce_buffers_.size() < MAX_BOUNCE_BUFFERS) {
+    bounce_buffers_.emplace_back(ALIGN(size, std::max((size_t)PAGE_SIZE, direct_alignment_)), buffer);
+  } else {
+    free(buffer);
+  }
+}
+
+#ifdef HAS_LIBURING
+
+/* Completions are signaled through an eventfd polled by the IoThread,
+ * so callbacks run on the IoThread with the host device locked */
+void DiskImage::InitializeAsyncIo() {
+  if (!io_) {
+    MV_WARN("io_uring needs an IoThread, %s uses worker threads", filepath_.c_str());
+    return;
+  }
+  if (device_->has_key("queue_depth")) {
+    ring_depth_ = std::get<uint64_t>((*device_)["queue_depth"]);
+  }
+
+  ring_ = new struct io_uring;
+  int ret = io_uring_queue_init(ring_depth_, ring_, 0);
+  if (ret < 0) {
+    MV_WARN("failed to setup io_uring for %s, ret=%d", filepath_.c_str(), ret);
+    delete ring_;
+    ring_ = nullptr;
+    return;
+  }
+
+  ring_event_fd_ = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  MV_ASSERT(ring_event_fd_ >= 0);
+  MV_ASSERT(io_uring_register_eventfd(ring_, ring_event_fd_) == 0);
+  io_->StartPolling(host_device_, ring_event_fd_, EPOLLIN, [this](auto events) {
+    MV_UNUSED(events);
+    ReapAsyncIo();
+  });
+}
+
+void DiskImage::DestroyAsyncIo() {
+  if (!ring_) {
+    return;
+  }
+  DrainAsyncIo();
+  io_->StopPolling(ring_event_fd_);
+  io_uring_queue_exit(ring_);
+  safe_close(&ring_event_fd_);
+  delete ring_;
+  ring_ = nullptr;
+}
+
+/* Called with ring_mutex_ locked */
+void DiskImage::PrepareAsyncSegment(ImageAsyncSegment* segment) {
+  auto sqe = io_uring_get_sqe(ring_);
+  while (sqe == nullptr) {
+    io_uring_submit(ring_);
+    sqe = io_uring_get_sqe(ring_);
+  }
+
+  auto async_io = segment->async_io;
+  if (segment->vector.empty()) {
+    /* Flush waits for all earlier requests to complete */
+    io_uring_prep_fsync(sqe, async_io->fd, 0);
+    sqe->flags |= IOSQE_IO_DRAIN;
+  } else if (async_io->is_write) {
+    io_uring_prep_writev(sqe, async_io->fd, segment->vector.data(), segment->vector.size(), segment->offset);
+  } else {
+    io_uring_prep_readv(sqe, async_io->fd, segment->vector.data(), segment->vector.size(), segment->offset);
+  }
+  io_uring_sqe_set_data(sqe, segment);
+}
+
+/* Called on the worker thread */
+bool DiskImage::SubmitAsyncIo(const ImageIoRequest& request, IoCallback& callback, size_t requests,
+  IoTimePoint start_time) {
+  /* Misaligned O_DIRECT requests are bounced by HandleIoRequest() */
+  if (cache_mode_ == kImageCacheNone &&
+      !IsDirectAligned(request.vector.data(), request.vector.size(), request.position)) {
+    return false;
+  }
+
+  auto async_io = new ImageAsyncIo;
+  if (!PrepareAsyncIo(request, *async_io)) {
+    delete async_io;
+    return false;
+  }
+
+  async_io->pending = async_io->segments.size() + (async_io->fsync ? 1 : 0);
+  if (async_io->pending == 0 || async_io->result < 0) {
+    {
+      std::lock_guard<std::recursive_mutex> device_lock(host_device_->mutex());
+      callback(async_io->result);
+    }
+    delete async_io;
+    std::lock_guard<std::mutex> lock(worker_mutex_);
+    RecordCompletion(requests, start_time);
+    return true;
+  }
+  async_io->is_write = request.type == kImageIoWrite;
+  async_io->callback = std::move(callback);
+  async_io->requests = requests;
+  async_io->start_time = start_time;
+
+  /* Wait for free slots if the queue is full */
+  std::unique_lock<std::mutex> lock(ring_mutex_);
+  ring_cv_.wait(lock, [this, async_io]() {
+    return ring_inflight_ + async_io->pending <= ring_depth_ || ring_inflight_ == 0;
+  });
+  ring_inflight_ += async_io->pending;
+
+  for (auto& segment : async_io->segments) {
+    segment.async_io = async_io;
+    PrepareAsyncSegment(&segment);
+  }
+  if (async_io->fsync) {
+    async_io->flush.async_io = async_io;
+    PrepareAsyncSegment(&async_io->flush);
+  }
+
+  int ret = io_uring_submit(ring_);
+  if (ret < 0) {
+    MV_PANIC("failed to submit io_uring requests, ret=%d", ret);
+  }
+  return true;
+}
+
+/* Called on the IoThread with host device locked */
+void DiskImage::ReapAsyncIo() {
+  uint64_t value;
+  while (read(ring_event_fd_, &value, sizeof(value)) > 0) {
+  }
+
+  io_uring_cqe* cqe;
+  unsigned head, count = 0;
+  std::vector<std::pair<size_t, IoTimePoint>> completed;
+  std::vector<ImageAsyncSegment*> resubmit;
+  io_uring_for_each_cqe(ring_, head, cqe) {
+    ++count;
+    auto segment = (ImageAsyncSegment*)io_uring_cqe_get_data(cqe);
+    auto async_io = segment->async_io;
+    if (cqe->res < 0) {
+      async_io->result = cqe->res;
+    } else if (cqe->res > 0) {
+      if (async_io->result >= 0) {
+        async_io->result += cqe->res;
+      }
+
+      /* Resume a short transfer from the partially done entry, a read stops at EOF */
+      size_t done = cqe->res;
+      auto& vector = segment->vector;
+      auto it = vector.begin();
+      while (it != vector.end() && done >= it->iov_len) {
+        done -= it->iov_len;
+        ++it;
+      }
+      if (it != vector.end()) {
+        it->iov_base = (uint8_t*)it->iov_base + done;
+        it->iov_len -= done;
+        vector.erase(vector.begin(), it);
+        segment->offset += cqe->res;
+        if (async_io->result >= 0) {
+          resubmit.push_back(segment);
+          continue;
+        }
+      }
+    }
+
+    if (--async_io->pending == 0) {
+      async_io->callback(async_io->result);
+      completed.emplace_back(async_io->requests, async_io->start_time);
+      delete async_io;
+    }
+  }
+  io_uring_cq_advance(ring_, count);
+
+  /* Callbacks may queue requests, so statistics are recorded after them */
+  if (!completed.empty()) {
+    std::lock_guard<std::mutex> lock(worker_mutex_);
+    for (auto &item : completed) {
+      RecordCompletion(item.first, item.second);
+    }
+  }
+
+  /* Resubmitted segments keep their slots */
+  std::lock_guard<std::mutex> lock(ring_mutex_);
+  if (!resubmit.empty()) {
+    for (auto segment : resubmit) {
+      PrepareAsyncSegment(segment);
+    }
+    int ret = io_uring_submit(ring_);
+    if (ret < 0) {
+      MV_PANIC("failed to submit io_uring requests, ret=%d", ret);
+    }
+  }
+  ring_inflight_ -= count - resubmit.size();
+  ring_cv_.notify_all();
+}
+
+void DiskImage::DrainAsyncIo() {
+  std::unique_lock<std::mutex> lock(ring_mutex_);
+  ring_cv_.wait(lock, [this]() {
+    return ring_inflight_ == 0;
+  });
+}
+
+#else
+
+void DiskImage::InitializeAsyncIo() {
+  MV_WARN("io_uring is not supported in this build, %s uses the worker thread", filepath_.c_str());
+}
+
+void DiskImage::DestroyAsyncIo() {
+}
+
+bool DiskImage::SubmitAsyncIo(const ImageIoRequest& request, IoCallback& callback, size_t requests,
+  IoTimePoint start_time) {
+  MV_UNUSED(request);
+  MV_UNUSED(callback);
+  MV_UNUSED(requests);
+  MV_UNUSED(start_time);
+  return false;
+}
+
+void DiskImage::ReapAsyncIo() {
+}
+
+void DiskImage::DrainAsyncIo() {
+}
+
+#endif
@@ -21,22 +21,28 @@
 #include <fcntl.h>
 #include <unistd.h>
 #include <libgen.h>
+#include <climits>
 #include <sys/stat.h>
 #include <ctime>
 #include <cstring>
 #include <vector>
+#include <cstddef>
 #include <filesystem>
 #include "logger.h"
+#include "device.h"
 
-#define REFCOUNT_CACHE_ITEMS        128
-#define L2_CACHE_ITEMS              128
-#define CLUSTER_CACHE_ITEMS         128
+/* Default cache limits are 128 clusters of each kind */
+#define DEFAULT_CACHE_CLUSTERS      128
+/* Data clusters are reserved 1MB at a time for sequential writes */
+#define ALLOCATION_EXTENT_CLUSTERS  16
 
 Qcow2Image::~Qcow2Image() {
   ReleaseImage(true);
 }
 
 void Qcow2Image::ReleaseImage(bool remove_file) {
+  StopPrefetch();
+
   /* Flush caches if dirty */
   l2_cache_.Clear();
   rfb_cache_.Clear();
@@ -44,6 +50,9 @@ void Qcow2Image::ReleaseImage(bool remove_file) {
 
   if (fd_ != -1) {
     FlushAll();
+    if (dirty_) {
+      MarkClean();
+    }
     safe_close(&fd_);
   }
 
@@ -55,6 +64,11 @@ void Qcow2Image::ReleaseImage(bool remove_file) {
     delete[] copied_cluster_;
   }
 
+  if (shared_cache_) {
+    delete shared_cache_;
+    shared_cache_ = nullptr;
+  }
+
   if (backing_file_) {
     delete backing_file_;
   }
@@ -99,10 +113,15 @@ void Qcow2Image::Initialize() {
     close(mkstemps(temp.data(), 6));
 
     filepath_ = temp;
-    Qcow2Image::CreateImageWithBackingFile(filepath_, backing_filepath);
+    /* Small writes to overlays with extended L2 entries only copy the touched subclusters */
+    bool extended_l2 = device_ && device_->has_key("extended_l2") && std::get<bool>((*device_)["extended_l2"]);
+    Qcow2Image::CreateImageWithBackingFile(filepath_, backing_filepath, extended_l2);
   }
 
-  fd_ = open(filepath_.c_str(), oflags);
+  prefetch_stopped_ = false;
+  last_compressed_cluster_ = -1;
+  compressed_cursor_ = 0;
+  fd_ = OpenFile(filepath_, oflags);
   if (fd_ < 0)
     MV_PANIC("failed to open disk file: %s", filepath_.c_str());
 
@@ -113,7 +132,12 @@ void Qcow2Image::Initialize() {
   InitializeQcow2Header();
   InitializeL1Table();
   InitializeRefcountTable();
-  InitializeLruCache();
+  if (dirty_ && !readonly_) {
+    RepairRefcounts();
+    MarkClean();
+  }
+  InitializeClusterBitmap();
+  InitializeCache();
   
   /* Setup backing file READONLY if valid */
   if (image_header_.backing_file_offset && image_header_.backing_file_size < 1024) {
@@ -126,15 +150,27 @@ void Qcow2Image::Initialize() {
       strncpy(temp, filepath_.c_str(), sizeof(temp) - 1);
       backing_filepath_ = std::string(dirname(temp)) + "/" + filename;
     }
-    backing_file_ = new Qcow2Image();
-    backing_file_->is_backing_file_ = true;
-    backing_file_->readonly_ = true;
-    backing_file_->filepath_ = backing_filepath_;
-    backing_file_->Initialize();
+    OpenBackingFile();
   }
   // MV_LOG("open qcow2 %s file size=%ld", path.c_str(), image_size_);
 }
 
+/* Backing files inherit the cache settings of this image */
+void Qcow2Image::OpenBackingFile() {
+  backing_file_ = new Qcow2Image();
+  backing_file_->is_backing_file_ = true;
+  backing_file_->readonly_ = true;
+  backing_file_->cache_mode_ = cache_mode_;
+  backing_file_->l2_cache_size_ = l2_cache_size_;
+  backing_file_->rfb_cache_size_ = rfb_cache_size_;
+  backing_file_->cluster_cache_size_ = cluster_cache_size_;
+  backing_file_->shared_cache_size_ = shared_cache_size_;
+  backing_file_->prefetch_workers_ = prefetch_workers_;
+  backing_file_->prefetch_clusters_ = prefetch_clusters_;
+  backing_file_->filepath_ = backing_filepath_;
+  backing_file_->Initialize();
+}
+
 void Qcow2Image::InitializeQcow2Header() {
   bzero(&image_header_, sizeof(image_header_));
   /* Read the image header at offset 0 */
@@ -159,6 +195,10 @@ void Qcow2Image::InitializeQcow2Header() {
   be64_to_cpus(&image_header_.autoclear_features);
   be32_to_cpus(&image_header_.refcount_order);
   be32_to_cpus(&image_header_.header_length);
+  /* Images without the compression type field use zlib */
+  if (image_header_.version < 3 || image_header_.header_length <= offsetof(Qcow2Header, compression_type)) {
+    image_header_.compression_type = kCompressionTypeZlib;
+  }
 
   if (image_header_.magic != 0x514649FB) {
     MV_PANIC("File %s is not QCOW2 format", filepath_.c_str());
@@ -170,7 +210,9 @@ void Qcow2Image::InitializeQcow2Header() {
   total_blocks_ = image_header_.size >> block_size_shift_;
   cluster_bits_ = image_header_.cluster_bits;
   cluster_size_ = 1 << cluster_bits_;
-  l2_entries_ = cluster_size_ / sizeof(uint64_t);
+  extended_l2_ = image_header_.version == 3 && (image_header_.incompatible_features & QCOW2_INCOMPAT_EXTL2);
+  l2_entries_ = cluster_size_ / (extended_l2_ ? 2 * sizeof(uint64_t) : sizeof(uint64_t));
+  subcluster_bits_ = extended_l2_ ? cluster_bits_ - 5 : cluster_bits_;
   copied_cluster_ = new uint8_t[cluster_size_];
 
   /* For version 2, refcount bits is always 16 */
@@ -184,23 +226,29 @@ void Qcow2Image::InitializeQcow2Header() {
   if (image_header_.version == 3 && image_header_.compression_type > 1) {
     MV_PANIC("Unsupportted compression type=%d", image_header_.compression_type);
   }
+  uint64_t unknown_features = image_header_.incompatible_features &
+    ~(QCOW2_INCOMPAT_DIRTY | QCOW2_INCOMPAT_COMPRESSION | QCOW2_INCOMPAT_EXTL2);
+  if (image_header_.version == 3 && unknown_features) {
+    MV_PANIC("Qcow2 file incompatible features=0x%lx not supported", unknown_features);
+  }
+  dirty_ = image_header_.version == 3 && (image_header_.incompatible_features & QCOW2_INCOMPAT_DIRTY);
+  if (dirty_ && readonly_) {
+    MV_WARN("%s was not closed cleanly, refcounts may be wrong", filepath_.c_str());
+  }
 }
 
 /* FIXME: should we call pwrite for multiple times to write all data ??? */
 ssize_t Qcow2Image::WriteFile(void* buffer, size_t length, off_t offset) {
-  if (offset >= (ssize_t)image_header_.size) {
-    MV_LOG("write overflow length=0x%lx, offset=0x%lx", length, offset);
-    return 0;
-  }
-  ssize_t ret = pwrite(fd_, buffer, length, offset);
+  iovec iov = { .iov_base = buffer, .iov_len = length };
+  ssize_t ret = VectorFileIo(fd_, true, &iov, 1, offset);
   MV_ASSERT(ret == (ssize_t)length);
   return ret;
 }
 
 /* FIXME: should we call pread for multiple times to read all data ??? */
 ssize_t Qcow2Image::ReadFile(void* buffer, size_t length, off_t offset) {
-  ssize_t ret = pread(fd_, buffer, length, offset);
-  return ret;
+  iovec iov = { .iov_base = buffer, .iov_len = length };
+  return VectorFileIo(fd_, false, &iov, 1, offset);
 }
 
 void Qcow2Image::InitializeL1Table() {
@@ -219,6 +267,14 @@ void Qcow2Image::InitializeRefcountTable() {
 }
 
 void Qcow2Image::WriteL1Table() {
+  /* New L2 tables must have refcounts */
+  if (lazy_refcounts_) {
+    MarkDirty();
+  } else if (l2_depends_on_refcounts_) {
+    l2_depends_on_refcounts_ = false;
+    FlushRefcountBlocks();
+    WriteBarrier();
+  }
   WriteFile(l1_table_.data(), l1_table_.size() * sizeof(uint64_t),
     image_header_.l1_table_offset);
   l1_table_dirty_ = false;
@@ -231,46 +287,240 @@ void Qcow2Image::WriteRefcountTable() {
 }
 
 void Qcow2Image::WriteL2Table(L2Table* l2_table) {
-  WriteFile(l2_table->entries, l2_entries_ * sizeof(uint64_t),
-    l2_table->offset_in_file);
+  if (lazy_refcounts_) {
+    MarkDirty();
+  } else if (l2_depends_on_refcounts_) {
+    l2_depends_on_refcounts_ = false;
+    FlushRefcountBlocks();
+    WriteBarrier();
+  }
+  WriteFile(l2_table->entries, cluster_size_, l2_table->offset_in_file);
   l2_table->dirty = false;
 }
 
 void Qcow2Image::WriteRefcountBlock(RefcountBlock* rfb) {
+  /* Freed clusters must not be referenced on disk before their refcounts drop */
+  if (!lazy_refcounts_ && refcounts_depend_on_l2_) {
+    refcounts_depend_on_l2_ = false;
+    FlushL2Tables();
+    if (l1_table_dirty_) {
+      WriteL1Table();
+    }
+    WriteBarrier();
+  }
   WriteFile(rfb->entries, rfb_entries_ * sizeof(uint16_t), rfb->offset_in_file);
   rfb->dirty = false;
 }
 
-void Qcow2Image::InitializeLruCache() {
-  rfb_cache_.Initialize(REFCOUNT_CACHE_ITEMS, [this](auto offset_in_file, auto rfb) {
-    MV_UNUSED(offset_in_file);
-    if (rfb->dirty) {
-      WriteRefcountBlock(rfb);
+void Qcow2Image::WriteHeaderFeatures() {
+  uint64_t features[2] = {
+    htobe64(image_header_.incompatible_features),
+    htobe64(image_header_.compatible_features)
+  };
+  WriteFile(features, sizeof(features), offsetof(Qcow2Header, incompatible_features));
+}
+
+/* Make earlier writes durable before writing metadata depending on them */
+void Qcow2Image::WriteBarrier() {
+  if (cache_mode_ != kImageCacheUnsafe) {
+    fdatasync(fd_);
+  }
+}
+
+/* The dirty bit must be on disk before any L2 table referencing clusters with stale refcounts */
+void Qcow2Image::MarkDirty() {
+  if (dirty_) {
+    return;
+  }
+  image_header_.incompatible_features |= QCOW2_INCOMPAT_DIRTY;
+  WriteHeaderFeatures();
+  WriteBarrier();
+  dirty_ = true;
+}
+
+/* Called after all refcount blocks are written */
+void Qcow2Image::MarkClean() {
+  if (refcount_table_dirty_) {
+    WriteRefcountTable();
+  }
+  WriteBarrier();
+  image_header_.incompatible_features &= ~QCOW2_INCOMPAT_DIRTY;
+  WriteHeaderFeatures();
+  WriteBarrier();
+  dirty_ = false;
+}
+
+/* Rebuild all refcounts from the metadata after a crash with lazy refcounts.
+ * Leaked clusters are freed, and refcount blocks missing for referenced clusters are
+ * appended after the last used cluster. */
+void Qcow2Image::RepairRefcounts() {
+  MV_WARN("%s was not closed cleanly, repairing refcounts", filepath_.c_str());
+  std::vector<uint16_t> refcounts;
+  auto reference = [this, &refcounts](uint64_t offset, uint64_t length) {
+    uint64_t last = (offset + length - 1) >> cluster_bits_;
+    if (last >= refcounts.size()) {
+      refcounts.resize(last + 1);
     }
-    // MV_LOG("free rfb 0x%lx", rfb->offset_in_file);
-    free(rfb);
-  });
-  l2_cache_.Initialize(L2_CACHE_ITEMS, [this](auto offset_in_file, auto l2_table) {
-    MV_UNUSED(offset_in_file);
-    if (l2_table->dirty) {
+    for (uint64_t index = offset >> cluster_bits_; index <= last; index++) {
+      refcounts[index]++;
+    }
+  };
+
+  /* Header, extensions and backing file name are in the first cluster */
+  reference(0, cluster_size_);
+  reference(image_header_.l1_table_offset, l1_table_.size() * sizeof(uint64_t));
+  reference(image_header_.refcount_table_offset, image_header_.refcount_table_clusters * cluster_size_);
+  for (auto entry : refcount_table_) {
+    if (entry) {
+      reference(be64toh(entry), cluster_size_);
+    }
+  }
+
+  std::vector<uint64_t> l2_table(cluster_size_ / sizeof(uint64_t));
+  for (auto l1_entry : l1_table_) {
+    uint64_t l2_offset = be64toh(l1_entry) & QCOW2_STANDARD_OFFSET_MASK;
+    if (!l2_offset) {
+      continue;
+    }
+    reference(l2_offset, cluster_size_);
+    ReadFile(l2_table.data(), cluster_size_, l2_offset);
+    for (size_t i = 0; i < l2_entries_; i++) {
+      uint64_t l2_entry = be64toh(l2_table[extended_l2_ ? i * 2 : i]);
+      if (l2_entry & QCOW2_OFLAG_COMPRESSED) {
+        uint64_t host_offset, compressed_length;
+        GetCompressedRange(l2_entry & QCOW2_DESCRIPTOR_MASK, &host_offset, &compressed_length);
+        reference(host_offset, compressed_length);
+      } else if (l2_entry & QCOW2_STANDARD_OFFSET_MASK) {
+        reference(l2_entry & QCOW2_STANDARD_OFFSET_MASK, cluster_size_);
+      }
+    }
+  }
+
+  for (size_t rft_index = 0; rft_index * rfb_entries_ < refcounts.size(); rft_index++) {
+    if (rft_index >= refcount_table_.size()) {
+      MV_PANIC("refcount table of %s is too small", filepath_.c_str());
+    }
+    if (!refcount_table_[rft_index]) {
+      uint64_t block_offset = refcounts.size() << cluster_bits_;
+      reference(block_offset, cluster_size_);
+      refcount_table_[rft_index] = htobe64(block_offset);
+      refcount_table_dirty_ = true;
+    }
+  }
+
+  std::vector<uint16_t> block(rfb_entries_);
+  for (size_t rft_index = 0; rft_index < refcount_table_.size(); rft_index++) {
+    if (!refcount_table_[rft_index]) {
+      continue;
+    }
+    for (size_t i = 0; i < rfb_entries_; i++) {
+      size_t index = rft_index * rfb_entries_ + i;
+      block[i] = htobe16(index < refcounts.size() ? refcounts[index] : 0);
+    }
+    WriteFile(block.data(), rfb_entries_ * sizeof(uint16_t), be64toh(refcount_table_[rft_index]));
+  }
+}
+
+void Qcow2Image::InitializeCache() {
+  /* Backing files inherit the settings of the top image */
+  if (device_) {
+    if (device_->has_key("l2_cache_size")) {
+      l2_cache_size_ = std::get<uint64_t>((*device_)["l2_cache_size"]);
+    }
+    if (device_->has_key("refcount_cache_size")) {
+      rfb_cache_size_ = std::get<uint64_t>((*device_)["refcount_cache_size"]);
+    }
+    if (device_->has_key("cluster_cache_size")) {
+      cluster_cache_size_ = std::get<uint64_t>((*device_)["cluster_cache_size"]);
+    }
+    if (device_->has_key("prefetch_threads")) {
+      prefetch_workers_ = std::get<uint64_t>((*device_)["prefetch_threads"]);
+    }
+    if (device_->has_key("prefetch_clusters")) {
+      prefetch_clusters_ = std::get<uint64_t>((*device_)["prefetch_clusters"]);
+    }
+    if (device_->has_key("shared_cache_size")) {
+      shared_cache_size_ = std::get<uint64_t>((*device_)["shared_cache_size"]);
+    }
+    if (device_->has_key("copy_on_read")) {
+      copy_on_read_ = std::get<bool>((*device_)["copy_on_read"]);
+    }
+  }
+
+  /* The lazy refcounts feature is stored in the image, set or cleared by lazy_refcounts */
+  if (!readonly_ && image_header_.version == 3) {
+    bool lazy_refcounts = image_header_.compatible_features & QCOW2_COMPAT_LAZY_REFCOUNTS;
+    if (device_ && device_->has_key("lazy_refcounts")) {
+      lazy_refcounts = std::get<bool>((*device_)["lazy_refcounts"]);
+    }
+    if (lazy_refcounts != bool(image_header_.compatible_features & QCOW2_COMPAT_LAZY_REFCOUNTS)) {
+      image_header_.compatible_features ^= QCOW2_COMPAT_LAZY_REFCOUNTS;
+      WriteHeaderFeatures();
+    }
+    lazy_refcounts_ = lazy_refcounts;
+  }
+
+  /* Base images are readonly, so their clusters never change while shared. Snapshot
+   * overlays of a machine become backing files later and may be merged by commits */
+  bool overlay = std::filesystem::path(filepath_).filename().string().rfind("snapshot_", 0) == 0;
+  if (readonly_ && shared_cache_size_ && !overlay) {
+    shared_cache_ = new Qcow2SharedCache();
+    if (!shared_cache_->Initialize(fd_, cluster_size_, shared_cache_size_)) {
+      delete shared_cache_;
+      shared_cache_ = nullptr;
+    }
+  }
+
+  size_t default_size = DEFAULT_CACHE_CLUSTERS * cluster_size_;
+  rfb_cache_.Initialize(rfb_cache_size_ ? rfb_cache_size_ : default_size, rfb_entries_ * sizeof(uint16_t),
+    [this](auto rfb) {
+      WriteRefcountBlock(rfb);
+    });
+  l2_cache_.Initialize(l2_cache_size_ ? l2_cache_size_ : default_size, cluster_size_,
+    [this](auto l2_table) {
       WriteL2Table(l2_table);
+    });
+  /* Decompressed clusters are never dirty */
+  cluster_cache_.Initialize(cluster_cache_size_ ? cluster_cache_size_ : default_size, cluster_size_,
+    [](auto cluster) {
+      MV_PANIC("decompressed cluster 0x%lx is dirty", cluster->offset_in_file);
+    });
+}
+
+void Qcow2Image::GetCacheStatistics(Qcow2CacheStatistics* l2, Qcow2CacheStatistics* refcount,
+  Qcow2CacheStatistics* cluster) {
+  std::lock_guard<std::mutex> lock(metadata_mutex_);
+  *l2 = l2_cache_.statistics();
+  *refcount = rfb_cache_.statistics();
+  *cluster = cluster_cache_.statistics();
+}
+
+void Qcow2Image::GetFormatStatistics(DiskImageStatistics* statistics) {
+  Qcow2CacheStatistics l2, refcount, cluster;
+  GetCacheStatistics(&l2, &refcount, &cluster);
+  statistics->l2_cache_hits = l2.hits;
+  statistics->l2_cache_misses = l2.misses;
+  statistics->refcount_cache_hits = refcount.hits;
+  statistics->refcount_cache_misses = refcount.misses;
+  statistics->cluster_cache_hits = cluster.hits;
+  statistics->cluster_cache_misses = cluster.misses;
+  statistics->cow_copies = cow_copies_;
+  statistics->copy_on_read = copy_on_read_clusters_;
+  statistics->backing_reads = backing_reads_;
+  statistics->backing_bytes = backing_bytes_;
+
+  /* Readonly base images share clusters with other processes */
+  for (auto image = this; image; image = image->backing_file_) {
+    if (image->shared_cache_) {
+      statistics->shared_cache_hits += image->shared_cache_->hits();
+      statistics->shared_cache_misses += image->shared_cache_->misses();
     }
-    // MV_LOG("free l2_table 0x%lx", l2_table->offset_in_file);
-    free(l2_table);
-  });
-  cluster_cache_.Initialize(CLUSTER_CACHE_ITEMS, [this](auto offset_in_file, auto data) {
-    MV_UNUSED(offset_in_file);
-    delete data;
-  });
+  }
 }
 
+/* The new refcount block is zeroed and owned by the cache */
 RefcountBlock* Qcow2Image::NewRefcountBlock(uint64_t block_offset) {
-  size_t size = sizeof(RefcountBlock) + rfb_entries_ * sizeof(uint16_t);
-  RefcountBlock* block = (RefcountBlock*)malloc(size);
-  bzero(block, size);
-  block->dirty = false;
-  block->offset_in_file = block_offset;
-  return block;
+  return rfb_cache_.Insert(block_offset);
 }
 
 RefcountBlock* Qcow2Image::GetRefcountBlock(uint64_t cluster_index, uint64_t* rfb_index, bool allocate) {
@@ -291,7 +541,6 @@ RefcountBlock* Qcow2Image::GetRefcountBlock(uint64_t cluster_index, uint64_t* rf
     }
     block_offset = cluster_index << cluster_bits_;
     rfb = NewRefcountBlock(block_offset);
-    rfb_cache_.Put(block_offset, rfb);
     rfb->entries[*rfb_index] = htobe16(1);
     rfb->dirty = true;
 
@@ -299,17 +548,115 @@ RefcountBlock* Qcow2Image::GetRefcountBlock(uint64_t cluster_index, uint64_t* rf
     refcount_table_dirty_ = true;
     return rfb;
   } else {
-    if (rfb_cache_.Get(block_offset, rfb)) {
+    rfb = rfb_cache_.Lookup(block_offset);
+    if (rfb) {
       return rfb;
     }
 
     rfb = NewRefcountBlock(block_offset);
     ReadFile(rfb->entries, rfb_entries_ * sizeof(uint16_t), rfb->offset_in_file);
-    rfb_cache_.Put(rfb->offset_in_file, rfb);
     return rfb;
   }
 }
 
+/* Read every refcount block once, so allocation does not look up refcounts of used clusters */
+void Qcow2Image::InitializeClusterBitmap() {
+  cluster_bitmap_.clear();
+  free_cluster_index_ = 0;
+  extent_next_ = extent_end_ = 0;
+  if (readonly_) {
+    return;
+  }
+
+  std::vector<uint16_t> entries(rfb_entries_);
+  for (size_t rft_index = 0; rft_index < refcount_table_.size(); rft_index++) {
+    uint64_t block_offset = be64toh(refcount_table_[rft_index]);
+    if (!block_offset) {
+      continue;
+    }
+    bzero(entries.data(), rfb_entries_ * sizeof(uint16_t));
+    ReadFile(entries.data(), rfb_entries_ * sizeof(uint16_t), block_offset);
+    for (size_t i = 0; i < rfb_entries_; i++) {
+      if (entries[i]) {
+        MarkClusters(rft_index * rfb_entries_ + i, 1, true);
+      }
+    }
+  }
+}
+
+bool Qcow2Image::IsClusterUsed(uint64_t cluster_index) {
+  uint64_t word = cluster_index / 64;
+  return word < cluster_bitmap_.size() && (cluster_bitmap_[word] & (1ULL << (cluster_index % 64)));
+}
+
+void Qcow2Image::MarkClusters(uint64_t cluster_index, size_t count, bool used) {
+  uint64_t last_word = (cluster_index + count - 1) / 64;
+  if (last_word >= cluster_bitmap_.size()) {
+    if (!used) {
+      return;
+    }
+    cluster_bitmap_.resize(std::max(last_word + 1, cluster_bitmap_.size() * 2));
+  }
+  for (uint64_t index = cluster_index; index < cluster_index + count; index++) {
+    if (used) {
+      cluster_bitmap_[index / 64] |= 1ULL << (index % 64);
+    } else {
+      cluster_bitmap_[index / 64] &= ~(1ULL << (index % 64));
+    }
+  }
+  if (!used && cluster_index < free_cluster_index_) {
+    free_cluster_index_ = cluster_index;
+  }
+}
+
+/* Reserve the first run of free clusters, up to max_count clusters */
+uint64_t Qcow2Image::ReserveClusters(size_t max_count, size_t* count) {
+  uint64_t index = free_cluster_index_;
+  /* Skip used clusters a word at a time */
+  while (index / 64 < cluster_bitmap_.size()) {
+    uint64_t word = cluster_bitmap_[index / 64] | ((1ULL << (index % 64)) - 1);
+    if (word != ~0ULL) {
+      index = (index & ~63ULL) + __builtin_ctzll(~word);
+      break;
+    }
+    index = (index & ~63ULL) + 64;
+  }
+  free_cluster_index_ = index;
+
+  *count = 1;
+  while (*count < max_count && !IsClusterUsed(index + *count)) {
+    ++*count;
+  }
+  MarkClusters(index, *count, true);
+  return index;
+}
+
+/* Give back reserved clusters that were not used by sequential writes */
+void Qcow2Image::ReleaseExtent() {
+  if (extent_next_ < extent_end_) {
+    MarkClusters(extent_next_, extent_end_ - extent_next_, false);
+  }
+  extent_next_ = extent_end_ = 0;
+}
+
+/* Set the refcount of a reserved cluster. Return false if it has become a new refcount block */
+bool Qcow2Image::CommitCluster(uint64_t cluster_index) {
+  uint64_t rfb_index;
+  RefcountBlock* rfb = GetRefcountBlock(cluster_index, &rfb_index, true);
+  if (rfb == nullptr) {
+    MV_PANIC("refcount table is full, cluster_index=0x%lx", cluster_index);
+  }
+  if (rfb->offset_in_file == cluster_index << cluster_bits_) {
+    return false;
+  }
+
+  // update refcount and set dirty
+  rfb->entries[rfb_index] = htobe16(be16toh(rfb->entries[rfb_index]) + 1);
+  rfb->dirty = true;
+  l2_depends_on_refcounts_ = true;
+  return true;
+}
+
 void Qcow2Image::FreeCluster(uint64_t start) {
   uint64_t rfb_index;
   uint64_t cluster_index = start >> cluster_bits_;
@@ -321,58 +668,61 @@ void Qcow2Image::FreeCluster(uint64_t start) {
 
   rfb->entries[rfb_index] = htobe16(be16toh(rfb->entries[rfb_index]) - 1);
   rfb->dirty = true;
-  if (rfb->entries[rfb_index] == 0 && cluster_index < free_cluster_index_) {
-    free_cluster_index_ = cluster_index;
+  refcounts_depend_on_l2_ = true;
+  if (rfb->entries[rfb_index] == 0) {
+    MarkClusters(cluster_index, 1, false);
   }
 }
 
-/* free_cluster_index_ is initialized to zero and record last position. */
+/* Allocate a cluster for metadata or compressed data at the lowest free position */
 uint64_t Qcow2Image::AllocateCluster() {
-  uint64_t rfb_index;
-  uint64_t cluster_index = free_cluster_index_++;
-  RefcountBlock* rfb = GetRefcountBlock(cluster_index, &rfb_index, true);
   while (true) {
-    if (rfb == nullptr) {
-      return 0; // Error occurred
+    size_t count;
+    uint64_t cluster_index = ReserveClusters(1, &count);
+    if (CommitCluster(cluster_index)) {
+      return cluster_index << cluster_bits_;
     }
-    uint16_t refcount = be16toh(rfb->entries[rfb_index]);
-    if (refcount == 0) {
-      break;
+  }
+}
+
+/* Allocate a data cluster for the guest cluster at pos. Clusters are reserved in extents,
+ * so sequential writes are contiguous in the host file and can be merged into larger I/O */
+uint64_t Qcow2Image::AllocateDataCluster(off_t pos) {
+  uint64_t guest_cluster = pos >> cluster_bits_;
+  while (true) {
+    if (extent_next_ >= extent_end_ || guest_cluster != extent_guest_cluster_) {
+      ReleaseExtent();
+      size_t count;
+      extent_next_ = ReserveClusters(ALLOCATION_EXTENT_CLUSTERS, &count);
+      extent_end_ = extent_next_ + count;
     }
-    cluster_index = free_cluster_index_++;
-    if (++rfb_index >= rfb_entries_) {
-      rfb = GetRefcountBlock(cluster_index, &rfb_index, true);
+
+    uint64_t cluster_index = extent_next_++;
+    extent_guest_cluster_ = guest_cluster + 1;
+    if (CommitCluster(cluster_index)) {
+      return cluster_index << cluster_bits_;
     }
   }
-
-  // update refcount and set dirty
-  rfb->entries[rfb_index] = htobe16(be16toh(rfb->entries[rfb_index]) + 1);
-  rfb->dirty = true;
-  return cluster_index << cluster_bits_;
 }
 
+/* The new L2 table is zeroed and owned by the cache */
 L2Table* Qcow2Image::NewL2Table(uint64_t l2_offset) {
-  size_t size = sizeof(L2Table) + l2_entries_ * sizeof(uint64_t);
-  L2Table* table = (L2Table*)malloc(size);
-  bzero(table, size);
-  table->dirty = false;
-  table->offset_in_file = l2_offset;
-  return table;
+  return l2_cache_.Insert(l2_offset);
 }
 
 L2Table* Qcow2Image::ReadL2Table(uint64_t l2_offset) {
-  L2Table* table;
-  if (l2_cache_.Get(l2_offset, table)) {
+  L2Table* table = l2_cache_.Lookup(l2_offset);
+  if (table) {
     return table;
   }
 
   table = NewL2Table(l2_offset);
-  ReadFile(table->entries, l2_entries_ * sizeof(uint64_t), table->offset_in_file);
-
-  l2_cache_.Put(table->offset_in_file, table);
+  ReadFile(table->entries, cluster_size_, table->offset_in_file);
   return table;
 }
 
+/* l2_index is the index of the entry in l2_table->entries, followed by the subcluster bitmap
+ * if using extended L2 entries */
 L2Table* Qcow2Image::GetL2Table(bool is_write, off_t pos, uint64_t* offset_in_cluster, uint64_t* l2_index, size_t* length) {
   *offset_in_cluster = pos % cluster_size_;
   if (*length > cluster_size_ - *offset_in_cluster) {
@@ -381,7 +731,7 @@ L2Table* Qcow2Image::GetL2Table(bool is_write, off_t pos, uint64_t* offset_in_cl
 
   uint64_t cluster_index = pos >> cluster_bits_;
   uint64_t l1_index = cluster_index / l2_entries_;
-  *l2_index = cluster_index % l2_entries_;
+  *l2_index = (cluster_index % l2_entries_) << (extended_l2_ ? 1 : 0);
   
   uint64_t l2_offset = be64toh(l1_table_[l1_index]);
   if (l2_offset & QCOW2_OFLAG_COPIED) { /* L2 already allocated, read from current file */
@@ -396,8 +746,6 @@ L2Table* Qcow2Image::GetL2Table(bool is_write, off_t pos, uint64_t* offset_in_cl
     MV_ASSERT(l2_offset);
     
     L2Table* l2_table = NewL2Table(l2_offset);
-    bzero(l2_table->entries, l2_entries_ * sizeof(uint64_t));
-    l2_cache_.Put(l2_offset, l2_table);
     l2_table->dirty = true;
 
     l1_table_[l1_index] = htobe64(l2_offset | QCOW2_OFLAG_COPIED);
@@ -409,74 +757,378 @@ L2Table* Qcow2Image::GetL2Table(bool is_write, off_t pos, uint64_t* offset_in_cl
   return nullptr;
 }
 
-/* The return value is always less than or equal to cluster size */
-ssize_t Qcow2Image::ReadCluster(void* buffer, off_t pos, size_t length, bool no_zero) {
+void Qcow2Image::GetCompressedRange(uint64_t cluster_descriptor, uint64_t* host_offset, uint64_t* length) {
+  uint64_t x = (62 - (cluster_bits_ - 8));
+  uint64_t mask = (1ULL << (cluster_bits_ - 8)) - 1;
+  uint64_t sectors = ((cluster_descriptor >> x) & mask) + 1;
+  *length = sectors * QCOW2_COMPRESSED_SECTOR_SIZE - (cluster_descriptor & ~QCOW2_COMPRESSED_SECTOR_MASK);
+  *host_offset = cluster_descriptor & ((1ULL << x) - 1);
+}
+
+/* Called without the metadata lock by workers and prefetch threads */
+ssize_t Qcow2Image::DecompressCluster(uint64_t cluster_descriptor, uint8_t* output) {
+  uint64_t host_offset, compressed_length;
+  GetCompressedRange(cluster_descriptor, &host_offset, &compressed_length);
+
+  thread_local std::vector<uint8_t> compressed;
+  if (compressed.size() < compressed_length) {
+    compressed.resize(compressed_length);
+  }
+  ssize_t bytes_read = ReadFile(compressed.data(), compressed_length, host_offset);
+  if (bytes_read < 0) {
+    return bytes_read;
+  }
+
+  ssize_t ret;
+  if (image_header_.compression_type == kCompressionTypeZstd) {
+    ret = zstd_decompress(compressed.data(), bytes_read, output, cluster_size_);
+  } else {
+    ret = zlib_decompress(compressed.data(), bytes_read, output, cluster_size_);
+  }
+  if (ret < 0) {
+    MV_ERROR("failed to decompressed length=0x%lx ret=%ld", compressed_length, ret);
+  }
+  return ret;
+}
+
+/* Called with metadata locked. Decompression runs without the lock, a write may have
+ * rewritten the cluster and freed the compressed data meanwhile, and the freed host
+ * clusters may be reused. The data read is only valid if the L2 entry is unchanged. */
+bool Qcow2Image::CompressedClusterChanged(off_t pos, uint64_t l2_entry) {
   uint64_t offset_in_cluster, l2_index;
+  size_t length = cluster_size_;
   auto l2_table = GetL2Table(false, pos, &offset_in_cluster, &l2_index, &length);
-  if (l2_table == nullptr || !l2_table->entries[l2_index]) {
-    if (backing_file_ == nullptr) { /* Reading at unallocated space always return zero??? */
-      if (no_zero)
-        return -2;
-      bzero(buffer, length);
+  return l2_table == nullptr || be64toh(l2_table->entries[l2_index]) != l2_entry;
+}
+
+/* Called with metadata locked, skip if the L2 entry was changed while decompressing */
+void Qcow2Image::CacheDecompressedCluster(off_t pos, uint64_t l2_entry, uint8_t* data) {
+  if (CompressedClusterChanged(pos, l2_entry)) {
+    return;
+  }
+
+  uint64_t host_offset, compressed_length;
+  GetCompressedRange(l2_entry & QCOW2_DESCRIPTOR_MASK, &host_offset, &compressed_length);
+  if (!cluster_cache_.Contains(host_offset)) {
+    auto cluster = cluster_cache_.Insert(host_offset);
+    memcpy(cluster->data, data, cluster_size_);
+  }
+  if (shared_cache_) {
+    shared_cache_->Insert(pos >> cluster_bits_, data);
+  }
+}
+
+/* Called with metadata locked, queue compressed clusters not cached or pending */
+void Qcow2Image::PrefetchClusters(uint64_t cluster_index) {
+  std::vector<std::pair<uint64_t, uint64_t>> clusters;
+  for (size_t i = 0; i < prefetch_clusters_; i++) {
+    uint64_t pos = (cluster_index + i) << cluster_bits_;
+    if (pos >= image_header_.size) {
+      break;
+    }
+
+    uint64_t offset_in_cluster, l2_index, host_offset, compressed_length;
+    size_t length = cluster_size_;
+    auto l2_table = GetL2Table(false, pos, &offset_in_cluster, &l2_index, &length);
+    if (l2_table == nullptr) {
+      continue;
+    }
+    uint64_t l2_entry = be64toh(l2_table->entries[l2_index]);
+    if (!(l2_entry & QCOW2_OFLAG_COMPRESSED)) {
+      continue;
+    }
+    GetCompressedRange(l2_entry & QCOW2_DESCRIPTOR_MASK, &host_offset, &compressed_length);
+    if (!cluster_cache_.Contains(host_offset)) {
+      clusters.emplace_back(pos, l2_entry);
+    }
+  }
+  if (clusters.empty()) {
+    return;
+  }
+
+  std::lock_guard<std::mutex> lock(prefetch_mutex_);
+  if (prefetch_stopped_) {
+    return;
+  }
+  if (prefetch_threads_.empty()) {
+    for (size_t i = 0; i < prefetch_workers_; i++) {
+      prefetch_threads_.emplace_back(&Qcow2Image::PrefetchProcess, this);
+    }
+  }
+  for (auto &cluster : clusters) {
+    uint64_t host_offset, compressed_length;
+    GetCompressedRange(cluster.second & QCOW2_DESCRIPTOR_MASK, &host_offset, &compressed_length);
+    if (prefetch_pending_.insert(host_offset).second) {
+      prefetch_queue_.push_back(cluster);
+    }
+  }
+  prefetch_cv_.notify_all();
+}
+
+void Qcow2Image::PrefetchProcess() {
+  SetThreadName("mvisor-prefetch");
+  std::vector<uint8_t> output(cluster_size_);
+
+  std::unique_lock<std::mutex> lock(prefetch_mutex_);
+  while (true) {
+    prefetch_cv_.wait(lock, [this]() {
+      return prefetch_stopped_ || !prefetch_queue_.empty();
+    });
+    if (prefetch_stopped_) {
+      break;
+    }
+
+    auto cluster = prefetch_queue_.front();
+    prefetch_queue_.pop_front();
+    lock.unlock();
+
+    uint64_t host_offset, compressed_length;
+    GetCompressedRange(cluster.second & QCOW2_DESCRIPTOR_MASK, &host_offset, &compressed_length);
+    if (DecompressCluster(cluster.second & QCOW2_DESCRIPTOR_MASK, output.data()) >= 0) {
+      std::lock_guard<std::mutex> metadata_lock(metadata_mutex_);
+      CacheDecompressedCluster(cluster.first, cluster.second, output.data());
+    }
+
+    lock.lock();
+    prefetch_pending_.erase(host_offset);
+    prefetch_cv_.notify_all();
+  }
+}
+
+/* Return true if the cluster was being prefetched and we have waited for it */
+bool Qcow2Image::WaitForPrefetch(uint64_t host_offset) {
+  std::unique_lock<std::mutex> lock(prefetch_mutex_);
+  if (!prefetch_pending_.count(host_offset)) {
+    return false;
+  }
+  prefetch_cv_.wait(lock, [this, host_offset]() {
+    return prefetch_stopped_ || !prefetch_pending_.count(host_offset);
+  });
+  return !prefetch_stopped_;
+}
+
+void Qcow2Image::StopPrefetch() {
+  {
+    std::lock_guard<std::mutex> lock(prefetch_mutex_);
+    prefetch_stopped_ = true;
+    prefetch_cv_.notify_all();
+  }
+  for (auto &thread : prefetch_threads_) {
+    thread.join();
+  }
+  prefetch_threads_.clear();
+  prefetch_queue_.clear();
+  prefetch_pending_.clear();
+}
+
+/* Called with metadata locked, the state of the subcluster at offset_in_cluster of a standard
+ * cluster, length is limited to the following subclusters in the same state.
+ * Without extended L2 entries, the whole cluster is a single subcluster. */
+Qcow2SubclusterState Qcow2Image::GetSubclusterState(L2Table* l2_table, uint64_t l2_index,
+  uint64_t offset_in_cluster, size_t* length) {
+  uint64_t l2_entry = be64toh(l2_table->entries[l2_index]);
+  uint64_t host_offset = l2_entry & QCOW2_STANDARD_OFFSET_MASK;
+  if (!extended_l2_) {
+    if (l2_entry & 1) { // Bit 0 means zero
+      return kSubclusterZero;
+    }
+    return host_offset ? kSubclusterAllocated : kSubclusterUnallocated;
+  }
+
+  uint64_t bitmap = be64toh(l2_table->entries[l2_index + 1]);
+  auto state_of = [bitmap](uint64_t index) {
+    if (bitmap & (1ULL << index)) {
+      return kSubclusterAllocated;
+    }
+    return (bitmap & (1ULL << (QCOW2_SUBCLUSTERS + index))) ? kSubclusterZero : kSubclusterUnallocated;
+  };
+
+  uint64_t index = offset_in_cluster >> subcluster_bits_;
+  auto state = state_of(index);
+  if (state == kSubclusterAllocated && host_offset == 0) {
+    MV_PANIC("invalid extended L2 entry=0x%lx bitmap=0x%lx", l2_entry, bitmap);
+  }
+  uint64_t end = index + 1;
+  while (end < QCOW2_SUBCLUSTERS && state_of(end) == state) {
+    end++;
+  }
+  if (*length > (end << subcluster_bits_) - offset_in_cluster) {
+    *length = (end << subcluster_bits_) - offset_in_cluster;
+  }
+  return state;
+}
+
+/* Data of unallocated clusters, zeros if not found in backing files */
+ssize_t Qcow2Image::ReadBackingFile(void* buffer, off_t pos, size_t length) {
+  ssize_t ret = 0;
+  if (backing_file_) {
+    backing_reads_++;
+    backing_bytes_ += length;
+    ret = backing_file_->BlockIo(buffer, pos, length, kImageIoRead);
+    if (ret < 0) {
+      return ret;
+    }
+  }
+  if ((size_t)ret < length) {
+    bzero((uint8_t*)buffer + ret, length - ret);
+  }
+  return length;
+}
+
+/* Copy a whole cluster from the backing file, so later reads skip the backing chain.
+ * Clusters not found in the backing file are left unallocated. */
+ssize_t Qcow2Image::CopyOnRead(void* buffer, off_t pos, size_t length) {
+  uint64_t offset_in_cluster = pos & (cluster_size_ - 1);
+  off_t cluster_pos = pos - offset_in_cluster;
+  auto data = (uint8_t*)aligned_alloc(4096, cluster_size_);
+  auto ret = ReadBackingFile(data, cluster_pos, cluster_size_);
+  if (ret < 0) {
+    free(data);
+    return ret;
+  }
+  memcpy(buffer, data + offset_in_cluster, length);
+
+  if (!test_zero(data, cluster_size_)) {
+    /* Skip if the cluster was written while reading the backing file */
+    std::lock_guard<std::mutex> lock(metadata_mutex_);
+    uint64_t l2_index;
+    size_t cluster_length = cluster_size_;
+    L2Table* l2_table = GetL2Table(true, cluster_pos, &offset_in_cluster, &l2_index, &cluster_length);
+    if (!l2_table->entries[l2_index] && !(extended_l2_ && l2_table->entries[l2_index + 1]) &&
+        !allocating_clusters_.count(cluster_pos >> cluster_bits_)) {
+      uint64_t host_offset = AllocateDataCluster(cluster_pos);
+      if (WriteFile(data, cluster_size_, host_offset) != (ssize_t)cluster_size_) {
+        MV_PANIC("failed to copy cluster at pos=0x%lx", cluster_pos);
+      }
+      l2_table->entries[l2_index] = htobe64(host_offset | QCOW2_OFLAG_COPIED);
+      if (extended_l2_) {
+        l2_table->entries[l2_index + 1] = htobe64(QCOW2_SUBCLUSTER_ALLOC_ALL);
+      }
+      l2_table->dirty = true;
+      copy_on_read_clusters_++;
+    }
+  }
+  free(data);
+  return length;
+}
+
+/* The return value is always less than or equal to cluster size */
+ssize_t Qcow2Image::ReadCluster(void* buffer, off_t pos, size_t length) {
+  if (shared_cache_) {
+    uint64_t offset_in_cluster = pos & (cluster_size_ - 1);
+    length = std::min(length, cluster_size_ - offset_in_cluster);
+    if (shared_cache_->Read(pos >> cluster_bits_, offset_in_cluster, buffer, length)) {
       return length;
     }
-    return backing_file_->ReadCluster(buffer, pos, length);
+  }
+
+  /* Metadata is locked while looking up, data clusters are read without the lock */
+  std::unique_lock<std::mutex> lock(metadata_mutex_);
+  uint64_t offset_in_cluster, l2_index;
+  auto l2_table = GetL2Table(false, pos, &offset_in_cluster, &l2_index, &length);
+  bool copy_on_read = copy_on_read_ && backing_file_ && !readonly_;
+  if (l2_table == nullptr) {
+    lock.unlock();
+    if (copy_on_read) {
+      return CopyOnRead(buffer, pos, length);
+    }
+    return ReadBackingFile(buffer, pos, length);
   }
 
   uint64_t l2_entry = be64toh(l2_table->entries[l2_index]);
   uint64_t cluster_descriptor = l2_entry & QCOW2_DESCRIPTOR_MASK;
 
   if (l2_entry & QCOW2_OFLAG_COMPRESSED) { /* Compressed descriptor */
-    MV_ASSERT(image_header_.compression_type == kCompressionTypeZstd);
-
-    uint64_t x = (62 - (cluster_bits_ - 8));
-    uint64_t mask = (1ULL << (cluster_bits_ - 8)) - 1;
-    uint64_t sectors = ((cluster_descriptor >> x) & mask) + 1;
-    uint64_t compressed_length = sectors * QCOW2_COMPRESSED_SECTOR_SIZE -
-      (cluster_descriptor & ~QCOW2_COMPRESSED_SECTOR_MASK);
-    uint64_t host_offset = cluster_descriptor & ((1ULL << x) - 1);
-
-    uint8_t* decompressed = nullptr;
-    if (!cluster_cache_.Get(host_offset, decompressed)) {
-      if (compressed_.size() < compressed_length)
-        compressed_.resize(compressed_length);
-      ssize_t bytes_read = ReadFile(compressed_.data(), compressed_length, host_offset);
-      if (bytes_read < 0) {
-        return bytes_read;
-      }
+    uint64_t host_offset, compressed_length;
+    GetCompressedRange(cluster_descriptor, &host_offset, &compressed_length);
 
-      decompressed = new uint8_t[cluster_size_];
-      auto ret = zstd_decompress(compressed_.data(), compressed_length, decompressed, cluster_size_);
-      if (ret < 0) {
-        delete[] decompressed;
-        MV_ERROR("failed to decompressed length=0x%x ret=%d", compressed_length, ret);
-        return ret;
-      }
-      cluster_cache_.Put(host_offset, decompressed);
+    /* Decompress the next clusters in background if reading sequentially */
+    int64_t cluster_index = pos >> cluster_bits_;
+    if (prefetch_workers_ && cluster_index == last_compressed_cluster_ + 1) {
+      PrefetchClusters(cluster_index + 1);
     }
-    memcpy(buffer, decompressed + offset_in_cluster, length);
-  } else { /* Standard descriptor */
-    if (cluster_descriptor & 1) { // Bit 0 means zero
-      bzero(buffer, length);
+    last_compressed_cluster_ = cluster_index;
+
+    auto decompressed = cluster_cache_.Lookup(host_offset);
+    if (decompressed) {
+      memcpy(buffer, decompressed->data + offset_in_cluster, length);
       return length;
     }
 
-    uint64_t host_offset = cluster_descriptor & QCOW2_STANDARD_OFFSET_MASK;
+    /* Decompress without the lock, then check the cluster was not rewritten meanwhile */
+    lock.unlock();
+    if (WaitForPrefetch(host_offset)) {
+      return ReadCluster(buffer, pos, length);
+    }
+    thread_local std::vector<uint8_t> output;
+    output.resize(cluster_size_);
+    auto ret = DecompressCluster(cluster_descriptor, output.data());
+
+    lock.lock();
+    if (CompressedClusterChanged(pos, l2_entry)) {
+      lock.unlock();
+      return ReadCluster(buffer, pos, length);
+    }
+    if (ret < 0) {
+      return ret;
+    }
+    memcpy(buffer, output.data() + offset_in_cluster, length);
+    CacheDecompressedCluster(pos, l2_entry, output.data());
+    return length;
+  }
+
+  /* Standard descriptor */
+  size_t cluster_length = cluster_size_;
+  bool whole_cluster = GetSubclusterState(l2_table, l2_index, 0, &cluster_length) != kSubclusterZero &&
+    cluster_length == cluster_size_;
+  auto state = GetSubclusterState(l2_table, l2_index, offset_in_cluster, &length);
+  lock.unlock();
+  if (state == kSubclusterUnallocated) {
+    if (copy_on_read && whole_cluster) {
+      return CopyOnRead(buffer, pos, length);
+    }
+    return ReadBackingFile(buffer, pos, length);
+  } else if (state == kSubclusterZero) {
+    bzero(buffer, length);
+    return length;
+  }
 
-    ssize_t bytes_read = ReadFile(buffer, length, host_offset + offset_in_cluster);
+  uint64_t host_offset = cluster_descriptor & QCOW2_STANDARD_OFFSET_MASK;
+  if (shared_cache_ && whole_cluster) {
+    /* Read the whole cluster for other processes */
+    thread_local std::vector<uint8_t> data;
+    data.resize(cluster_size_);
+    ssize_t bytes_read = ReadFile(data.data(), cluster_size_, host_offset);
     if (bytes_read < 0) {
       return bytes_read;
     }
-    if ((size_t)bytes_read < length) {
-      /* Reach the end of file??? */
-      bzero((uint8_t*)buffer + bytes_read, length - bytes_read);
+    if ((size_t)bytes_read < cluster_size_) {
+      bzero(data.data() + bytes_read, cluster_size_ - bytes_read);
     }
+    shared_cache_->Insert(pos >> cluster_bits_, data.data());
+    memcpy(buffer, data.data() + offset_in_cluster, length);
+    return length;
+  }
+  ssize_t bytes_read = ReadFile(buffer, length, host_offset + offset_in_cluster);
+  if (bytes_read < 0) {
+    return bytes_read;
+  }
+  if ((size_t)bytes_read < length) {
+    /* Reach the end of file??? */
+    bzero((uint8_t*)buffer + bytes_read, length - bytes_read);
   }
   return length;
 }
 
 /* The return value is always less than or equal to cluster size */
 ssize_t Qcow2Image::WriteCluster(void* buffer, off_t pos, size_t length) {
+  /* Wait if another write is allocating or copying the cluster without the lock */
+  std::unique_lock<std::mutex> lock(metadata_mutex_);
+  uint64_t guest_cluster = pos >> cluster_bits_;
+  allocating_cv_.wait(lock, [this, guest_cluster]() {
+    return !allocating_clusters_.count(guest_cluster);
+  });
+
   uint64_t offset_in_cluster, l2_index;
   L2Table* l2_table = GetL2Table(true, pos, &offset_in_cluster, &l2_index, &length);
   MV_ASSERT(l2_table);
@@ -484,49 +1136,248 @@ ssize_t Qcow2Image::WriteCluster(void* buffer, off_t pos, size_t length) {
   uint64_t l2_entry = be64toh(l2_table->entries[l2_index]);
   uint64_t cluster_descriptor = l2_entry & QCOW2_DESCRIPTOR_MASK;
 
-  /* Writing compressed cluster is not supported */
-  MV_ASSERT(!(l2_entry & QCOW2_OFLAG_COMPRESSED));
+  if (l2_entry & QCOW2_OFLAG_COMPRESSED) {
+    return RewriteCompressedCluster(l2_table, l2_index, buffer, pos, offset_in_cluster, length);
+  }
+  if (extended_l2_) {
+    return WriteSubclusters(lock, l2_table, l2_index, buffer, pos, offset_in_cluster, length);
+  }
   uint64_t host_offset = cluster_descriptor & QCOW2_STANDARD_OFFSET_MASK;
 
   if (l2_entry & QCOW2_OFLAG_COPIED) {
+    lock.unlock();
     if (WriteFile(buffer, length, host_offset + offset_in_cluster) != (ssize_t)length) {
       return -1;
     }
-  } else {
+    return length;
+  }
+
+  if (host_offset) {
+    MV_PANIC("writing to images with snapshots is not supported yet");
+  }
+  host_offset = AllocateDataCluster(pos);
+  if (host_offset == 0) {
+    MV_ERROR("failed to allocate cluster");
+    return -1;
+  }
+
+  /* The data is written without the lock and the L2 entry is set afterwards,
+   * reads of the cluster meanwhile still go to the backing file */
+  allocating_clusters_.insert(guest_cluster);
+  lock.unlock();
+
+  /* If not writing the whole cluster, copy the original data from the backing file,
+   * or write zeros around the data, a freed cluster may be reused with stale data
+   */
+  if (!(offset_in_cluster == 0 && length == cluster_size_)) {
+    cow_copies_++;
+    thread_local std::vector<uint8_t> copied;
+    copied.resize(cluster_size_);
+    if (ReadBackingFile(copied.data(), pos - offset_in_cluster, cluster_size_) != (ssize_t)cluster_size_) {
+      MV_PANIC("failed to read backing file at pos=0x%lx", pos);
+    }
+    memcpy(copied.data() + offset_in_cluster, buffer, length);
+    if (WriteFile(copied.data(), cluster_size_, host_offset) != (ssize_t)cluster_size_) {
+      MV_PANIC("failed to copy cluster at pos=0x%lx length=0x%lx", pos, length);
+    }
+  } else if (WriteFile(buffer, length, host_offset + offset_in_cluster) != (ssize_t)length) {
+    MV_PANIC("failed to write image file pos=0x%lx host_offset=0x%lx offset=0x%lx length=0x%lx",
+      pos, host_offset, offset_in_cluster, length);
+  }
+
+  lock.lock();
+  PublishCluster(pos, host_offset, 0);
+  return length; // Always return length of dirty data
+}
+
+/* Called with metadata locked after writing a cluster reserved in allocating_clusters_.
+ * The L2 table may have been evicted while unlocked, look it up again. A zero host_offset
+ * keeps the entry and only sets the subclusters in mask as allocated. */
+void Qcow2Image::PublishCluster(off_t pos, uint64_t host_offset, uint64_t mask) {
+  uint64_t offset_in_cluster, l2_index;
+  size_t length = cluster_size_;
+  L2Table* l2_table = GetL2Table(true, pos, &offset_in_cluster, &l2_index, &length);
+  MV_ASSERT(l2_table);
+
+  if (host_offset) {
+    l2_table->entries[l2_index] = htobe64(host_offset | QCOW2_OFLAG_COPIED);
+  }
+  if (mask) {
+    uint64_t bitmap = be64toh(l2_table->entries[l2_index + 1]);
+    bitmap |= mask;
+    bitmap &= ~(mask << QCOW2_SUBCLUSTERS);
+    l2_table->entries[l2_index + 1] = htobe64(bitmap);
+  }
+  l2_table->dirty = true;
+
+  allocating_clusters_.erase(pos >> cluster_bits_);
+  allocating_cv_.notify_all();
+}
+
+/* Called with metadata locked, only subclusters touched by the write are allocated.
+ * Unallocated parts of the first and last subclusters are copied from the backing file
+ * without the lock, the L2 entry and the bitmap are set afterwards. */
+ssize_t Qcow2Image::WriteSubclusters(std::unique_lock<std::mutex>& lock, L2Table* l2_table, uint64_t l2_index,
+  void* buffer, off_t pos, uint64_t offset_in_cluster, size_t length) {
+  uint64_t l2_entry = be64toh(l2_table->entries[l2_index]);
+  uint64_t bitmap = be64toh(l2_table->entries[l2_index + 1]);
+  uint64_t host_offset = l2_entry & QCOW2_STANDARD_OFFSET_MASK;
+
+  uint64_t first = offset_in_cluster >> subcluster_bits_;
+  uint64_t last = (offset_in_cluster + length - 1) >> subcluster_bits_;
+  uint64_t mask = ((1ULL << (last - first + 1)) - 1) << first;
+
+  if ((bitmap & mask) == mask) {
+    lock.unlock();
+    if (WriteFile(buffer, length, host_offset + offset_in_cluster) != (ssize_t)length) {
+      return -1;
+    }
+    return length;
+  }
+
+  uint64_t new_host_offset = 0;
+  if (!(l2_entry & QCOW2_OFLAG_COPIED)) {
     if (host_offset) {
       MV_PANIC("writing to images with snapshots is not supported yet");
     }
-    host_offset = AllocateCluster();
+    host_offset = new_host_offset = AllocateDataCluster(pos);
     if (host_offset == 0) {
       MV_ERROR("failed to allocate cluster");
       return -1;
     }
-
-    l2_table->entries[l2_index] = htobe64(host_offset | QCOW2_OFLAG_COPIED);
-    l2_table->dirty = true;
-
-    /* If not writing the whole cluster, we should read the original data from the backing file
-      * Always read the whole cluster without zeroing data if cluster exists in backing file
-      */
-    if (backing_file_ && !(offset_in_cluster == 0 && length == cluster_size_)) {
-      auto bytes = backing_file_->ReadCluster(copied_cluster_, pos - offset_in_cluster, cluster_size_, true);
-      if (bytes > 0) { // Check if exists
-        MV_ASSERT(bytes == (ssize_t)cluster_size_); // Make sure we have a whole cluster
-        memcpy(copied_cluster_ + offset_in_cluster, buffer, length);
-        if (WriteFile(copied_cluster_, cluster_size_, host_offset) != (ssize_t)cluster_size_) {
-          MV_PANIC("failed to copy cluster at pos=0x%lx length=0x%lx", pos, length);
-        }
-        return length; // Always return length of dirty data
+  }
+  allocating_clusters_.insert(pos >> cluster_bits_);
+  lock.unlock();
+
+  /* Pad the write to subcluster boundaries if the first or last subcluster is not allocated */
+  uint64_t start = offset_in_cluster, end = offset_in_cluster + length;
+  uint64_t cluster_pos = pos - offset_in_cluster;
+  if ((!(bitmap & (1ULL << first)) && (offset_in_cluster & ((1ULL << subcluster_bits_) - 1))) ||
+      (!(bitmap & (1ULL << last)) && (end & ((1ULL << subcluster_bits_) - 1)))) {
+    cow_copies_++;
+  }
+  thread_local std::vector<uint8_t> copied;
+  copied.resize(cluster_size_);
+  if (!(bitmap & (1ULL << first))) {
+    start = first << subcluster_bits_;
+    if (start < offset_in_cluster) {
+      if (bitmap & (1ULL << (QCOW2_SUBCLUSTERS + first))) {
+        bzero(copied.data() + start, offset_in_cluster - start);
+      } else if (ReadBackingFile(copied.data() + start, cluster_pos + start, offset_in_cluster - start) < 0) {
+        MV_PANIC("failed to read backing file at pos=0x%lx", cluster_pos + start);
       }
     }
+  }
+  if (!(bitmap & (1ULL << last))) {
+    uint64_t padded_end = (last + 1) << subcluster_bits_;
+    if (end < padded_end) {
+      if (bitmap & (1ULL << (QCOW2_SUBCLUSTERS + last))) {
+        bzero(copied.data() + end, padded_end - end);
+      } else if (ReadBackingFile(copied.data() + end, cluster_pos + end, padded_end - end) < 0) {
+        MV_PANIC("failed to read backing file at pos=0x%lx", cluster_pos + end);
+      }
+    }
+    end = padded_end;
+  }
+  memcpy(copied.data() + offset_in_cluster, buffer, length);
+  if (WriteFile(copied.data() + start, end - start, host_offset + start) != (ssize_t)(end - start)) {
+    MV_PANIC("failed to write subclusters at pos=0x%lx length=0x%lx", pos, length);
+  }
 
-    if (WriteFile(buffer, length, host_offset + offset_in_cluster) != (ssize_t)length) {
-      MV_PANIC("failed to write image file pos=0x%lx host_offset=0x%lx offset=0x%lx length=0x%lx",
-        pos, host_offset, offset_in_cluster, length);
+  lock.lock();
+  PublishCluster(pos, new_host_offset, mask);
+  return length;
+}
+
+/* Called with metadata locked, decompress the cluster and write it back as a standard cluster */
+ssize_t Qcow2Image::RewriteCompressedCluster(L2Table* l2_table, uint64_t l2_index, void* buffer,
+  off_t pos, uint64_t offset_in_cluster, size_t length) {
+  uint64_t cluster_descriptor = be64toh(l2_table->entries[l2_index]) & QCOW2_DESCRIPTOR_MASK;
+  if (DecompressCluster(cluster_descriptor, copied_cluster_) < 0) {
+    return -1;
+  }
+  cow_copies_++;
+  memcpy(copied_cluster_ + offset_in_cluster, buffer, length);
+
+  uint64_t host_offset = AllocateDataCluster(pos);
+  if (host_offset == 0) {
+    MV_ERROR("failed to allocate cluster");
+    return -1;
+  }
+  if (WriteFile(copied_cluster_, cluster_size_, host_offset) != (ssize_t)cluster_size_) {
+    MV_PANIC("failed to rewrite compressed cluster at host_offset=0x%lx", host_offset);
+  }
+
+  FreeCompressedCluster(cluster_descriptor);
+  l2_table->entries[l2_index] = htobe64(host_offset | QCOW2_OFLAG_COPIED);
+  if (extended_l2_) {
+    l2_table->entries[l2_index + 1] = htobe64(QCOW2_SUBCLUSTER_ALLOC_ALL);
+  }
+  l2_table->dirty = true;
+  return length;
+}
+
+/* Called with metadata locked, compressed data holds a reference to every cluster it touches.
+ * Reads decompressing the old data without the lock may see the clusters reused, they
+ * check the L2 entry afterwards and read again, see CompressedClusterChanged(). */
+void Qcow2Image::FreeCompressedCluster(uint64_t cluster_descriptor) {
+  uint64_t host_offset, compressed_length;
+  GetCompressedRange(cluster_descriptor, &host_offset, &compressed_length);
+  cluster_cache_.Remove(host_offset);
+
+  uint64_t first = host_offset >> cluster_bits_;
+  uint64_t last = (host_offset + compressed_length - 1) >> cluster_bits_;
+  for (uint64_t index = first; index <= last; index++) {
+    FreeCluster(index << cluster_bits_);
+  }
+}
+
+/* Called with metadata locked */
+void Qcow2Image::IncreaseRefcount(uint64_t host_offset) {
+  uint64_t rfb_index;
+  RefcountBlock* rfb = GetRefcountBlock(host_offset >> cluster_bits_, &rfb_index, false);
+  MV_ASSERT(rfb);
+  rfb->entries[rfb_index] = htobe16(be16toh(rfb->entries[rfb_index]) + 1);
+  rfb->dirty = true;
+  l2_depends_on_refcounts_ = true;
+}
+
+/* Store compressed data of a whole unallocated cluster. Compressed data is packed
+ * into shared host clusters but never spans two clusters. */
+ssize_t Qcow2Image::WriteCompressedCluster(off_t pos, const void* data, size_t length) {
+  std::lock_guard<std::mutex> lock(metadata_mutex_);
+  uint64_t offset_in_cluster, l2_index;
+  size_t cluster_length = cluster_size_;
+  L2Table* l2_table = GetL2Table(true, pos, &offset_in_cluster, &l2_index, &cluster_length);
+  MV_ASSERT(l2_table && offset_in_cluster == 0 && length < cluster_size_);
+  if (l2_table->entries[l2_index] || (extended_l2_ && l2_table->entries[l2_index + 1])) {
+    MV_ERROR("cluster at pos=0x%lx is already allocated", pos);
+    return -1;
+  }
+
+  size_t used = compressed_cursor_ % cluster_size_;
+  if (compressed_cursor_ == 0 || used == 0 || cluster_size_ - used < length) {
+    compressed_cursor_ = AllocateCluster();
+    if (compressed_cursor_ == 0) {
+      MV_ERROR("failed to allocate cluster");
       return -1;
     }
+  } else {
+    IncreaseRefcount(compressed_cursor_);
   }
+  if (WriteFile((void*)data, length, compressed_cursor_) != (ssize_t)length) {
+    return -1;
+  }
+
+  /* Number of additional 512-byte sectors beyond the sector containing the offset */
+  uint64_t x = (62 - (cluster_bits_ - 8));
+  uint64_t sectors = ((compressed_cursor_ & ~QCOW2_COMPRESSED_SECTOR_MASK) + length +
+    QCOW2_COMPRESSED_SECTOR_SIZE - 1) / QCOW2_COMPRESSED_SECTOR_SIZE - 1;
+  uint64_t l2_entry = QCOW2_OFLAG_COMPRESSED | (sectors << x) | compressed_cursor_;
+  l2_table->entries[l2_index] = htobe64(l2_entry);
+  l2_table->dirty = true;
 
+  compressed_cursor_ += length;
   return length;
 }
 
@@ -534,6 +1385,7 @@ ssize_t Qcow2Image::WriteCluster(void* buffer, off_t pos, size_t length) {
   * To recycle these regions, clear the L2 table entry, and set the refcount to 0
   * The return value is always less than or equal to cluster size */
 ssize_t Qcow2Image::DiscardCluster(off_t pos, size_t length) {
+  std::lock_guard<std::mutex> lock(metadata_mutex_);
   uint64_t offset_in_cluster, l2_index;
   auto l2_table = GetL2Table(false, pos, &offset_in_cluster, &l2_index, &length);
   if (l2_table == nullptr) {
@@ -548,10 +1400,18 @@ ssize_t Qcow2Image::DiscardCluster(off_t pos, size_t length) {
   uint64_t l2_entry = be64toh(l2_table->entries[l2_index]);
   uint64_t cluster_descriptor = l2_entry & QCOW2_DESCRIPTOR_MASK;
 
-  /* Writing compressed cluster is not supported */
-  MV_ASSERT(!(l2_entry & QCOW2_OFLAG_COMPRESSED));
+  if (l2_entry & QCOW2_OFLAG_COMPRESSED) {
+    FreeCompressedCluster(cluster_descriptor);
+    l2_table->entries[l2_index] = 0;
+    l2_table->dirty = true;
+    return length;
+  }
   uint64_t host_offset = cluster_descriptor & QCOW2_STANDARD_OFFSET_MASK;
 
+  if (extended_l2_ && l2_table->entries[l2_index + 1]) {
+    l2_table->entries[l2_index + 1] = 0;
+    l2_table->dirty = true;
+  }
   if ((cluster_descriptor & 1) || host_offset == 0) {
     return length;
   }
@@ -599,26 +1459,13 @@ ssize_t Qcow2Image::BlockIo(void *buffer, off_t position, size_t length, ImageIo
 }
 
 void Qcow2Image::FlushL2Tables () {
-  int l2_table_dirty_count = 0;
-  auto map = l2_cache_.map();
-  for (auto it = map.begin(); it != map.end(); it++) {
-    auto l2_table = it->second->second;
-    if (l2_table->dirty) {
-      WriteL2Table(l2_table);
-      ++l2_table_dirty_count;
-    }
-  }
+  l2_cache_.Flush();
 }
 
 void Qcow2Image::FlushRefcountBlocks() {
-  int refcount_block_dirty_count = 0;
-  auto map = rfb_cache_.map();
-  for (auto it = map.begin(); it != map.end(); it++) {
-    auto rfb = it->second->second;
-    if (rfb->dirty) {
-      WriteRefcountBlock(rfb);
-      ++refcount_block_dirty_count;
-    }
+  rfb_cache_.Flush();
+  if (refcount_table_dirty_) {
+    WriteRefcountTable();
   }
 }
 
@@ -628,14 +1475,18 @@ long Qcow2Image::HandleIoRequest(const ImageIoRequest& request) {
   {
   case kImageIoRead:
   case kImageIoWrite: {
+    /* Walk the whole scatter-gather list cluster by cluster, stop at the end of image */
     size_t rw_total = 0, pos = request.position;
     for (auto &iov : request.vector) {
       ret = BlockIo(iov.iov_base, pos, iov.iov_len, request.type);
       if (ret <= 0) {
-        return ret;
+        return rw_total ? rw_total : ret;
       }
       rw_total += ret;
       pos += ret;
+      if ((size_t)ret < iov.iov_len) {
+        break;
+      }
     }
     ret = rw_total;
     break;
@@ -654,20 +1505,95 @@ long Qcow2Image::HandleIoRequest(const ImageIoRequest& request) {
   return ret;
 }
 
+/* Host offset of an allocated data cluster that can be accessed by io_uring, or 0 */
+uint64_t Qcow2Image::GetAsyncHostOffset(bool is_write, off_t pos, size_t* length) {
+  std::lock_guard<std::mutex> lock(metadata_mutex_);
+  uint64_t offset_in_cluster, l2_index;
+  auto l2_table = GetL2Table(is_write, pos, &offset_in_cluster, &l2_index, length);
+  if (l2_table == nullptr) {
+    return 0;
+  }
+
+  uint64_t l2_entry = be64toh(l2_table->entries[l2_index]);
+  uint64_t cluster_descriptor = l2_entry & QCOW2_DESCRIPTOR_MASK;
+  if ((l2_entry & QCOW2_OFLAG_COMPRESSED) || !(l2_entry & QCOW2_OFLAG_COPIED)) {
+    return 0;
+  }
+  /* With extended L2, length is limited to the allocated subclusters */
+  if (GetSubclusterState(l2_table, l2_index, offset_in_cluster, length) != kSubclusterAllocated) {
+    return 0;
+  }
+  return (cluster_descriptor & QCOW2_STANDARD_OFFSET_MASK) + offset_in_cluster;
+}
+
+/* Allocated data clusters are accessed by io_uring. Unallocated, compressed and
+ * backing file clusters are handled here synchronously since they touch metadata */
+bool Qcow2Image::PrepareAsyncIo(const ImageIoRequest& request, ImageAsyncIo& async_io) {
+  if (request.type != kImageIoRead && request.type != kImageIoWrite) {
+    return false;
+  }
+
+  async_io.fd = fd_;
+  off_t segment_end = -1;
+  size_t pos = request.position;
+  for (auto &iov : request.vector) {
+    auto ptr = (uint8_t*)iov.iov_base;
+    size_t offset = 0;
+    while (offset < iov.iov_len) {
+      if (pos >= image_header_.size) {
+        return true;
+      }
+
+      size_t length = iov.iov_len - offset;
+      ssize_t ret = length;
+      uint64_t host_offset = GetAsyncHostOffset(request.type == kImageIoWrite, pos, &length);
+      if (host_offset) {
+        /* Merge with the last segment if contiguous in the host file */
+        if ((off_t)host_offset != segment_end || async_io.segments.back().vector.size() >= IOV_MAX) {
+          async_io.segments.push_back(ImageAsyncSegment { .offset = (off_t)host_offset });
+        }
+        async_io.segments.back().vector.push_back(iovec { .iov_base = ptr + offset, .iov_len = length });
+        segment_end = host_offset + length;
+        ret = length;
+      } else {
+        if (request.type == kImageIoRead) {
+          ret = ReadCluster(ptr + offset, pos, length);
+        } else {
+          ret = WriteCluster(ptr + offset, pos, length);
+        }
+        if (ret <= 0) {
+          async_io.segments.clear();
+          async_io.result = ret;
+          return true;
+        }
+        async_io.result += ret;
+      }
+      offset += ret;
+      pos += ret;
+    }
+  }
+  return true;
+}
+
 ssize_t Qcow2Image::FlushAll() {
   if (readonly_) {
     return 0;
   }
 
+  /* Writing L2 tables also writes the refcounts they depend on. With lazy refcounts,
+   * a flush only writes dirty L2 tables and the L1 table. */
+  std::lock_guard<std::mutex> lock(metadata_mutex_);
   FlushL2Tables();
-  FlushRefcountBlocks();
   if (l1_table_dirty_) {
     WriteL1Table();
   }
-  if (refcount_table_dirty_) {
-    WriteRefcountTable();
+  if (!lazy_refcounts_) {
+    FlushRefcountBlocks();
   }
 
+  if (cache_mode_ == kImageCacheUnsafe) {
+    return 0;
+  }
   return fsync(fd_);
 }
 
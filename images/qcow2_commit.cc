@@ -0,0 +1,163 @@
+/* 
+ * MVisor QCOW2 Disk Image
+ * Copyright (C) 2021 Terrence <terrence@tenclass.com>
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "qcow2.h"
+#include <cstring>
+#include <thread>
+#include <future>
+#include <chrono>
+#include <unistd.h>
+#include "logger.h"
+
+/* The backing path is rewritten with the header in one block write */
+#define HEADER_BLOCK_SIZE 4096
+
+size_t Qcow2Image::backing_chain_depth() {
+  size_t depth = 0;
+  for (auto image = backing_file_; image; image = image->backing_file_) {
+    depth++;
+  }
+  return depth;
+}
+
+/* Return true if the guest cluster at pos has data or zero flags in this image,
+ * skip is set to the bytes without an L2 table */
+bool Qcow2Image::HasCluster(off_t pos, size_t* skip) {
+  std::lock_guard<std::mutex> lock(metadata_mutex_);
+  uint64_t offset_in_cluster, l2_index;
+  size_t length = cluster_size_;
+  *skip = cluster_size_;
+  auto l2_table = GetL2Table(false, pos, &offset_in_cluster, &l2_index, &length);
+  if (l2_table == nullptr) {
+    *skip = l2_entries_ * cluster_size_ - pos % (l2_entries_ * cluster_size_);
+    return false;
+  }
+  return l2_table->entries[l2_index] || (extended_l2_ && l2_table->entries[l2_index + 1]);
+}
+
+/* Point this image to another backing file. The header and the path are written
+ * in one block so a crash leaves either the old or the new chain. */
+bool Qcow2Image::RewriteBackingPath(const std::string& path) {
+  uint64_t offset = image_header_.backing_file_offset;
+  if (offset == 0 || offset + path.size() > HEADER_BLOCK_SIZE) {
+    MV_ERROR("no room for backing path %s in %s", path.c_str(), filepath_.c_str());
+    return false;
+  }
+
+  auto block = (uint8_t*)aligned_alloc(4096, HEADER_BLOCK_SIZE);
+  bool ret = false;
+  if (ReadFile(block, HEADER_BLOCK_SIZE, 0) >= (ssize_t)(offset + image_header_.backing_file_size)) {
+    auto header = (Qcow2Header*)block;
+    header->backing_file_size = htobe32(path.size());
+    memcpy(block + offset, path.data(), path.size());
+    ret = WriteFile(block, HEADER_BLOCK_SIZE, 0) == HEADER_BLOCK_SIZE;
+    if (ret) {
+      WriteBarrier();
+      image_header_.backing_file_size = path.size();
+      backing_filepath_ = path;
+    }
+  }
+  free(block);
+  return ret;
+}
+
+/* Merge the backing file into its own backing file while this image is in use,
+ * so reads missing this image look up one image less. Clusters of the backing
+ * file are copied at rate bytes per second through a writable handle of the target.
+ * Readers only reach the target for clusters the backing file doesn't have,
+ * so copying doesn't change what they read. The chain is switched by a barrier
+ * job of this image and the merged file is removed. Return false if stopped or
+ * failed, the chain is unchanged and extra clusters in the target are harmless. */
+bool Qcow2Image::CommitBackingFile(uint64_t rate, const std::atomic<bool>& stopped) {
+  auto source = backing_file_;
+  if (readonly_ || !source || !source->backing_file_) {
+    return false;
+  }
+  auto source_path = source->filepath_;
+  auto target_path = source->backing_filepath_;
+  if (image_header_.backing_file_offset + target_path.size() > HEADER_BLOCK_SIZE) {
+    MV_ERROR("no room for backing path %s in %s", target_path.c_str(), filepath_.c_str());
+    return false;
+  }
+
+  auto target = new Qcow2Image();
+  target->is_backing_file_ = true;
+  target->cache_mode_ = cache_mode_;
+  target->prefetch_workers_ = 0;
+  target->filepath_ = target_path;
+  target->Initialize();
+
+  size_t cluster_size = source->cluster_size_;
+  auto data = (uint8_t*)aligned_alloc(4096, cluster_size);
+  size_t disk_size = source->image_header_.size;
+  size_t copied = 0;
+  bool failed = false;
+  auto start_time = std::chrono::steady_clock::now();
+
+  for (size_t pos = 0; pos < disk_size && !stopped && !failed;) {
+    size_t skip;
+    if (!source->HasCluster(pos, &skip)) {
+      pos += skip;
+      continue;
+    }
+
+    /* Read through the backing file, unallocated subclusters come from the target */
+    size_t length = std::min(cluster_size, disk_size - pos);
+    if (source->BlockIo(data, pos, length, kImageIoRead) != (ssize_t)length ||
+        target->BlockIo(data, pos, length, kImageIoWrite) != (ssize_t)length) {
+      MV_ERROR("failed to commit %s at pos=0x%lx", source_path.c_str(), pos);
+      failed = true;
+    }
+    pos += cluster_size;
+    copied += length;
+
+    if (rate) {
+      auto due = start_time + std::chrono::duration<double>((double)copied / rate);
+      std::this_thread::sleep_until(std::chrono::time_point_cast<std::chrono::steady_clock::duration>(due));
+    }
+  }
+  free(data);
+
+  if (stopped || failed || target->FlushAll() < 0) {
+    delete target;
+    return false;
+  }
+  delete target;
+
+  /* Switch the chain when no request is running */
+  std::promise<bool> switched;
+  QueueBarrier([this, source, &target_path, &switched]() {
+    if (!RewriteBackingPath(target_path)) {
+      switched.set_value(false);
+      return;
+    }
+    backing_file_ = nullptr;
+    OpenBackingFile();
+    delete source;
+    switched.set_value(true);
+  });
+  if (!switched.get_future().get()) {
+    return false;
+  }
+
+  remove(source_path.c_str());
+  double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start_time).count();
+  MV_LOG("committed %s into %s, %lu MB in %.1fs", source_path.c_str(), target_path.c_str(),
+    copied >> 20, seconds);
+  return true;
+}
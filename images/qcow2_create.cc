@@ -19,6 +19,10 @@
 #include "qcow2.h"
 #include <cstdio>
 #include <cstring>
+#include <vector>
+#include <algorithm>
+#include <fcntl.h>
+#include <unistd.h>
 #include "logger.h"
 
 struct HeaderExtension {
@@ -45,9 +49,89 @@ static FeatureName default_features[] = {
 };
 
 
-void Qcow2Image::CreateEmptyImage(std::string path, size_t disk_size) {
+/* Preallocated images place the extra refcount blocks after the L1 table, followed by
+ * all L2 tables and data clusters. Metadata preallocation leaves the data sparse. */
+static void PreallocateImage(FILE* fp, size_t disk_size, size_t cluster_size, uint64_t l1_size,
+  bool extended_l2, Qcow2Preallocation preallocation) {
+  size_t l2_entries = cluster_size / (extended_l2 ? 16 : sizeof(uint64_t));
+  size_t rfb_entries = cluster_size / sizeof(uint16_t);
+  uint64_t data_clusters = (disk_size + cluster_size - 1) / cluster_size;
+
+  /* Refcount blocks must cover themselves */
+  uint64_t rfb_count = 1, total_clusters;
+  while (true) {
+    total_clusters = 4 + (rfb_count - 1) + l1_size + data_clusters;
+    uint64_t needed = (total_clusters + rfb_entries - 1) / rfb_entries;
+    if (needed <= rfb_count) {
+      break;
+    }
+    rfb_count = needed;
+  }
+  if (rfb_count > cluster_size / sizeof(uint64_t) || l1_size > cluster_size / sizeof(uint64_t)) {
+    MV_PANIC("disk size 0x%lx is too large to preallocate", disk_size);
+  }
+  uint64_t l2_start = 4 + rfb_count - 1;
+  uint64_t data_start = l2_start + l1_size;
+
+  /* Refcount table and blocks, the first block is at cluster 2 */
+  std::vector<uint64_t> refcount_table(rfb_count);
+  for (uint64_t i = 0; i < rfb_count; i++) {
+    refcount_table[i] = htobe64(cluster_size * (i == 0 ? 2 : 4 + i - 1));
+  }
+  fseek(fp, cluster_size * 1, SEEK_SET);
+  MV_ASSERT(fwrite(refcount_table.data(), sizeof(uint64_t), rfb_count, fp) == rfb_count);
+
+  std::vector<uint16_t> refcount_block(rfb_entries);
+  for (uint64_t i = 0; i < rfb_count; i++) {
+    for (size_t j = 0; j < rfb_entries; j++) {
+      refcount_block[j] = htobe16(i * rfb_entries + j < total_clusters ? 1 : 0);
+    }
+    fseek(fp, be64toh(refcount_table[i]), SEEK_SET);
+    MV_ASSERT(fwrite(refcount_block.data(), cluster_size, 1, fp) == 1);
+  }
+
+  /* L1 table points to all L2 tables */
+  std::vector<uint64_t> l1_table(l1_size);
+  for (uint64_t i = 0; i < l1_size; i++) {
+    l1_table[i] = htobe64(((l2_start + i) * cluster_size) | QCOW2_OFLAG_COPIED);
+  }
+  fseek(fp, cluster_size * 3, SEEK_SET);
+  MV_ASSERT(fwrite(l1_table.data(), sizeof(uint64_t), l1_size, fp) == l1_size);
+
+  /* L2 tables point to all data clusters */
+  std::vector<uint64_t> l2_table(cluster_size / sizeof(uint64_t));
+  for (uint64_t i = 0; i < l1_size; i++) {
+    std::fill(l2_table.begin(), l2_table.end(), 0);
+    for (size_t j = 0; j < l2_entries && i * l2_entries + j < data_clusters; j++) {
+      uint64_t host_offset = (data_start + i * l2_entries + j) * cluster_size;
+      if (extended_l2) {
+        l2_table[j * 2] = htobe64(host_offset | QCOW2_OFLAG_COPIED);
+        l2_table[j * 2 + 1] = htobe64(QCOW2_SUBCLUSTER_ALLOC_ALL);
+      } else {
+        l2_table[j] = htobe64(host_offset | QCOW2_OFLAG_COPIED);
+      }
+    }
+    fseek(fp, (l2_start + i) * cluster_size, SEEK_SET);
+    MV_ASSERT(fwrite(l2_table.data(), cluster_size, 1, fp) == 1);
+  }
+
+  /* Data clusters read zeros from the sparse file */
+  fflush(fp);
+  int fd = fileno(fp);
+  MV_ASSERT(ftruncate(fd, total_clusters * cluster_size) == 0);
+  if (preallocation == kPreallocationFalloc) {
+    if (fallocate(fd, 0, data_start * cluster_size, data_clusters * cluster_size) < 0) {
+      MV_PANIC("failed to allocate %lu clusters", data_clusters);
+    }
+  }
+}
+
+void Qcow2Image::CreateEmptyImage(std::string path, size_t disk_size, Qcow2CompressionType compression_type,
+  bool extended_l2, Qcow2Preallocation preallocation) {
   uint cluster_bits = 0x10;
   size_t cluster_size = 1 << cluster_bits;
+  /* Extended L2 entries are 128 bits */
+  size_t l2_coverage = cluster_size * (cluster_size / (extended_l2 ? 16 : sizeof(uint64_t)));
   FILE* fp = fopen(path.c_str(), "wb");
   if (fp == nullptr) {
     MV_PANIC("failed to create image file: %s", path.c_str());
@@ -60,12 +144,21 @@ void Qcow2Image::CreateEmptyImage(std::string path, size_t disk_size) {
   header.version = htobe32(3);
   header.cluster_bits = htobe32(cluster_bits);
   header.size = htobe64(disk_size);
-  header.l1_size = htobe32(disk_size / cluster_size / (cluster_size / sizeof(uint64_t)));
+  header.l1_size = htobe32((disk_size + l2_coverage - 1) / l2_coverage);
   header.l1_table_offset = htobe64(cluster_size * 3);
   header.refcount_table_offset = htobe64(cluster_size * 1);
   header.refcount_table_clusters = htobe32(1);
   header.refcount_order = htobe32(4);
   header.header_length = htobe32(0x70);
+  uint64_t incompatible_features = 0;
+  if (compression_type != kCompressionTypeZlib) {
+    incompatible_features |= QCOW2_INCOMPAT_COMPRESSION;
+    header.compression_type = compression_type;
+  }
+  if (extended_l2) {
+    incompatible_features |= QCOW2_INCOMPAT_EXTL2;
+  }
+  header.incompatible_features = htobe64(incompatible_features);
   fwrite(&header, sizeof(header), 1, fp);
 
   /* Seek to extensions */
@@ -78,6 +171,12 @@ void Qcow2Image::CreateEmptyImage(std::string path, size_t disk_size) {
   fwrite(&feature_extension, sizeof(feature_extension), 1, fp);
   fwrite(default_features, sizeof(default_features), 1, fp);
 
+  if (preallocation != kPreallocationOff) {
+    PreallocateImage(fp, disk_size, cluster_size, be32toh(header.l1_size), extended_l2, preallocation);
+    fclose(fp);
+    return;
+  }
+
   /* Seek to refcount table */
   fseek(fp, cluster_size * 1, SEEK_SET);
   uint64_t refcount_table_entry = htobe64(cluster_size * 2);
@@ -98,7 +197,7 @@ void Qcow2Image::CreateEmptyImage(std::string path, size_t disk_size) {
   fclose(fp);
 }
 
-void Qcow2Image::CreateImageWithBackingFile(std::string path, std::string backing_path) {
+void Qcow2Image::CreateImageWithBackingFile(std::string path, std::string backing_path, bool extended_l2) {
   FILE* fin = fopen(backing_path.c_str(), "rb");
   if (fin == nullptr) {
     MV_PANIC("failed to open QCOW2 file: %s", backing_path.c_str());
@@ -167,6 +266,16 @@ void Qcow2Image::CreateImageWithBackingFile(std::string path, std::string backin
   auto header = (Qcow2Header*)buffer;
   header->backing_file_offset = htobe64(pos);
   header->backing_file_size = htobe32(backing_path.length());
+  if (extended_l2 && !(be64toh(header->incompatible_features) & QCOW2_INCOMPAT_EXTL2)) {
+    /* Each L2 table covers half the clusters, the L1 table must still fit in one cluster */
+    uint64_t l2_coverage = (uint64_t)cluster_size * (cluster_size / 16);
+    uint64_t l1_size = (be64toh(header->size) + l2_coverage - 1) / l2_coverage;
+    if (l1_size * sizeof(uint64_t) > cluster_size) {
+      MV_PANIC("disk size 0x%lx is too large for extended L2 entries", be64toh(header->size));
+    }
+    header->l1_size = htobe32(l1_size);
+    header->incompatible_features = htobe64(be64toh(header->incompatible_features) | QCOW2_INCOMPAT_EXTL2);
+  }
   MV_ASSERT(fwrite(buffer, header_length, 1, fout) == 1);
 
   /* Seek to refcount table */
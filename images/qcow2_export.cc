@@ -0,0 +1,132 @@
+/* 
+ * MVisor QCOW2 Disk Image
+ * Copyright (C) 2021 Terrence <terrence@tenclass.com>
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "qcow2.h"
+#include <cstring>
+#include <thread>
+#include <atomic>
+#include <future>
+#include <chrono>
+#include <sys/stat.h>
+#include "logger.h"
+
+#define EXPORT_COMPRESSION_LEVEL  3
+
+/* Export the source image and its backing chain as a standalone zstd compressed
+ * qcow2 image. Clusters are read through the request queue of the source, which
+ * must not change while exporting. It is opened read-only by 'mvisor -export', or
+ * is the chain below a new overlay for Machine::ExportDiskImage().
+ * Zero clusters are left unallocated, incompressible clusters are stored as is. */
+bool Qcow2Image::ExportCompressedImage(DiskImage* source, std::string path, size_t threads) {
+  auto information = source->information();
+  size_t disk_size = information.block_size * information.total_blocks;
+  CreateEmptyImage(path, disk_size, kCompressionTypeZstd);
+
+  auto image = new Qcow2Image();
+  image->filepath_ = path;
+  image->Initialize();
+
+  size_t cluster_size = image->cluster_size_;
+  size_t total_clusters = (disk_size + cluster_size - 1) / cluster_size;
+  std::atomic<size_t> next_cluster = 0;
+  std::atomic<size_t> compressed_clusters = 0, zero_clusters = 0, raw_clusters = 0;
+  std::atomic<bool> failed = false;
+  auto start_time = std::chrono::steady_clock::now();
+
+  auto export_process = [&]() {
+    SetThreadName("mvisor-export");
+    auto data = (uint8_t*)aligned_alloc(4096, cluster_size);
+    auto compressed = new uint8_t[cluster_size];
+
+    while (!failed) {
+      size_t index = next_cluster++;
+      if (index >= total_clusters) {
+        break;
+      }
+      size_t position = index * cluster_size;
+      size_t length = std::min(cluster_size, disk_size - position);
+
+      ImageIoRequest request = {
+        .type = kImageIoRead,
+        .position = position,
+        .length = length
+      };
+      request.vector.push_back(iovec { .iov_base = data, .iov_len = length });
+      std::promise<ssize_t> done;
+      source->QueueIoRequest(request, [&done](auto ret) {
+        done.set_value(ret);
+      });
+      if (done.get_future().get() != (ssize_t)length) {
+        MV_ERROR("failed to read source image at pos=0x%lx", position);
+        failed = true;
+        break;
+      }
+      if (length < cluster_size) {
+        bzero(data + length, cluster_size - length);
+      }
+
+      if (test_zero(data, cluster_size)) {
+        zero_clusters++;
+        continue;
+      }
+
+      /* Compressed data must be smaller than a cluster to save space */
+      ssize_t ret = zstd_compress(data, cluster_size, compressed, cluster_size - QCOW2_COMPRESSED_SECTOR_SIZE,
+        EXPORT_COMPRESSION_LEVEL);
+      if (ret > 0) {
+        ret = image->WriteCompressedCluster(position, compressed, ret);
+        compressed_clusters++;
+      } else {
+        ret = image->WriteCluster(data, position, cluster_size);
+        raw_clusters++;
+      }
+      if (ret < 0) {
+        MV_ERROR("failed to write %s at pos=0x%lx", path.c_str(), position);
+        failed = true;
+      }
+    }
+
+    delete[] compressed;
+    free(data);
+  };
+
+  std::vector<std::thread> workers;
+  for (size_t i = 0; i < std::max(1UL, threads); i++) {
+    workers.emplace_back(export_process);
+  }
+  for (auto &thread : workers) {
+    thread.join();
+  }
+
+  if (image->FlushAll() < 0) {
+    MV_ERROR("failed to flush %s", path.c_str());
+    failed = true;
+  }
+  size_t file_size = image->image_size_;
+  struct stat st;
+  if (fstat(image->fd_, &st) == 0) {
+    file_size = st.st_size;
+  }
+  delete image;
+
+  double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start_time).count();
+  MV_LOG("exported %s to %s: disk=%luMB file=%luMB compressed=%lu raw=%lu zero=%lu threads=%lu time=%.1fs",
+    source->filepath().c_str(), path.c_str(), disk_size >> 20, file_size >> 20, compressed_clusters.load(),
+    raw_clusters.load(), zero_clusters.load(), threads, seconds);
+  return !failed;
+}
@@ -0,0 +1,159 @@
+/* 
+ * MVisor
+ * Copyright (C) 2021 Terrence <terrence@tenclass.com>
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+#include "qcow2_shared_cache.h"
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+#include <signal.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "logger.h"
+
+#define SHARED_CACHE_MAGIC  0x4D5653484152454FULL
+
+/* The last process detaching removes the object, processes that crashed have
+ * released their locks. The object is named after the image file, so a new
+ * name is used when the image changes. */
+Qcow2SharedCache::~Qcow2SharedCache() {
+  if (mapped_) {
+    munmap(mapped_, mapped_size_);
+  }
+  if (shm_fd_ >= 0) {
+    if (flock(shm_fd_, LOCK_EX | LOCK_NB) == 0) {
+      shm_unlink(name_.c_str());
+    }
+    close(shm_fd_);
+  }
+}
+
+/* Every attached process holds a shared lock on the object */
+int Qcow2SharedCache::Attach(const char* name) {
+  for (int retry = 0; retry < 3; retry++) {
+    int shm_fd = shm_open(name, O_RDWR | O_CREAT, 0600);
+    if (shm_fd < 0) {
+      return -1;
+    }
+    struct stat st;
+    if (flock(shm_fd, LOCK_SH) == 0 && fstat(shm_fd, &st) == 0 && st.st_nlink > 0) {
+      return shm_fd;
+    }
+    /* The last process unlinked it before we got the lock */
+    close(shm_fd);
+  }
+  return -1;
+}
+
+bool Qcow2SharedCache::Initialize(int fd, size_t cluster_size, size_t cache_size) {
+  struct stat st;
+  if (fstat(fd, &st) < 0) {
+    return false;
+  }
+  pid_ = getpid();
+  cluster_size_ = cluster_size;
+  slots_ = cache_size / cluster_size;
+  if (slots_ == 0) {
+    return false;
+  }
+
+  char name[128];
+  snprintf(name, sizeof(name), "/mvisor-qcow2-%lx-%lx-%lx.%lx-%lx-%lx", st.st_dev, st.st_ino,
+    st.st_mtim.tv_sec, st.st_mtim.tv_nsec, st.st_size, cache_size);
+  name_ = name;
+
+  size_t table_size = sizeof(Qcow2SharedCacheHeader) + slots_ * sizeof(Qcow2SharedCacheSlot);
+  table_size = (table_size + cluster_size - 1) & ~(cluster_size - 1);
+  mapped_size_ = table_size + slots_ * cluster_size;
+
+  shm_fd_ = Attach(name);
+  if (shm_fd_ < 0) {
+    MV_WARN("failed to open shared cache %s", name);
+    return false;
+  }
+  /* Every process sizes the object the same, pages stay unallocated until used */
+  if (ftruncate(shm_fd_, mapped_size_) < 0) {
+    return false;
+  }
+  mapped_ = mmap(nullptr, mapped_size_, PROT_READ | PROT_WRITE, MAP_SHARED, shm_fd_, 0);
+  if (mapped_ == MAP_FAILED) {
+    mapped_ = nullptr;
+    return false;
+  }
+
+  auto header = (Qcow2SharedCacheHeader*)mapped_;
+  if (header->magic == 0) {
+    header->cluster_size = cluster_size_;
+    header->slots = slots_;
+    __atomic_store_n(&header->magic, SHARED_CACHE_MAGIC, __ATOMIC_RELEASE);
+  } else if (header->magic != SHARED_CACHE_MAGIC || header->cluster_size != cluster_size_ ||
+    header->slots != slots_) {
+    MV_WARN("shared cache %s does not match the image", name);
+    munmap(mapped_, mapped_size_);
+    mapped_ = nullptr;
+    return false;
+  }
+  slot_table_ = (Qcow2SharedCacheSlot*)(header + 1);
+  data_ = (uint8_t*)mapped_ + table_size;
+  return true;
+}
+
+bool Qcow2SharedCache::Read(uint64_t cluster_index, uint64_t offset_in_cluster, void* buffer, size_t length) {
+  auto& slot = slot_table_[cluster_index % slots_];
+  uint64_t sequence = slot.sequence.load(std::memory_order_acquire);
+  if ((sequence & 1) || slot.key.load(std::memory_order_relaxed) != cluster_index + 1) {
+    misses_++;
+    return false;
+  }
+
+  memcpy(buffer, data_ + (cluster_index % slots_) * cluster_size_ + offset_in_cluster, length);
+  std::atomic_thread_fence(std::memory_order_acquire);
+  if (slot.sequence.load(std::memory_order_relaxed) != sequence) {
+    misses_++;
+    return false;
+  }
+  hits_++;
+  return true;
+}
+
+/* Writers keep their pid in the high half of the odd sequence. Skip if another
+ * process is writing the slot, take it over if that writer has died. */
+void Qcow2SharedCache::Insert(uint64_t cluster_index, const void* data) {
+  auto& slot = slot_table_[cluster_index % slots_];
+  uint64_t sequence = slot.sequence.load(std::memory_order_relaxed);
+  if (sequence & 1) {
+    pid_t writer = sequence >> 32;
+    if (kill(writer, 0) == 0 || errno != ESRCH) {
+      return;
+    }
+  } else if (slot.key.load(std::memory_order_relaxed) == cluster_index + 1) {
+    return;
+  }
+  uint32_t counter = sequence;
+  uint64_t locked = ((uint64_t)pid_ << 32) | (uint32_t)(counter + 1 + (counter & 1));
+  if (!slot.sequence.compare_exchange_strong(sequence, locked, std::memory_order_acquire)) {
+    return;
+  }
+  std::atomic_thread_fence(std::memory_order_release);
+
+  slot.key.store(0, std::memory_order_relaxed);
+  memcpy(data_ + (cluster_index % slots_) * cluster_size_, data, cluster_size_);
+  slot.key.store(cluster_index + 1, std::memory_order_relaxed);
+  slot.sequence.store((uint32_t)(locked + 1), std::memory_order_release);
+}
@@ -21,8 +21,14 @@
 #include <unistd.h>
 #include <fcntl.h>
 #include <unistd.h>
+#include <climits>
+#include <cstring>
 #include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <linux/falloc.h>
+#include <linux/fs.h>
 #include <filesystem>
+#include <atomic>
 
 #include "logger.h"
 #include "device_manager.h"
@@ -32,6 +38,10 @@ class RawImage : public DiskImage {
   int fd_ = -1;
   size_t block_size_ = 512;
   size_t total_blocks_ = 0;
+  bool is_block_device_ = false;
+  /* Cleared by any worker when the file system or device doesn't support the operation */
+  std::atomic<bool> punch_hole_ = true;
+  std::atomic<bool> zero_range_ = true;
 
   ImageInformation information() {
     return ImageInformation {
@@ -60,7 +70,7 @@ class RawImage : public DiskImage {
       filepath_ = temp;
     }
     
-    fd_ = open(filepath_.c_str(), oflags);
+    fd_ = OpenFile(filepath_, oflags);
     if (fd_ < 0)
       MV_PANIC("disk file not found: %s", filepath_.c_str());
 
@@ -68,6 +78,91 @@ class RawImage : public DiskImage {
     fstat(fd_, &st);
     block_size_ = 512;
     total_blocks_ = st.st_size / block_size_;
+    if (S_ISBLK(st.st_mode)) {
+      uint64_t size = 0;
+      if (ioctl(fd_, BLKGETSIZE64, &size) < 0) {
+        MV_PANIC("failed to get size of block device %s", filepath_.c_str());
+      }
+      is_block_device_ = true;
+      total_blocks_ = size / block_size_;
+    }
+  }
+
+  virtual bool SupportsDiscard() {
+    return true;
+  }
+
+  /* Discard is a hint, failures are not reported to the guest. Block devices
+   * support punching holes since Linux 4.9, BLKDISCARD is used on older kernels. */
+  long Discard(off_t position, size_t length) {
+    if (readonly_) {
+      return -EROFS;
+    }
+    if (punch_hole_) {
+      if (fallocate(fd_, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, position, length) == 0 ||
+          errno != EOPNOTSUPP) {
+        return length;
+      }
+      punch_hole_ = false;
+    }
+    if (is_block_device_) {
+      uint64_t range[2] = { (uint64_t)position, length };
+      ioctl(fd_, BLKDISCARD, range);
+    }
+    return length;
+  }
+
+  /* Zero the range without writing data if possible, holes are allowed
+   * because write_zeroes_may_unmap is set */
+  long WriteZeros(off_t position, size_t length) {
+    if (readonly_) {
+      return -EROFS;
+    }
+    if (zero_range_) {
+      if (fallocate(fd_, FALLOC_FL_ZERO_RANGE | FALLOC_FL_KEEP_SIZE, position, length) == 0) {
+        return length;
+      }
+      if (errno != EOPNOTSUPP) {
+        return -errno;
+      }
+      zero_range_ = false;
+    }
+    if (is_block_device_) {
+      uint64_t range[2] = { (uint64_t)position, length };
+      if (ioctl(fd_, BLKZEROOUT, range) == 0) {
+        return length;
+      }
+    } else if (punch_hole_) {
+      if (fallocate(fd_, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, position, length) == 0) {
+        return length;
+      }
+      if (errno == EOPNOTSUPP) {
+        punch_hole_ = false;
+      }
+    }
+    return WriteZeroBuffers(position, length);
+  }
+
+  /* Fallback if neither file system nor device can zero a range */
+  long WriteZeroBuffers(off_t position, size_t length) {
+    const size_t chunk_size = 1 << 20;
+    auto buffer = aligned_alloc(4096, chunk_size);
+    MV_ASSERT(buffer);
+    bzero(buffer, chunk_size);
+    size_t done = 0;
+    long ret = length;
+    while (done < length) {
+      size_t chunk = std::min(chunk_size, length - done);
+      iovec iov = { .iov_base = buffer, .iov_len = chunk };
+      ssize_t written = VectorFileIo(fd_, true, &iov, 1, position + done);
+      if (written != (ssize_t)chunk) {
+        ret = written < 0 ? written : -EIO;
+        break;
+      }
+      done += chunk;
+    }
+    free(buffer);
+    return ret;
   }
 
   long HandleIoRequest(const ImageIoRequest& request) {
@@ -76,26 +171,19 @@ class RawImage : public DiskImage {
     switch (request.type)
     {
     case kImageIoRead:
-    case kImageIoWrite: {
-      size_t rw_total = 0, pos = request.position;
-      for (auto &iov : request.vector) {
-        if (request.type == kImageIoRead) {
-          ret = pread(fd_, iov.iov_base, iov.iov_len, pos);
-        } else {
-          ret = pwrite(fd_, iov.iov_base, iov.iov_len, pos);
-        }
-        if (ret <= 0) {
-          return ret;
-        }
-        rw_total += ret;
-        pos += ret;
-      }
-      ret = rw_total;
+    case kImageIoWrite:
+      ret = VectorFileIo(fd_, request.type == kImageIoWrite, request.vector.data(), request.vector.size(),
+        request.position);
       break;
-    }
     case kImageIoFlush:
       ret = FlushAll();
       break;
+    case kImageIoDiscard:
+      ret = Discard(request.position, request.length);
+      break;
+    case kImageIoWriteZeros:
+      ret = WriteZeros(request.position, request.length);
+      break;
     default:
       MV_ERROR("unhandled io request %d", request.type);
       break;
@@ -103,8 +191,36 @@ class RawImage : public DiskImage {
     return ret;
   }
 
+  bool PrepareAsyncIo(const ImageIoRequest& request, ImageAsyncIo& async_io) {
+    async_io.fd = fd_;
+    switch (request.type)
+    {
+    case kImageIoRead:
+    case kImageIoWrite: {
+      off_t pos = request.position;
+      for (size_t i = 0; i < request.vector.size(); i += IOV_MAX) {
+        auto end = std::min(request.vector.size(), i + IOV_MAX);
+        ImageAsyncSegment segment = {
+          .offset = pos,
+          .vector = std::vector<iovec>(request.vector.begin() + i, request.vector.begin() + end)
+        };
+        for (auto &iov : segment.vector) {
+          pos += iov.iov_len;
+        }
+        async_io.segments.push_back(std::move(segment));
+      }
+      return true;
+    }
+    case kImageIoFlush:
+      async_io.fsync = !skip_fsync();
+      return true;
+    default:
+      return false;
+    }
+  }
+
   ssize_t FlushAll() {
-    if (readonly_) {
+    if (skip_fsync()) {
       return 0;
     } else {
       return fsync(fd_);
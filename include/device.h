@@ -91,7 +91,7 @@ class Device : public Object {
  protected:
   friend class IoThread;
   friend class DeviceManager;
-  DeviceManager* manager_;
+  DeviceManager* manager_ = nullptr;
 
   bool                    connected_ = false;
   std::set<IoResource*>   io_resources_;
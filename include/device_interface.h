@@ -29,6 +29,7 @@
 #include <cstdint>
 
 #include "logger.h"
+#include "iovec_list.h"
 
 class KeyboardInputInterface {
  public:
@@ -264,9 +265,10 @@ class NetworkBackendInterface {
  public:
   virtual ~NetworkBackendInterface() = default;
   virtual void Initialize(NetworkDeviceInterface* device, MacAddress& mac) = 0;
+  virtual void SetMacAddress(MacAddress& mac) = 0;
   virtual void SetMtu(int mtu) = 0;
   virtual void Reset() = 0;
-  virtual void OnFrameFromGuest(std::deque<iovec>& vector) = 0;
+  virtual void OnFrameFromGuest(IovecList& vector) = 0;
   virtual void OnReceiveAvailable() = 0;
 
   inline NetworkDeviceInterface* device() { return device_; }
@@ -276,6 +278,14 @@ class NetworkBackendInterface {
 };
 
 
+/* Network devices given a new MAC address by the host, e.g. clones of a template,
+ * while the restored guest driver still uses the old one */
+class MacAddressInterface {
+ public:
+  virtual ~MacAddressInterface() = default;
+  virtual bool GetMacAddressChange(MacAddress& guest_mac, MacAddress& new_mac) = 0;
+};
+
 class PowerDownInterface {
  public:
   virtual ~PowerDownInterface() = default;
@@ -55,6 +55,8 @@ struct IoEvent {
   uint64_t        datamatch;
   uint32_t        flags;
   int             fd;
+  /* Polled by a queue thread instead of the IoThread */
+  IoThread*       io_thread;
 };
 
 struct IoAccounting {
@@ -88,6 +90,7 @@ class DeviceManager {
   void UnregisterIoHandler(Device* device, const IoResource* resource);
   IoEvent* RegisterIoEvent(Device* device, IoResourceType type, uint64_t address);
   IoEvent* RegisterIoEvent(Device* device, IoResourceType type, uint64_t address, uint32_t length, uint64_t datamatch);
+  IoEvent* RegisterIoEvent(Device* device, IoResourceType type, uint64_t address, IoThread* io_thread, VoidCallback callback);
   void UnregisterIoEvent(Device* device, IoResourceType type, uint64_t address);
   void UnregisterIoEvent(IoEvent* event);
   void SetupCoalescingMmioRing(kvm_coalesced_mmio_ring* ring);
@@ -120,9 +123,11 @@ class DeviceManager {
   inline Machine* machine() { return machine_; }
   inline Device* root() { return root_; }
   IoThread* io();
+  IoThread* queue_io(size_t index);
 
  private:
   void SetupIrqChip();
+  IoEvent* CreateIoEvent(Device* device, IoResourceType type, uint64_t address, uint32_t length, uint64_t datamatch);
   void ResetGsiRoutingTable();
   void UpdateGsiRoutingTable();
 
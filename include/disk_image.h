@@ -40,6 +40,15 @@ enum ImageIoType {
   kImageIoDiscard,
   kImageIoWriteZeros
 };
+#define IMAGE_IO_TYPES (kImageIoWriteZeros + 1)
+
+/* writeback uses the host page cache, none opens images with O_DIRECT,
+ * unsafe is writeback without fsync for throwaway machines */
+enum ImageCacheMode {
+  kImageCacheWriteback,
+  kImageCacheNone,
+  kImageCacheUnsafe
+};
 
 struct ImageIoRequest {
   ImageIoType         type;
@@ -48,12 +57,108 @@ struct ImageIoRequest {
   std::vector<iovec>  vector;
 };
 
+/* Host file range of an asynchronous data request, short transfers advance
+ * offset and vector and are submitted again. An empty vector is the fsync. */
+struct ImageAsyncIo;
+struct ImageAsyncSegment {
+  off_t               offset;
+  std::vector<iovec>  vector;
+  ImageAsyncIo*       async_io = nullptr;
+};
+
+/* A request mapped by an image format for the io_uring engine,
+ * bytes handled synchronously while mapping are counted in result */
+struct ImageAsyncIo {
+  int                             fd = -1;
+  bool                            is_write = false;
+  bool                            fsync = false;
+  std::vector<ImageAsyncSegment>  segments;
+  ImageAsyncSegment               flush = {};
+  long                            result = 0;
+  size_t                          pending = 0;
+  IoCallback                      callback;
+  size_t                          requests = 1;
+  IoTimePoint                     start_time;
+};
+
+/* Barrier jobs start after all earlier jobs are done and block later ones.
+ * Request jobs keep their request so adjacent reads or writes can be merged,
+ * each merged request has its length and callback in completions. */
+struct DiskImageJob {
+  bool                                        barrier;
+  VoidCallback                                callback;
+  ImageIoRequest                              request;
+  std::vector<std::pair<size_t, IoCallback>>  completions;
+  IoTimePoint                                 throttled_time;
+  IoTimePoint                                 queued_time;
+};
+
+#define DISK_LATENCY_BUCKETS 24
+
+/* Bucket i counts latencies in [2^i, 2^(i+1)) microseconds, bucket 0 includes shorter ones */
+struct DiskLatencyHistogram {
+  uint64_t  buckets[DISK_LATENCY_BUCKETS] = {};
+  uint64_t  count = 0;
+  uint64_t  total_ns = 0;
+
+  void Add(uint64_t ns);
+  /* Upper bound in microseconds of the bucket holding the percentile */
+  uint64_t Percentile(double percent) const;
+};
+
+struct DiskImageStatistics {
+  uint64_t  requests = 0;           /* read / write requests queued */
+  uint64_t  merged_requests = 0;    /* requests appended to another job */
+  uint64_t  operations[IMAGE_IO_TYPES] = {};  /* requests by ImageIoType */
+  uint64_t  bytes[IMAGE_IO_TYPES] = {};
+  uint64_t  inflight = 0;           /* requests queued and not completed */
+  uint64_t  max_inflight = 0;
+  /* Per job, merged requests share the wait of the first one */
+  DiskLatencyHistogram queue_wait;  /* from queued to started by a worker */
+  DiskLatencyHistogram service;     /* from started to completed */
+  uint64_t  throttled_requests = 0; /* requests held back by the throttle */
+  uint64_t  throttle_delay_ns = 0;  /* total time held requests waited */
+  uint64_t  throttle_queue = 0;     /* requests held now */
+
+  /* Filled by qcow2 images */
+  uint64_t  l2_cache_hits = 0;
+  uint64_t  l2_cache_misses = 0;
+  uint64_t  refcount_cache_hits = 0;
+  uint64_t  refcount_cache_misses = 0;
+  uint64_t  cluster_cache_hits = 0;   /* decompressed clusters */
+  uint64_t  cluster_cache_misses = 0;
+  uint64_t  shared_cache_hits = 0;
+  uint64_t  shared_cache_misses = 0;
+  uint64_t  cow_copies = 0;           /* partial writes filled from the backing file or zeros */
+  uint64_t  copy_on_read = 0;         /* clusters copied up by reads */
+  uint64_t  backing_reads = 0;        /* reads passed to the backing file */
+  uint64_t  backing_bytes = 0;
+};
+
+/* Token bucket of a throttle limit, rate is ops or bytes per second and
+ * burst is the bucket size. Tokens go below zero after a request larger
+ * than the remaining tokens, later requests wait for the debt to be paid. */
+struct DiskThrottleBucket {
+  double  rate = 0;
+  double  burst = 0;
+  double  tokens = 0;
+};
+
+enum DiskThrottleLimit {
+  kThrottleReadIops,
+  kThrottleReadBps,
+  kThrottleWriteIops,
+  kThrottleWriteBps,
+  kThrottleLimits
+};
+
 struct ImageInformation {
   /* Disk size is block_size * total_blocks */
   size_t block_size;
   size_t total_blocks;
 };
 
+struct io_uring;
 class Device;
 class DiskImage : public Object {
  public:
@@ -73,10 +178,20 @@ class DiskImage : public Object {
   /* Interface for a image format to implement */
   virtual ImageInformation information() = 0;
   virtual long HandleIoRequest(const ImageIoRequest& request) = 0;
+  /* Return true if kImageIoDiscard and kImageIoWriteZeros are handled */
+  virtual bool SupportsDiscard() { return false; }
+  /* Map a request to host file ranges for io_uring, return false to handle it with HandleIoRequest() */
+  virtual bool PrepareAsyncIo(const ImageIoRequest& request, ImageAsyncIo& async_io);
+  /* Add counters of the image format */
+  virtual void GetFormatStatistics(DiskImageStatistics* statistics);
 
   /* Interface for user */
   virtual void QueueIoRequest(ImageIoRequest request, IoCallback callback);
   virtual void QueueMultipleIoRequests(std::vector<ImageIoRequest> requests, IoCallback callback);
+  /* Hold requests queued between Plug() and Unplug() to sort and merge them */
+  void Plug();
+  void Unplug();
+  DiskImageStatistics statistics();
 
  protected:
   bool        readonly_ = false;
@@ -86,18 +201,86 @@ class DiskImage : public Object {
   Device*     device_ = nullptr;
   IoThread*   io_ = nullptr;
   std::string filepath_;
+  ImageCacheMode cache_mode_ = kImageCacheWriteback;
+  size_t direct_alignment_ = 512;
 
   virtual void Initialize() = 0;
 
+  /* File access helpers that follow the cache mode */
+  int OpenFile(const std::string& path, int flags);
+  size_t ProbeDirectAlignment(int fd);
+  bool IsDirectAligned(const iovec* vector, size_t count, off_t offset);
+  ssize_t VectorFileIo(int fd, bool is_write, const iovec* vector, size_t count, off_t offset);
+  inline bool skip_fsync() { return readonly_ || cache_mode_ == kImageCacheUnsafe; }
+  /* Run the callback on a worker when no other job is running */
+  void QueueBarrier(VoidCallback callback);
+
  private:
-  /* Worker thread to implemente Async IO */
-  std::thread               worker_thread_;
+  /* Worker threads to implemente Async IO */
+  std::vector<std::thread>  worker_threads_;
   std::mutex                worker_mutex_;
   std::condition_variable   worker_cv_;
-  std::deque<VoidCallback>  worker_queue_;
+  std::deque<DiskImageJob>  worker_queue_;
+  size_t                    worker_running_ = 0;
+  bool                      barrier_running_ = false;
   bool                      finalized_ = false;
 
+  /* Request merging, enabled by the merge key */
+  bool                      merge_ = false;
+  size_t                    max_merge_bytes_ = 1 << 20;
+  int                       plugged_ = 0;
+  std::vector<DiskImageJob> plugged_jobs_;
+  DiskImageStatistics       statistics_;
+
+  /* Throttling, enabled by read_iops, read_bps, write_iops or write_bps keys.
+   * Held requests are released by the workers when the refill deadline expires. */
+  bool                      throttle_ = false;
+  DiskThrottleBucket        throttle_buckets_[kThrottleLimits];
+  IoTimePoint               throttle_refill_time_;
+  IoTimePoint               throttle_release_time_;
+  std::deque<DiskImageJob>  throttled_jobs_;
+
+  /* Aligned bounce buffers for O_DIRECT requests with misaligned iovecs */
+  std::mutex                bounce_mutex_;
+  std::vector<std::pair<size_t, void*>> bounce_buffers_;
+  /* Aligned ranges of bounced writes reading and rewriting partial blocks */
+  std::condition_variable   bounce_cv_;
+  std::vector<std::pair<off_t, off_t>> bounce_ranges_;
+
+  void* AcquireBounceBuffer(size_t size);
+  void ReleaseBounceBuffer(void* buffer, size_t size);
+  void LockBounceRange(off_t start, off_t end);
+  void UnlockBounceRange(off_t start, off_t end);
+  ssize_t BounceFileIo(int fd, bool is_write, const iovec* vector, size_t count, off_t offset);
+
   void WorkerProcess();
+  bool CanStartJob();
+  bool RunRequestJob(DiskImageJob& job, size_t requests, IoTimePoint start_time);
+  void RecordCompletion(size_t requests, IoTimePoint start_time);
+  void PushJob(DiskImageJob job);
+  void QueueJob(DiskImageJob job);
+  void DispatchPluggedJobs();
+
+  void InitializeThrottle();
+  void RefillThrottle(IoTimePoint now);
+  int64_t ChargeThrottle(const ImageIoRequest& request);
+  void ReleaseThrottledJobs();
+
+  /* io_uring engine, submitted by the worker thread and reaped by the IoThread,
+   * which also resubmits short transfers. Submissions hold ring_mutex_. */
+  struct io_uring*          ring_ = nullptr;
+  int                       ring_event_fd_ = -1;
+  size_t                    ring_depth_ = 128;
+  std::mutex                ring_mutex_;
+  std::condition_variable   ring_cv_;
+  size_t                    ring_inflight_ = 0;
+
+  void InitializeAsyncIo();
+  void DestroyAsyncIo();
+  bool SubmitAsyncIo(const ImageIoRequest& request, IoCallback& callback, size_t requests, IoTimePoint start_time);
+  void ReapAsyncIo();
+  void DrainAsyncIo();
+  void PrepareAsyncSegment(ImageAsyncSegment* segment);
 };
 
 
@@ -31,6 +31,7 @@
 #include <deque>
 #include <set>
 #include <list>
+#include <map>
 #include <unordered_map>
 #include <thread>
 #include <functional>
@@ -38,6 +39,7 @@
 #include <mutex>
 #include <condition_variable>
 #include <queue>
+#include <atomic>
 
 #include "migration.h"
 #include "io_thread.pb.h"
@@ -65,13 +67,26 @@ struct EpollEvent {
   Device*       device;
 };
 
+typedef std::function<bool()> PollCallback;
+typedef std::function<void(bool)> PollNotifyCallback;
+struct IoPoller {
+  Device*             device;
+  int64_t             max_ns;
+  /* Return true if new work is found and handled */
+  PollCallback        poll;
+  /* Turn off guest notifications while polling, and on again after */
+  PollNotifyCallback  set_notification;
+  bool                removed;
+};
+
 class Machine;
 class DiskImage;
+struct DiskImageStatistics;
 class Qcow2Image;
 class MigrationWriter;
 class IoThread {
  public:
-  IoThread(Machine* machine);
+  IoThread(Machine* machine, std::string name = "mvisor-iothread");
   ~IoThread();
   void Start();
   void Kick();
@@ -86,6 +101,10 @@ class IoThread {
   void ModifyTimer(IoTimer* timer, int64_t interval_ns);
   void Schedule(Device* device, VoidCallback callback);
 
+  /* Busy polling before sleeping, the window adapts up to the largest max_ns */
+  IoPoller* AddPoller(Device* device, int64_t max_ns, PollCallback poll, PollNotifyCallback set_notification);
+  void RemovePoller(IoPoller** poller);
+
   /* Disk images */
   void RegisterDiskImage(DiskImage* image);
   void UnregisterDiskImage(DiskImage* image);
@@ -95,6 +114,11 @@ class IoThread {
   bool SaveBackingDiskImage(MigrationNetworkWriter* writer);
   bool LoadBackingDiskImage(MigrationNetworkReader* reader);
   bool CreateQcow2ImageSnapshot();
+  bool ExportDiskImage(std::string device_name, std::string path, size_t threads);
+  std::map<std::string, DiskImageStatistics> GetDiskImageStatistics();
+  /* Merge snapshot overlays in background to keep backing chains short */
+  void StartCommittingDiskImages();
+  void StopCommittingDiskImages();
   uint GetDiskImageCount() { return disk_images_.size(); }
 
  private:
@@ -102,8 +126,12 @@ class IoThread {
   int64_t CheckTimers();
   bool    CanPauseNow();
   bool    PreRun();
+  bool    RunPollers(int64_t window_ns);
+  bool    CallPoller(IoPoller* poller, const std::function<bool()>& callback);
+  void    AdjustPollWindow(int64_t block_ns);
 
   std::thread           thread_;
+  std::string           name_;
   Machine*              machine_;
   std::mutex            mutex_;
   std::condition_variable wait_to_resume_;
@@ -113,8 +141,16 @@ class IoThread {
   int                   epoll_fd_;
   bool                  paused_ = true;
   std::list<IoTimer*>   timers_;
+  std::list<IoPoller*>  pollers_;
+  std::atomic<int64_t>  poll_max_ns_ = 0;
+  int64_t               poll_ns_ = 0;
+  std::atomic<bool>     kicked_ = false;
   std::list<DiskImage*>  disk_images_;
   std::unordered_map<Qcow2Image*, std::queue<std::string>> qcow2_image_backing_files_;
+  std::thread           commit_thread_;
+  std::atomic<bool>     commit_stopped_ = false;
+
+  void CommitDiskImages();
   std::unordered_map<int, EpollEvent*>  epoll_events_;
   
   friend class IoThreadLockGuard;
@@ -0,0 +1,87 @@
+/* 
+ * MVisor
+ * Copyright (C) 2021 Terrence <terrence@tenclass.com>
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef _MVISOR_IOVEC_LIST_H
+#define _MVISOR_IOVEC_LIST_H
+
+#include <cstdlib>
+#include <cstring>
+#include <sys/uio.h>
+
+/* Short lists are stored inline, so virtio chains of a few descriptors
+ * don't allocate */
+#define IOVEC_LIST_INLINE_SIZE  16
+
+/* A list of iovec used as a queue of guest buffers. Items are contiguous, so the
+ * list can be passed to preadv() and friends. pop_front() only moves the start.
+ * Long lists move to the heap, and the heap storage is kept after clear() to be
+ * reused by the next chain. The list can't be copied. */
+class IovecList {
+ public:
+  IovecList() {}
+  ~IovecList() {
+    if (items_ != inline_items_) {
+      free(items_);
+    }
+  }
+  IovecList(const IovecList&) = delete;
+  IovecList& operator=(const IovecList&) = delete;
+
+  inline size_t size() const { return end_ - start_; }
+  inline bool empty() const { return start_ == end_; }
+  inline iovec* data() { return items_ + start_; }
+  inline iovec* begin() { return items_ + start_; }
+  inline iovec* end() { return items_ + end_; }
+  inline const iovec* begin() const { return items_ + start_; }
+  inline const iovec* end() const { return items_ + end_; }
+  inline iovec& front() { return items_[start_]; }
+  inline iovec& back() { return items_[end_ - 1]; }
+  inline iovec& operator[](size_t index) { return items_[start_ + index]; }
+  inline void pop_front() { start_++; }
+  inline void pop_back() { end_--; }
+  inline void clear() { start_ = end_ = 0; }
+
+  inline void push_back(const iovec& item) {
+    if (end_ == capacity_) {
+      Grow();
+    }
+    items_[end_++] = item;
+  }
+
+ private:
+  void Grow() {
+    size_t capacity = capacity_ * 2;
+    auto items = (iovec*)malloc(sizeof(iovec) * capacity);
+    memcpy(items, items_ + start_, sizeof(iovec) * size());
+    if (items_ != inline_items_) {
+      free(items_);
+    }
+    end_ -= start_;
+    start_ = 0;
+    items_ = items;
+    capacity_ = capacity;
+  }
+
+  iovec*  items_ = inline_items_;
+  size_t  start_ = 0;
+  size_t  end_ = 0;
+  size_t  capacity_ = IOVEC_LIST_INLINE_SIZE;
+  iovec   inline_items_[IOVEC_LIST_INLINE_SIZE];
+};
+
+#endif // _MVISOR_IOVEC_LIST_H
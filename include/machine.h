@@ -37,13 +37,14 @@
 #include "device_manager.h"
 #include "vfio_manager.h"
 #include "configuration.h"
+#include "disk_image.h"
 
 
 /* The Machine class handles all the VM initialization and common operations
  * such as startup, quit, pause, resume */
 class Machine {
  public:
-  Machine(std::string config_path, std::string vm_name, std::string vm_uuid);
+  Machine(std::string config_path, std::string vm_name, std::string vm_uuid, bool clone = false);
   ~Machine();
 
   void Quit();
@@ -61,6 +62,9 @@ class Machine {
   bool Save(const std::string ip, const uint16_t port);
   bool PostSave();
   void Load(uint16_t port);
+  MigrationProgress GetMigrationProgress();
+  bool ExportDiskImage(std::string device_name, std::string path);
+  std::map<std::string, DiskImageStatistics> GetDiskImageStatistics();
 
   Object* LookupObjectByName(std::string name);
   Object* LookupObjectByClass(std::string class_name);
@@ -78,6 +82,7 @@ class Machine {
   inline uint64_t ram_size() { return ram_size_; }
   inline bool debug() { return debug_; }
   inline bool hypervisor() { return hypervisor_; }
+  inline bool clone() { return clone_; }
   inline const std::string& guest_os() const { return guest_os_; }
   inline const std::string& vm_name() const { return vm_name_; }
   inline const std::string& vm_uuid() const { return vm_uuid_; }
@@ -121,11 +126,16 @@ class Machine {
   VfioManager* vfio_manager_;
   Configuration* config_;
   IoThread* io_thread_;
+  /* Extra IoThreads shared by device queues, set by the iothreads key */
+  int num_queue_threads_ = 0;
+  std::vector<IoThread*> queue_threads_;
   MigrationNetworkWriter* network_writer_ = nullptr;
+  MigrationStatistics migration_statistics_;
 
   std::map<std::string, Object*> objects_;
   bool debug_ = false;
   bool hypervisor_ = false;
+  bool clone_ = false;
   std::string guest_os_;
   std::string vm_name_;
   std::string vm_uuid_;
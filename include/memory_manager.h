@@ -73,6 +73,7 @@ class MemoryManager {
   void SetDirtyMemoryRegion(uint64_t gpa, size_t size);
   void StartTrackingDirtyMemory();
   void StopTrackingDirtyMemory();
+  uint64_t CountDirtyPages();
 
   bool SaveDirtyMemory(MigrationNetworkWriter* writer, DirtyMemoryType type);
   bool LoadDirtyMemory(MigrationNetworkReader* reader, DirtyMemoryType type);
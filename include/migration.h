@@ -21,10 +21,13 @@
 
 #include <google/protobuf/message.h>
 
+#include <chrono>
 #include <list>
+#include <mutex>
 #include <string>
 #include <unordered_map>
 #include <queue>
+#include <vector>
 
 using google::protobuf::Message;
 
@@ -47,6 +50,82 @@ enum MigrationSignalType {
   kMigrateComplete
 };
 
+enum MigrationPhase {
+  kMigrationPhaseIdle,
+  kMigrationPhaseBackingImage,
+  kMigrationPhaseRam,
+  kMigrationPhaseReady,         /* pre-copy done, guest running until PostSave */
+  kMigrationPhaseImage,
+  kMigrationPhaseDirtyMemory,
+  kMigrationPhaseDevice,
+  kMigrationPhaseVcpu,
+  kMigrationPhaseComplete,
+  kMigrationPhaseFailed,
+  kMigrationPhaseCount
+};
+
+struct MigrationPhaseProgress {
+  uint64_t  bytes = 0;
+  uint64_t  pages = 0;
+  double    seconds = 0;
+};
+
+/* Pages dirtied by the guest since tracking started, sampled at the end of each
+ * pre-copy round and when PostSave pauses the guest */
+struct MigrationDirtyRound {
+  MigrationPhase  phase;
+  double          time;           /* seconds since migration started */
+  uint64_t        dirty_pages;
+  double          dirty_rate;     /* pages per second since the last round */
+};
+
+struct MigrationProgress {
+  MigrationPhase  phase = kMigrationPhaseIdle;
+  double          elapsed = 0;            /* seconds since migration started */
+  uint64_t        total_bytes = 0;
+  double          bandwidth = 0;          /* bytes per second while transferring */
+  double          pages_per_second = 0;   /* pages sent per second in the current phase */
+  uint64_t        dirty_pages = 0;
+  double          dirty_rate = 0;         /* pages per second */
+  uint64_t        remaining_bytes = 0;
+  double          remaining_time = 0;     /* seconds */
+  double          downtime = 0;           /* seconds, predicted before PostSave, measured after */
+  MigrationPhaseProgress            phases[kMigrationPhaseCount];
+  std::vector<MigrationDirtyRound>  dirty_rounds;
+};
+
+/* Counters updated by the migration thread, progress() is safe to call from
+ * other threads while migration is running */
+class MigrationStatistics {
+ public:
+  void Start(uint64_t ram_pages);
+  void BeginPhase(MigrationPhase phase);
+  void AddBytes(size_t bytes);
+  void AddPages(size_t pages);
+  void UpdateDirtyPages(uint64_t dirty_pages, bool end_of_round);
+  void Finish(bool success);
+  void PrintReport();
+  MigrationProgress progress();
+
+  static const char* phase_name(MigrationPhase phase);
+
+ private:
+  typedef std::chrono::steady_clock::time_point TimePoint;
+
+  double SecondsSince(TimePoint time_point);
+  void UpdatePhaseTime();
+  void Estimate(MigrationProgress& progress);
+
+  std::mutex        mutex_;
+  MigrationProgress progress_;
+  uint64_t          ram_pages_ = 0;
+  TimePoint         start_time_;
+  TimePoint         phase_start_time_;
+  TimePoint         downtime_start_time_;
+  TimePoint         dirty_sample_time_;
+  uint64_t          dirty_sample_pages_ = 0;
+};
+
 struct MigrationNetworkDataHeader {
   char tag[24];
   size_t size;
@@ -109,8 +188,12 @@ class MigrationNetworkWriter : public MigrationWriter {
   bool WaitForSignal(MigrationSignalType type);
   bool WriteFromFile(std::string tag, std::string path, size_t offset);
 
+  inline MigrationStatistics* statistics() { return statistics_; }
+  inline void set_statistics(MigrationStatistics* statistics) { statistics_ = statistics; }
+
  private:
-  int         socket_fd_ = -1;
+  int                   socket_fd_ = -1;
+  MigrationStatistics*  statistics_ = nullptr;
 
   bool Write(void* data, size_t size);
 };
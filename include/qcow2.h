@@ -19,8 +19,12 @@
 #ifndef _MVISOR_IMAGES_QCOW2_H
 #define _MVISOR_IMAGES_QCOW2_H
 
+#include <set>
+#include <atomic>
+
 #include "disk_image.h"
-#include "lru_cache.h"
+#include "qcow2_cache.h"
+#include "qcow2_shared_cache.h"
 
 
 #define QCOW2_OFLAG_COPIED            (1UL << 63)
@@ -31,6 +35,14 @@
 #define QCOW2_COMPRESSED_SECTOR_SIZE  512
 #define QCOW2_COMPRESSED_SECTOR_MASK  (~(QCOW2_COMPRESSED_SECTOR_SIZE - 1LL))
 #define QCOW2_MIGRATE_DATA_OFFSET     0x10000
+#define QCOW2_INCOMPAT_DIRTY          (1UL << 0)
+#define QCOW2_INCOMPAT_COMPRESSION    (1UL << 3)
+#define QCOW2_INCOMPAT_EXTL2          (1UL << 4)
+#define QCOW2_COMPAT_LAZY_REFCOUNTS   (1UL << 0)
+/* With extended L2 entries, a cluster has 32 subclusters. The second 64 bits of an entry
+ * is a bitmap, bit x means subcluster x is allocated and bit 32 + x means it reads zeros */
+#define QCOW2_SUBCLUSTERS             32
+#define QCOW2_SUBCLUSTER_ALLOC_ALL    ((1ULL << QCOW2_SUBCLUSTERS) - 1)
 
 static inline void be32_to_cpus(uint32_t* x) {
   *x = be32toh(*x);
@@ -73,6 +85,18 @@ struct Qcow2Header {
   uint8_t  compression_type;
 } __attribute__ ((packed));
 
+enum Qcow2Preallocation {
+  kPreallocationOff,
+  kPreallocationMetadata,
+  kPreallocationFalloc
+};
+
+enum Qcow2SubclusterState {
+  kSubclusterUnallocated,
+  kSubclusterZero,
+  kSubclusterAllocated
+};
+
 struct L2Table {
   uint64_t    offset_in_file;
   bool        dirty;
@@ -85,6 +109,12 @@ struct RefcountBlock {
   uint16_t    entries[];
 };
 
+struct DecompressedCluster {
+  uint64_t    offset_in_file;
+  bool        dirty;
+  uint8_t     data[];
+};
+
 
 /* Reference: https://git.qemu.org/?p=qemu.git;a=blob;f=docs/interop/qcow2.txt
  * All numbers in Qcow2 are stored in Big Endian byte order
@@ -126,21 +156,74 @@ class Qcow2Image : public DiskImage {
   size_t cluster_bits_;
 
   size_t l2_entries_;
+  /* With extended L2, an entry is 2 words and subclusters are 1/32 of a cluster */
+  bool   extended_l2_ = false;
+  size_t subcluster_bits_;
   size_t rfb_entries_;
   size_t refcount_bits_;
 
   uint64_t    free_cluster_index_ = 0;
+  /* Bit set if a cluster is in use or reserved, built from refcount blocks at open time.
+   * Clusters beyond the end of the bitmap are free. */
+  std::vector<uint64_t> cluster_bitmap_;
+  /* Contiguous clusters reserved for sequential guest clusters, refcounts are only
+   * updated when used, so unused clusters are free again after reopening */
+  uint64_t    extent_next_ = 0;
+  uint64_t    extent_end_ = 0;
+  uint64_t    extent_guest_cluster_ = 0;
   uint8_t*    copied_cluster_ = nullptr;
-  std::string compressed_;
+  /* Next free byte for compressed data written by export */
+  uint64_t    compressed_cursor_ = 0;
 
   std::vector<uint64_t> l1_table_;
   std::vector<uint64_t> refcount_table_;
   bool l1_table_dirty_ = false;
   bool refcount_table_dirty_ = false;
 
-  SimpleLRUCache<uint64_t, L2Table*>        l2_cache_;
-  SimpleLRUCache<uint64_t, RefcountBlock*>  rfb_cache_;
-  SimpleLRUCache<uint64_t, uint8_t*>        cluster_cache_;
+  /* With lazy refcounts, refcount blocks are written when evicted or closing. The dirty bit
+   * is set before the first L2 write and refcounts are rebuilt if it is found on open. */
+  bool lazy_refcounts_ = false;
+  bool dirty_ = false;
+  /* Without lazy refcounts, refcounts of new clusters are written before L2 tables using
+   * them, and L2 tables releasing clusters are written before the refcounts */
+  bool l2_depends_on_refcounts_ = false;
+  bool refcounts_depend_on_l2_ = false;
+
+  Qcow2Cache<L2Table>                       l2_cache_;
+  Qcow2Cache<RefcountBlock>                 rfb_cache_;
+  Qcow2Cache<DecompressedCluster>           cluster_cache_;
+  /* Cache limits in bytes, set by l2_cache_size, refcount_cache_size and cluster_cache_size */
+  size_t                                    l2_cache_size_ = 0;
+  size_t                                    rfb_cache_size_ = 0;
+  size_t                                    cluster_cache_size_ = 0;
+  /* Clusters of readonly images shared between processes, set by shared_cache_size */
+  size_t                                    shared_cache_size_ = 0;
+  Qcow2SharedCache*                         shared_cache_ = nullptr;
+  /* Clusters read from the backing file are copied to this image, set by copy_on_read */
+  bool                                      copy_on_read_ = false;
+  /* Counters reported by GetFormatStatistics() */
+  std::atomic<uint64_t>                     cow_copies_ = 0;
+  std::atomic<uint64_t>                     copy_on_read_clusters_ = 0;
+  std::atomic<uint64_t>                     backing_reads_ = 0;
+  std::atomic<uint64_t>                     backing_bytes_ = 0;
+  /* Protects L1/L2/refcount tables and caches when running multiple workers */
+  std::mutex                                metadata_mutex_;
+  /* Guest clusters written without the metadata lock before their L2 entries are set,
+   * other writes to them wait */
+  std::set<uint64_t>                        allocating_clusters_;
+  std::condition_variable                   allocating_cv_;
+
+  /* Compressed clusters after a sequential read are decompressed by prefetch threads,
+   * set by prefetch_threads and prefetch_clusters, 0 threads disables prefetching */
+  size_t                                    prefetch_workers_ = 2;
+  size_t                                    prefetch_clusters_ = 8;
+  int64_t                                   last_compressed_cluster_ = -1;
+  std::vector<std::thread>                  prefetch_threads_;
+  std::mutex                                prefetch_mutex_;
+  std::condition_variable                   prefetch_cv_;
+  std::deque<std::pair<uint64_t, uint64_t>> prefetch_queue_;
+  std::set<uint64_t>                        prefetch_pending_;
+  bool                                      prefetch_stopped_ = false;
 
   Qcow2Header image_header_;
   std::string backing_filepath_;
@@ -149,6 +232,9 @@ class Qcow2Image : public DiskImage {
 
  private:
   void InitializeQcow2Header();
+  void OpenBackingFile();
+  bool HasCluster(off_t pos, size_t* skip);
+  bool RewriteBackingPath(const std::string& path);
   ssize_t WriteFile(void* buffer, size_t length, off_t offset);
   ssize_t ReadFile(void* buffer, size_t length, off_t offset);
   void InitializeL1Table();
@@ -156,19 +242,52 @@ class Qcow2Image : public DiskImage {
   void WriteL1Table();
   void WriteRefcountTable();
   void WriteL2Table(L2Table* l2_table);
+  void WriteHeaderFeatures();
+  void WriteBarrier();
+  void MarkDirty();
+  void MarkClean();
+  void RepairRefcounts();
   void WriteRefcountBlock(RefcountBlock* rfb);
-  void InitializeLruCache();
+  void InitializeCache();
   RefcountBlock* NewRefcountBlock(uint64_t block_offset);
   RefcountBlock* GetRefcountBlock(uint64_t cluster_index, uint64_t* rfb_index, bool allocate);
+  void InitializeClusterBitmap();
+  bool IsClusterUsed(uint64_t cluster_index);
+  void MarkClusters(uint64_t cluster_index, size_t count, bool used);
+  uint64_t ReserveClusters(size_t max_count, size_t* count);
+  void ReleaseExtent();
+  bool CommitCluster(uint64_t cluster_index);
   void FreeCluster(uint64_t start);
   uint64_t AllocateCluster();
+  uint64_t AllocateDataCluster(off_t pos);
   L2Table* NewL2Table(uint64_t l2_offset);
   L2Table* ReadL2Table(uint64_t l2_offset);
   L2Table* GetL2Table(bool is_write, off_t pos, uint64_t* offset_in_cluster, uint64_t* l2_index, size_t* length);
-  ssize_t ReadCluster(void* buffer, off_t pos, size_t length, bool no_zero = false);
+  void GetCompressedRange(uint64_t cluster_descriptor, uint64_t* host_offset, uint64_t* length);
+  ssize_t DecompressCluster(uint64_t cluster_descriptor, uint8_t* output);
+  bool CompressedClusterChanged(off_t pos, uint64_t l2_entry);
+  void CacheDecompressedCluster(off_t pos, uint64_t l2_entry, uint8_t* data);
+  void PrefetchClusters(uint64_t cluster_index);
+  void PrefetchProcess();
+  bool WaitForPrefetch(uint64_t host_offset);
+  void StopPrefetch();
+  Qcow2SubclusterState GetSubclusterState(L2Table* l2_table, uint64_t l2_index, uint64_t offset_in_cluster,
+    size_t* length);
+  ssize_t ReadBackingFile(void* buffer, off_t pos, size_t length);
+  ssize_t CopyOnRead(void* buffer, off_t pos, size_t length);
+  ssize_t ReadCluster(void* buffer, off_t pos, size_t length);
   ssize_t WriteCluster(void* buffer, off_t pos, size_t length);
+  void PublishCluster(off_t pos, uint64_t host_offset, uint64_t mask);
+  ssize_t WriteSubclusters(std::unique_lock<std::mutex>& lock, L2Table* l2_table, uint64_t l2_index,
+    void* buffer, off_t pos, uint64_t offset_in_cluster, size_t length);
   ssize_t DiscardCluster(off_t pos, size_t length);
+  ssize_t RewriteCompressedCluster(L2Table* l2_table, uint64_t l2_index, void* buffer,
+    off_t pos, uint64_t offset_in_cluster, size_t length);
+  void FreeCompressedCluster(uint64_t cluster_descriptor);
+  void IncreaseRefcount(uint64_t host_offset);
+  ssize_t WriteCompressedCluster(off_t pos, const void* data, size_t length);
   ssize_t BlockIo(void *buffer, off_t position, size_t length, ImageIoType type);
+  uint64_t GetAsyncHostOffset(bool is_write, off_t pos, size_t* length);
   ssize_t FlushAll();
   void FlushL2Tables ();
   void FlushRefcountBlocks();
@@ -179,6 +298,9 @@ class Qcow2Image : public DiskImage {
   virtual ~Qcow2Image();
   virtual void Initialize();
   virtual long HandleIoRequest(const ImageIoRequest& request);
+  virtual bool PrepareAsyncIo(const ImageIoRequest& request, ImageAsyncIo& async_io);
+  virtual void GetFormatStatistics(DiskImageStatistics* statistics);
+  virtual bool SupportsDiscard() { return true; }
 
   virtual ImageInformation information() {
     return ImageInformation {
@@ -189,9 +311,15 @@ class Qcow2Image : public DiskImage {
   
   void Reset();
   bool CreateSnapshot();
+  void GetCacheStatistics(Qcow2CacheStatistics* l2, Qcow2CacheStatistics* refcount, Qcow2CacheStatistics* cluster);
+  bool CommitBackingFile(uint64_t rate, const std::atomic<bool>& stopped);
+  size_t backing_chain_depth();
   
-  static void CreateEmptyImage(std::string path, size_t disk_size);
-  static void CreateImageWithBackingFile(std::string path, std::string backing_path);
+  static void CreateEmptyImage(std::string path, size_t disk_size,
+    Qcow2CompressionType compression_type = kCompressionTypeZlib, bool extended_l2 = false,
+    Qcow2Preallocation preallocation = kPreallocationOff);
+  static bool ExportCompressedImage(DiskImage* source, std::string path, size_t threads);
+  static void CreateImageWithBackingFile(std::string path, std::string backing_path, bool extended_l2 = false);
 };
 
 #endif // _MVISOR_IMAGES_QCOW2_H
@@ -0,0 +1,262 @@
+/* 
+ * MVisor
+ * Copyright (C) 2021 Terrence <terrence@tenclass.com>
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+/*
+ * Fixed size metadata cache for qcow2 L2 tables, refcount blocks and
+ * decompressed clusters, keyed by the offset in the image file.
+ *
+ * Entries live in slabs allocated on demand up to the byte limit. Lookup uses
+ * an open addressing hash with linear probing, eviction uses CLOCK. T must
+ * begin with uint64_t offset_in_file and bool dirty, followed by the payload.
+ * Pointers returned stay valid until another entry is inserted or removed,
+ * callers hold the image metadata lock.
+ */
+
+#ifndef _MVISOR_QCOW2_CACHE_H
+#define _MVISOR_QCOW2_CACHE_H
+
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+#include <algorithm>
+#include <functional>
+
+#include "logger.h"
+
+#define QCOW2_CACHE_MIN_ENTRIES   4
+#define QCOW2_CACHE_SLAB_SIZE     (1UL << 20)
+
+struct Qcow2CacheStatistics {
+  uint64_t hits = 0;
+  uint64_t misses = 0;
+  uint64_t evictions = 0;
+  uint64_t writebacks = 0;
+};
+
+template<typename T>
+class Qcow2Cache {
+ private:
+  size_t                    entry_size_ = 0;
+  size_t                    capacity_ = 0;
+  size_t                    slab_entries_ = 0;
+  size_t                    used_ = 0;
+  std::vector<uint8_t*>     slabs_;
+  /* Slot index in each hash bucket, -1 if empty */
+  std::vector<int32_t>      buckets_;
+  size_t                    hash_bits_ = 0;
+  std::vector<uint8_t>      valid_;
+  std::vector<uint8_t>      referenced_;
+  std::vector<int32_t>      free_slots_;
+  size_t                    clock_hand_ = 0;
+  int32_t                   last_slot_ = -1;
+  std::function<void(T*)>   writeback_;
+  Qcow2CacheStatistics      statistics_;
+
+  inline T* entry(int32_t slot) {
+    return (T*)(slabs_[slot / slab_entries_] + (slot % slab_entries_) * entry_size_);
+  }
+
+  inline size_t Hash(uint64_t key) {
+    return (key * 0x9E3779B97F4A7C15ULL) >> (64 - hash_bits_);
+  }
+
+  /* Return the bucket holding the key, or the empty bucket where it should go */
+  size_t FindBucket(uint64_t key) {
+    size_t mask = buckets_.size() - 1;
+    size_t index = Hash(key);
+    while (buckets_[index] != -1 && entry(buckets_[index])->offset_in_file != key) {
+      index = (index + 1) & mask;
+    }
+    return index;
+  }
+
+  /* Backward shift deletion keeps probe sequences intact without tombstones */
+  void RemoveBucket(size_t index) {
+    size_t mask = buckets_.size() - 1;
+    buckets_[index] = -1;
+    size_t next = index;
+    while (true) {
+      next = (next + 1) & mask;
+      if (buckets_[next] == -1) {
+        break;
+      }
+      size_t home = Hash(entry(buckets_[next])->offset_in_file);
+      bool movable = next > index ? (home <= index || home > next) : (home <= index && home > next);
+      if (movable) {
+        buckets_[index] = buckets_[next];
+        buckets_[next] = -1;
+        index = next;
+      }
+    }
+  }
+
+  void WriteBack(T* item) {
+    if (item->dirty) {
+      writeback_(item);
+      item->dirty = false;
+      statistics_.writebacks++;
+    }
+  }
+
+  /* CLOCK gives referenced entries a second chance, the latest entry is never evicted */
+  int32_t Evict() {
+    while (true) {
+      int32_t slot = clock_hand_;
+      clock_hand_ = (clock_hand_ + 1) % used_;
+      if (!valid_[slot] || slot == last_slot_) {
+        continue;
+      }
+      if (referenced_[slot]) {
+        referenced_[slot] = 0;
+        continue;
+      }
+
+      auto item = entry(slot);
+      WriteBack(item);
+      RemoveBucket(FindBucket(item->offset_in_file));
+      valid_[slot] = 0;
+      statistics_.evictions++;
+      return slot;
+    }
+  }
+
+  int32_t AllocateSlot() {
+    if (!free_slots_.empty()) {
+      auto slot = free_slots_.back();
+      free_slots_.pop_back();
+      return slot;
+    }
+    if (used_ < capacity_) {
+      if (used_ % slab_entries_ == 0 && used_ / slab_entries_ >= slabs_.size()) {
+        auto slab = (uint8_t*)aligned_alloc(64, slab_entries_ * entry_size_);
+        MV_ASSERT(slab);
+        slabs_.push_back(slab);
+      }
+      return used_++;
+    }
+    return Evict();
+  }
+
+  void FreeSlabs() {
+    for (auto slab : slabs_) {
+      free(slab);
+    }
+    slabs_.clear();
+  }
+
+ public:
+  ~Qcow2Cache() {
+    FreeSlabs();
+  }
+
+  /* The cache holds max_bytes / payload_size entries of payload_size bytes */
+  void Initialize(size_t max_bytes, size_t payload_size, std::function<void(T*)> writeback) {
+    FreeSlabs();
+    entry_size_ = (sizeof(T) + payload_size + 63) & ~63UL;
+    capacity_ = std::max((size_t)QCOW2_CACHE_MIN_ENTRIES, max_bytes / payload_size);
+    slab_entries_ = std::max(1UL, std::min(capacity_, QCOW2_CACHE_SLAB_SIZE / entry_size_));
+    hash_bits_ = 1;
+    while ((1UL << hash_bits_) < capacity_ * 2) {
+      hash_bits_++;
+    }
+    buckets_.assign(1UL << hash_bits_, -1);
+    valid_.assign(capacity_, 0);
+    referenced_.assign(capacity_, 0);
+    free_slots_.clear();
+    used_ = clock_hand_ = 0;
+    last_slot_ = -1;
+    writeback_ = writeback;
+    statistics_ = Qcow2CacheStatistics();
+  }
+
+  T* Lookup(uint64_t key) {
+    auto index = FindBucket(key);
+    if (buckets_[index] == -1) {
+      statistics_.misses++;
+      return nullptr;
+    }
+    statistics_.hits++;
+    last_slot_ = buckets_[index];
+    referenced_[last_slot_] = 1;
+    return entry(last_slot_);
+  }
+
+  /* Test without touching the statistics or the reference bit */
+  bool Contains(uint64_t key) {
+    return buckets_[FindBucket(key)] != -1;
+  }
+
+  /* Return a zeroed entry for a key not in the cache, may evict another entry */
+  T* Insert(uint64_t key) {
+    auto slot = AllocateSlot();
+    auto item = entry(slot);
+    bzero(item, entry_size_);
+    item->offset_in_file = key;
+    item->dirty = false;
+
+    auto index = FindBucket(key);
+    MV_ASSERT(buckets_[index] == -1);
+    buckets_[index] = slot;
+    valid_[slot] = 1;
+    referenced_[slot] = 1;
+    last_slot_ = slot;
+    return item;
+  }
+
+  /* Drop an entry without writing it back */
+  void Remove(uint64_t key) {
+    auto index = FindBucket(key);
+    if (buckets_[index] == -1) {
+      return;
+    }
+    auto slot = buckets_[index];
+    RemoveBucket(index);
+    valid_[slot] = 0;
+    free_slots_.push_back(slot);
+    if (last_slot_ == slot) {
+      last_slot_ = -1;
+    }
+  }
+
+  /* Write back all dirty entries */
+  void Flush() {
+    for (size_t slot = 0; slot < used_; slot++) {
+      if (valid_[slot]) {
+        WriteBack(entry(slot));
+      }
+    }
+  }
+
+  /* Write back dirty entries and drop all, slabs are kept for reuse */
+  void Clear() {
+    Flush();
+    std::fill(buckets_.begin(), buckets_.end(), -1);
+    std::fill(valid_.begin(), valid_.end(), 0);
+    free_slots_.clear();
+    used_ = clock_hand_ = 0;
+    last_slot_ = -1;
+  }
+
+  inline size_t size() const { return used_ - free_slots_.size(); }
+  inline size_t capacity() const { return capacity_; }
+  inline const Qcow2CacheStatistics& statistics() const { return statistics_; }
+};
+
+#endif // _MVISOR_QCOW2_CACHE_H
@@ -0,0 +1,83 @@
+/* 
+ * MVisor
+ * Copyright (C) 2021 Terrence <terrence@tenclass.com>
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+/*
+ * Host-wide read cache of clusters of a readonly base image, shared by all
+ * MVisor processes using the same image file. The cache lives in a POSIX
+ * shared memory object named after the device, inode, mtime and size of the
+ * image, so VMs booting from snapshot overlays of one base image keep a
+ * single in-memory copy of its hot clusters. It is removed when the last
+ * process using it detaches.
+ *
+ * The cache is direct mapped by guest cluster index. Each slot is guarded by
+ * a sequence counter: writers make it odd while copying, readers retry as a
+ * miss if the counter changed, so no lock is shared between processes. A slot
+ * left odd by a writer that died is taken over by the next writer.
+ */
+
+#ifndef _MVISOR_QCOW2_SHARED_CACHE_H
+#define _MVISOR_QCOW2_SHARED_CACHE_H
+
+#include <cstdint>
+#include <string>
+#include <atomic>
+#include <sys/types.h>
+
+struct Qcow2SharedCacheHeader {
+  uint64_t  magic;
+  uint64_t  cluster_size;
+  uint64_t  slots;
+};
+
+struct Qcow2SharedCacheSlot {
+  /* Counter in the low half, pid of the writer in the high half while odd */
+  std::atomic<uint64_t>  sequence;
+  /* Guest cluster index plus one, 0 if empty */
+  std::atomic<uint64_t>  key;
+};
+
+class Qcow2SharedCache {
+ private:
+  std::string             name_;
+  int                     shm_fd_ = -1;
+  pid_t                   pid_ = 0;
+  size_t                  cluster_size_ = 0;
+  size_t                  slots_ = 0;
+  size_t                  mapped_size_ = 0;
+  void*                   mapped_ = nullptr;
+  Qcow2SharedCacheSlot*   slot_table_ = nullptr;
+  uint8_t*                data_ = nullptr;
+  std::atomic<uint64_t>   hits_ = 0;
+  std::atomic<uint64_t>   misses_ = 0;
+
+  int Attach(const char* name);
+
+ public:
+  Qcow2SharedCache() {}
+  ~Qcow2SharedCache();
+
+  bool Initialize(int fd, size_t cluster_size, size_t cache_size);
+  bool Read(uint64_t cluster_index, uint64_t offset_in_cluster, void* buffer, size_t length);
+  void Insert(uint64_t cluster_index, const void* data);
+
+  uint64_t hits() { return hits_; }
+  uint64_t misses() { return misses_; }
+};
+
+#endif // _MVISOR_QCOW2_SHARED_CACHE_H
@@ -73,5 +73,9 @@ bool test_zero(const void* buffer, size_t length);
  * https://github.com/facebook/zstd
  */
 ssize_t zstd_decompress(const void* src,  size_t src_size, void* dest, size_t dest_size);
+ssize_t zstd_compress(const void* src, size_t src_size, void* dest, size_t dest_size, int level);
+
+/* Raw deflate decompress for qcow2 zlib clusters */
+ssize_t zlib_decompress(const void* src, size_t src_size, void* dest, size_t dest_size);
 
 #endif // _MVISOR_UTILITY_H
@@ -22,12 +22,16 @@
 #include <getopt.h>
 #include <signal.h>
 #include <thread>
+#include <random>
+#include <chrono>
 
 #include <filesystem>
 
 #include "version.h"
 #include "machine.h"
 #include "utilities.h"
+#include "device.h"
+#include "qcow2.h"
 #include "gui/vnc/server.h"
 
 static Machine*     machine = nullptr;
@@ -85,12 +89,18 @@ static void PrintHelp() {
   printf("Usage: mvisor [option]\n");
   printf("Options\n");
   printf("  -c, --config          Specified mvisor config file path.\n");
+  printf("  -C, --clone           Start a clone of mvisor snapshot, writable disks must be qcow2.\n");
+  printf("                        Clones get new SMBIOS serials and MAC addresses, set by the guest agent.\n");
+  printf("  -e, --export          Export a disk image chain as a zstd compressed qcow2 image.\n");
+  printf("                        Export is offline, the image must not be used by a running VM.\n");
   printf("  -h, --help            Display this information.\n");
   printf("  -l, --load            Load mvisor snapshot information.\n");
   printf("  -m, --migration       Start mvisor witn port from migration.\n");
   printf("  -n, --name            Specified mvisor name information.\n");
+  printf("  -o, --output          Output path of the exported image.\n");
   printf("  -p, --pidfile         Specified mvisor pid file path.\n");
   printf("  -s, --sweet           Specified mvisor socket file path.\n");
+  printf("  -t, --threads         Compression threads of export (default all CPUs).\n");
   printf("  -u, --uuid            Specified mvisor uuid information.\n");
   printf("  -v, --version         Display mvisor version information.\n");
   printf("  -vnc [port]           Start a VNC server at specified port.\n");
@@ -107,12 +117,16 @@ static void PrintVersion() {
 
 static struct option long_options[] = {
   {"config", required_argument, 0, 'c'},
+  {"clone", required_argument, 0, 'C'},
+  {"export", required_argument, 0, 'e'},
   {"help", no_argument, 0, 'h'},
   {"load", required_argument, 0, 'l'},
   {"migration", required_argument, 0, 'm'},
   {"name", required_argument, 0, 'n'},
+  {"output", required_argument, 0, 'o'},
   {"pidfile", required_argument, 0, 'p'},
   {"sweet", required_argument, 0, 's'},
+  {"threads", required_argument, 0, 't'},
   {"uuid", required_argument, 0, 'u'},
   {"version", no_argument, 0, 'V'},
   {"vnc", required_argument, 0, 'v'},
@@ -120,7 +134,26 @@ static struct option long_options[] = {
   {NULL, 0, 0, 0}
 };
 
+/* Export an image offline without starting a machine */
+static int ExportImage(std::string image_path, std::string output_path, size_t threads) {
+  if (output_path.empty()) {
+    MV_ERROR("-output is required to export %s", image_path.c_str());
+    return 1;
+  }
+
+  Device device;
+  device.set_name("export");
+  auto image = DiskImage::Create(&device, &device, image_path, true, false);
+  bool ret = Qcow2Image::ExportCompressedImage(image, output_path, threads);
+  delete image;
+  return ret ? 0 : 1;
+}
+
 int main(int argc, char* argv[]) {
+  auto start_time = std::chrono::steady_clock::now();
+  /* Clones started at the same time must not generate the same uuid, which is
+   * also the SMBIOS serial, or the same MAC addresses */
+  srand(std::random_device()());
   IntializeArguments(argc, argv);
   SetThreadName("mvisor");
 
@@ -129,12 +162,15 @@ int main(int argc, char* argv[]) {
   std::string sweet_path;
   std::string pid_path;
   std::string load_path;
+  std::string clone_path;
   std::string migration_port;
+  std::string export_path, output_path;
+  size_t export_threads = std::thread::hardware_concurrency();
   uint16_t vnc_port = 0;
   std::string vnc_password;
 
   int c, option_index = 0;
-  while ((c = getopt_long_only(argc, argv, "hVc:u:n:s:p:l:", long_options, &option_index)) != -1) {
+  while ((c = getopt_long_only(argc, argv, "hVc:C:e:o:t:u:n:s:p:l:", long_options, &option_index)) != -1) {
     switch (c)
     {
     case 'h':
@@ -158,9 +194,21 @@ int main(int argc, char* argv[]) {
     case 'l':
       load_path = optarg;
       break;
+    case 'C':
+      clone_path = optarg;
+      break;
     case 'm':
       migration_port = optarg;
       break;
+    case 'e':
+      export_path = optarg;
+      break;
+    case 'o':
+      output_path = optarg;
+      break;
+    case 't':
+      export_threads = atol(optarg);
+      break;
     case 'v':
       vnc_port = atoi(optarg);
       break;
@@ -176,6 +224,10 @@ int main(int argc, char* argv[]) {
     }
   }
 
+  if (!export_path.empty()) {
+    return ExportImage(export_path, output_path, export_threads);
+  }
+
   /* write pid to file if path specified */
   if (!pid_path.empty()) {
     FILE* fp = fopen(pid_path.c_str(), "wb");
@@ -183,7 +235,13 @@ int main(int argc, char* argv[]) {
     fclose(fp);
   }
 
-  machine = new Machine(config_path, vm_name.empty() ? vm_uuid : vm_name, vm_uuid);
+  /* A clone loads the template like -l does, but never writes to the template images */
+  if (!clone_path.empty()) {
+    config_path = clone_path + "/configuration.yaml";
+    load_path = clone_path;
+  }
+
+  machine = new Machine(config_path, vm_name.empty() ? vm_uuid : vm_name, vm_uuid, !clone_path.empty());
 
   /* Register CTRL+C signal handler */
   auto quit_callback = [](int signum) {
@@ -237,6 +295,11 @@ int main(int argc, char* argv[]) {
     }
 
     machine->Resume();
+    if (!clone_path.empty()) {
+      auto delta_us = std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::steady_clock::now() - start_time).count();
+      MV_LOG("clone %s is running in %.3lfms", vm_uuid.c_str(), double(delta_us) / 1000);
+    }
   }
 
   if (vnc_port) {
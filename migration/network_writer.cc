@@ -86,6 +86,9 @@ bool MigrationNetworkWriter::Write(void* data, size_t size) {
     }
     pos += ret;
     remain_size -= ret;
+    if (statistics_) {
+      statistics_->AddBytes(ret);
+    }
   }
   return true;
 }
@@ -131,6 +134,9 @@ bool MigrationNetworkWriter::WriteMemoryPages(std::string tag, void* pages, size
     if (!ret) {
       break;
     }
+    if (statistics_) {
+      statistics_->AddPages(1);
+    }
     pos += PAGE_SIZE;
     remain_size -= PAGE_SIZE;
   }
@@ -0,0 +1,173 @@
+/* 
+ * MVisor
+ * Copyright (C) 2022 Terrence <terrence@tenclass.com>
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <algorithm>
+
+#include "logger.h"
+#include "machine.h"
+#include "migration.h"
+
+
+const char* MigrationStatistics::phase_name(MigrationPhase phase) {
+  static const char* names[kMigrationPhaseCount] = {
+    "idle", "backing-image", "ram", "ready", "image", "dirty-memory",
+    "device", "vcpu", "complete", "failed"
+  };
+  MV_ASSERT(phase < kMigrationPhaseCount);
+  return names[phase];
+}
+
+double MigrationStatistics::SecondsSince(TimePoint time_point) {
+  return std::chrono::duration<double>(std::chrono::steady_clock::now() - time_point).count();
+}
+
+/* Called with mutex_ held */
+void MigrationStatistics::UpdatePhaseTime() {
+  auto now = std::chrono::steady_clock::now();
+  progress_.phases[progress_.phase].seconds += std::chrono::duration<double>(now - phase_start_time_).count();
+  progress_.elapsed = std::chrono::duration<double>(now - start_time_).count();
+  phase_start_time_ = now;
+}
+
+void MigrationStatistics::Start(uint64_t ram_pages) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  progress_ = MigrationProgress();
+  ram_pages_ = ram_pages;
+  start_time_ = phase_start_time_ = dirty_sample_time_ = std::chrono::steady_clock::now();
+  dirty_sample_pages_ = 0;
+}
+
+void MigrationStatistics::BeginPhase(MigrationPhase phase) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  UpdatePhaseTime();
+  progress_.phase = phase;
+  /* PostSave starts with the guest paused */
+  if (phase == kMigrationPhaseImage) {
+    downtime_start_time_ = phase_start_time_;
+  }
+}
+
+void MigrationStatistics::AddBytes(size_t bytes) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  progress_.total_bytes += bytes;
+  progress_.phases[progress_.phase].bytes += bytes;
+}
+
+void MigrationStatistics::AddPages(size_t pages) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  progress_.phases[progress_.phase].pages += pages;
+}
+
+/* Dirty pages are counted since tracking started, the rate is measured from the last round */
+void MigrationStatistics::UpdateDirtyPages(uint64_t dirty_pages, bool end_of_round) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  auto seconds = SecondsSince(dirty_sample_time_);
+  if (seconds > 0) {
+    auto new_pages = dirty_pages >= dirty_sample_pages_ ? dirty_pages - dirty_sample_pages_ : dirty_pages;
+    progress_.dirty_rate = new_pages / seconds;
+  }
+  progress_.dirty_pages = dirty_pages;
+
+  if (end_of_round) {
+    progress_.dirty_rounds.push_back(MigrationDirtyRound {
+      .phase = progress_.phase,
+      .time = SecondsSince(start_time_),
+      .dirty_pages = dirty_pages,
+      .dirty_rate = progress_.dirty_rate
+    });
+    dirty_sample_time_ = std::chrono::steady_clock::now();
+    dirty_sample_pages_ = dirty_pages;
+  }
+}
+
+/* Estimations only cover memory, disk images are sent as they are */
+void MigrationStatistics::Estimate(MigrationProgress& progress) {
+  uint64_t transfer_bytes = 0;
+  double transfer_seconds = 0;
+  for (int i = kMigrationPhaseBackingImage; i <= kMigrationPhaseVcpu; i++) {
+    if (i != kMigrationPhaseReady) {
+      transfer_bytes += progress.phases[i].bytes;
+      transfer_seconds += progress.phases[i].seconds;
+    }
+  }
+  progress.bandwidth = transfer_seconds > 0 ? transfer_bytes / transfer_seconds : 0;
+
+  auto& current = progress.phases[progress.phase];
+  progress.pages_per_second = current.seconds > 0 ? current.pages / current.seconds : 0;
+
+  uint64_t pending_pages = 0;
+  if (progress.phase <= kMigrationPhaseRam) {
+    pending_pages += ram_pages_ - std::min(ram_pages_, progress.phases[kMigrationPhaseRam].pages);
+  }
+  if (progress.phase <= kMigrationPhaseDirtyMemory) {
+    pending_pages += progress.dirty_pages - std::min(progress.dirty_pages,
+      progress.phases[kMigrationPhaseDirtyMemory].pages);
+  }
+  progress.remaining_bytes = pending_pages * PAGE_SIZE;
+  progress.remaining_time = progress.bandwidth > 0 ? progress.remaining_bytes / progress.bandwidth : 0;
+
+  if (progress.phase < kMigrationPhaseImage) {
+    /* The dirty set is sent while the guest is paused */
+    if (progress.bandwidth > 0) {
+      progress.downtime = progress.dirty_pages * PAGE_SIZE / progress.bandwidth;
+    }
+  } else if (progress.phase <= kMigrationPhaseVcpu) {
+    progress.downtime = SecondsSince(downtime_start_time_) + progress.remaining_time;
+  }
+}
+
+MigrationProgress MigrationStatistics::progress() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  UpdatePhaseTime();
+  MigrationProgress progress = progress_;
+  Estimate(progress);
+  return progress;
+}
+
+void MigrationStatistics::Finish(bool success) {
+  std::unique_lock<std::mutex> lock(mutex_);
+  UpdatePhaseTime();
+  if (progress_.phase >= kMigrationPhaseImage) {
+    progress_.downtime = SecondsSince(downtime_start_time_);
+  }
+  progress_.phase = success ? kMigrationPhaseComplete : kMigrationPhaseFailed;
+  lock.unlock();
+
+  PrintReport();
+}
+
+void MigrationStatistics::PrintReport() {
+  auto progress = this->progress();
+  MV_LOG("migration %s elapsed=%.3fs sent=%luMB bandwidth=%.1fMB/s downtime=%.3fs",
+    phase_name(progress.phase), progress.elapsed, progress.total_bytes >> 20,
+    progress.bandwidth / (1 << 20), progress.downtime);
+
+  for (int i = kMigrationPhaseBackingImage; i <= kMigrationPhaseVcpu; i++) {
+    auto& phase = progress.phases[i];
+    if (phase.bytes == 0 && phase.seconds == 0) {
+      continue;
+    }
+    MV_LOG("phase=%s sent=%luKB pages=%lu time=%.3fs pages/s=%.0f", phase_name((MigrationPhase)i),
+      phase.bytes >> 10, phase.pages, phase.seconds, phase.seconds > 0 ? phase.pages / phase.seconds : 0);
+  }
+
+  for (auto& round : progress.dirty_rounds) {
+    MV_LOG("dirty round after %s at %.3fs dirty_pages=%lu dirty_rate=%.0f pages/s",
+      phase_name(round.phase), round.time, round.dirty_pages, round.dirty_rate);
+  }
+}
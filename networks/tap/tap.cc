@@ -88,6 +88,11 @@ Tap::~Tap() {
   safe_close(&tap_fd_);
 }
 
+/* The tap device forwards frames of any address */
+void Tap::SetMacAddress(MacAddress& mac) {
+  MV_UNUSED(mac);
+}
+
 void Tap::SetMtu(int mtu) {
   mtu_ = mtu;
 }
@@ -122,7 +127,7 @@ void Tap::StartReading() {
 void Tap::StartWriting() {
 }
 
-void Tap::OnFrameFromGuest(std::deque<iovec>& vector) {
+void Tap::OnFrameFromGuest(IovecList& vector) {
   if(can_write()) {
     size_t buffer_size = 0;
     for (auto &v : vector) {
@@ -25,9 +25,10 @@ class Tap : public Object, public NetworkBackendInterface {
  public:
   virtual ~Tap();
   virtual void Initialize(NetworkDeviceInterface* device, MacAddress& mac) override;
+  virtual void SetMacAddress(MacAddress& mac) override;
   virtual void SetMtu(int mtu) override;
   virtual void Reset() override;
-  virtual void OnFrameFromGuest(std::deque<iovec>& vector) override;
+  virtual void OnFrameFromGuest(IovecList& vector) override;
   virtual void OnReceiveAvailable() override;
 };
 
@@ -135,6 +135,11 @@ void Uip::Initialize(NetworkDeviceInterface* device, MacAddress& mac) {
   }
 }
 
+/* Frames to the guest are sent to the address its driver uses */
+void Uip::SetMacAddress(MacAddress& mac) {
+  guest_mac_ = mac;
+}
+
 void Uip::SetMtu(int mtu) {
   mtu_ = mtu;
   MV_ASSERT(mtu_ <= 4096);
@@ -355,7 +360,7 @@ void Uip::OnReceiveAvailable() {
   }
 }
 
-void Uip::OnFrameFromGuest(std::deque<iovec>& vector) {
+void Uip::OnFrameFromGuest(IovecList& vector) {
   size_t buffer_size = 0;
   for (auto &v : vector) {
     buffer_size += v.iov_len;
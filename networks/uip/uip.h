@@ -88,10 +88,11 @@ class Uip : public Object, public NetworkBackendInterface {
   Uip();
   virtual ~Uip();
   virtual void Initialize(NetworkDeviceInterface* device, MacAddress& mac) override;
+  virtual void SetMacAddress(MacAddress& mac) override;
   virtual void SetMtu(int mtu) override;
   virtual void Reset() override;
   virtual void OnReceiveAvailable() override;
-  virtual void OnFrameFromGuest(std::deque<iovec>& vector) override;
+  virtual void OnFrameFromGuest(IovecList& vector) override;
   virtual Ipv4Packet* AllocatePacket(bool urgent);
   virtual bool OnPacketFromHost(Ipv4Packet* packet);
 
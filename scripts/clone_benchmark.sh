@@ -0,0 +1,43 @@
+#!/bin/sh
+# Measure time-to-running of clones started from a saved template
+# Usage: clone_benchmark.sh /tmp/save [counts...]
+# The template is created by Machine::Save, e.g. mvisor -c config.yaml, then save to /tmp/save
+
+TEMPLATE=$1
+shift
+COUNTS=${*:-"1 10 100"}
+MVISOR=${MVISOR:-../build/mvisor}
+LOG_DIR=$(mktemp -d /tmp/clone_benchmark_XXXXXX)
+
+if [ ! -f "$TEMPLATE/configuration.yaml" ]; then
+  echo "usage: $0 <template path> [counts...]"
+  exit 1
+fi
+
+for count in $COUNTS; do
+  start=$(date +%s%N)
+  i=0
+  while [ $i -lt $count ]; do
+    # Pass -uuid, otherwise mvisor restarts itself to add one and the clone
+    # can't measure from its first start
+    $MVISOR -clone "$TEMPLATE" -uuid "$(cat /proc/sys/kernel/random/uuid)" -vnc $((6000 + i)) \
+      > "$LOG_DIR/clone-$i.log" 2>&1 &
+    i=$((i + 1))
+  done
+
+  # Wait for all clones to report running
+  while [ "$(grep -l 'is running' "$LOG_DIR"/clone-*.log 2>/dev/null | wc -l)" -lt $count ]; do
+    sleep 0.01
+  done
+  end=$(date +%s%N)
+
+  # Each clone logs the time since main() started
+  slowest=$(grep -h 'is running in' "$LOG_DIR"/clone-*.log | sed 's/.*is running in \([0-9.]*\)ms.*/\1/' | sort -n | tail -1)
+  echo "clones=$count all_running=$(( (end - start) / 1000000 ))ms slowest_clone=${slowest}ms"
+
+  pkill -TERM -f "$MVISOR -clone $TEMPLATE"
+  wait
+  rm -f "$LOG_DIR"/clone-*.log
+done
+
+rmdir "$LOG_DIR"
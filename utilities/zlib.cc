@@ -0,0 +1,60 @@
+/* 
+ * MVisor
+ * Copyright (C) 2022 Terrence <terrence@tenclass.com>
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "utilities.h"
+
+#include <cerrno>
+#include <zlib.h>
+
+#include "logger.h"
+
+/* Inflate streams are reused by each thread and freed at thread exit.
+ * Qcow2 compressed clusters are raw deflate data with a 4KB window. */
+struct ZlibDecompressContext {
+  z_stream stream;
+
+  ZlibDecompressContext() {
+    stream = z_stream();
+    MV_ASSERT(inflateInit2(&stream, -12) == Z_OK);
+  }
+  ~ZlibDecompressContext() {
+    inflateEnd(&stream);
+  }
+};
+
+ssize_t zlib_decompress(const void* src, size_t src_size, void* dest, size_t dest_size) {
+  thread_local ZlibDecompressContext context;
+  z_stream* stream = &context.stream;
+  if (inflateReset(stream) != Z_OK) {
+    return -EIO;
+  }
+
+  stream->next_in = (Bytef*)src;
+  stream->avail_in = src_size;
+  stream->next_out = (Bytef*)dest;
+  stream->avail_out = dest_size;
+
+  /* The compressed data may have padding after the end of the stream */
+  int ret = inflate(stream, Z_FINISH);
+  if (ret != Z_STREAM_END && !(ret == Z_BUF_ERROR && stream->avail_out == 0)) {
+    MV_ERROR("zlib decompress error ret=%d in=%lu out=%lu", ret, src_size - stream->avail_in,
+      dest_size - stream->avail_out);
+    return -EIO;
+  }
+  return 0;
+}
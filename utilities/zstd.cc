@@ -26,7 +26,21 @@
 #include "logger.h"
 
 
+/* Decompression contexts are reused by each thread and freed at thread exit */
+struct ZstdDecompressContext {
+  ZSTD_DCtx* dctx;
+
+  ZstdDecompressContext() {
+    dctx = ZSTD_createDCtx();
+    MV_ASSERT(dctx);
+  }
+  ~ZstdDecompressContext() {
+    ZSTD_freeDCtx(dctx);
+  }
+};
+
 ssize_t zstd_decompress(const void* src,  size_t src_size, void* dest, size_t dest_size) {
+  thread_local ZstdDecompressContext context;
   size_t zstd_ret = 0;
   ssize_t ret = 0;
   ZSTD_outBuffer output = {
@@ -39,8 +53,8 @@ ssize_t zstd_decompress(const void* src,  size_t src_size, void* dest, size_t de
     .size = src_size,
     .pos = 0
   };
-  ZSTD_DCtx* dctx = ZSTD_createDCtx();
-  MV_ASSERT(dctx);
+  ZSTD_DCtx* dctx = context.dctx;
+  ZSTD_DCtx_reset(dctx, ZSTD_reset_session_only);
 
   while (output.pos < output.size) {
     size_t last_in_pos = input.pos;
@@ -57,6 +71,7 @@ ssize_t zstd_decompress(const void* src,  size_t src_size, void* dest, size_t de
     /* prevent infinitely waiting for input data */
     if (last_in_pos >= input.pos && last_out_pos >= output.pos) {
       ret = -EIO;
+      break;
     }
   }
   
@@ -64,6 +79,31 @@ ssize_t zstd_decompress(const void* src,  size_t src_size, void* dest, size_t de
   if (zstd_ret > 0) {
     ret = -EIO;
   }
-  ZSTD_freeDCtx(dctx);
   return ret;
 }
+
+struct ZstdCompressContext {
+  ZSTD_CCtx* cctx;
+
+  ZstdCompressContext() {
+    cctx = ZSTD_createCCtx();
+    MV_ASSERT(cctx);
+  }
+  ~ZstdCompressContext() {
+    ZSTD_freeCCtx(cctx);
+  }
+};
+
+/* Return the compressed size, or -ENOSPC if the result doesn't fit in dest */
+ssize_t zstd_compress(const void* src, size_t src_size, void* dest, size_t dest_size, int level) {
+  thread_local ZstdCompressContext context;
+  size_t zstd_ret = ZSTD_compressCCtx(context.cctx, dest, dest_size, src, src_size, level);
+  if (ZSTD_isError(zstd_ret)) {
+    if (ZSTD_getErrorCode(zstd_ret) == ZSTD_error_dstSize_tooSmall) {
+      return -ENOSPC;
+    }
+    MV_ERROR("ZSTD compress error: %s", ZSTD_getErrorString(ZSTD_getErrorCode(zstd_ret)));
+    return -EIO;
+  }
+  return zstd_ret;
+}